@@ -0,0 +1,636 @@
+// For clock_gettime and pthread_cond_timedwait
+#define _POSIX_C_SOURCE 200809L
+
+#include "bcache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "copy.h"
+#include "simple-fs.h"
+#include "vcb.h"
+#include "volume.h"
+
+// Mounted volume, owned by simple-fs.c
+extern struct vcb *vcb;
+
+/* Cache of file data blocks for volumes mounted with mount_fs_cached(). The
+ * blocks are read from the image file into a fixed set of buffers and written
+ * back with pwrite(), so only the buffers take memory however large the
+ * volume is. Metadata, including the first block of every file, stays in
+ * place on the mapped volume.
+ * A buffer is pinned while a caller copies in or out of it and is never
+ * replaced meanwhile. Unpinned buffers are replaced with the CLOCK algorithm:
+ * the hand skips buffers used since it last passed and clears their bit. A
+ * flusher thread writes dirty buffers back once enough of them are dirty, and
+ * every BCACHE_WRITEBACK_MS otherwise, so replacing a buffer rarely has to.
+ * Writers that find too many buffers dirty write their own back first.
+ * Copies go through the buffers one block at a time with memcpy(), so the
+ * streaming kernels of copy_bytes() are not used for cached data, and every
+ * block copied takes the cache lock twice, to pin and to unpin its buffer.
+ * That includes lock-free reads of cached files.
+ * A block that cannot be read from the image is not cached, and a dirty
+ * buffer that cannot be written back stays dirty. Either way the access
+ * functions fail rather than the process.
+ * Without a cache the access functions below work on raw_blocks directly.
+ */
+
+#define BUF_DIRTY 0x01
+#define BUF_LOADING 0x02
+#define BUF_WRITING 0x04
+#define BUF_HASHED 0x08
+
+// A block held in memory. Buffers loading or being written back are pinned by
+// the thread doing the I/O. Dirty buffers being written back stay in the hash
+// table until the write is done, so a freed block is never written over its
+// next owner.
+struct bcache_buf {
+	size_t block;
+	char *data;
+	unsigned int pins;
+	unsigned int flags;
+	// Set on every use, cleared by the clock hand
+	int referenced;
+	// Next buffer in the same hash bucket
+	struct bcache_buf *next;
+};
+
+enum bcache_op {
+	BCACHE_READ,
+	BCACHE_WRITE,
+	BCACHE_ZERO,
+};
+
+static struct bcache_buf *bufs = NULL;
+static size_t nbufs = 0;
+static char *buf_data = NULL;
+static struct bcache_buf **buckets = NULL;
+static size_t nbuckets = 0;
+static size_t clock_hand = 0;
+static size_t dirty_bufs = 0;
+static size_t dirty_background;
+static size_t dirty_limit;
+static size_t cache_block_size;
+static int cache_fd = -1;
+static pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a buffer is unpinned or done loading or writing back
+static pthread_cond_t bcache_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher_tid;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static int flusher_running = 0;
+
+static int bcache_access(size_t block, size_t offset, char *buf, size_t len,
+			 enum bcache_op op);
+static int buf_fetch(size_t block, size_t offset, char *buf, size_t len);
+static struct bcache_buf *buf_get(size_t block, int load);
+static void buf_put(struct bcache_buf *buf, int dirty);
+static int buf_victim(struct bcache_buf **victim);
+static int buf_writeback(struct bcache_buf *buf);
+static void buf_drop(size_t block);
+static struct bcache_buf *buf_lookup(size_t block);
+static void buf_unhash(struct bcache_buf *buf);
+static void *bcache_flusher(void *arg);
+
+/* Sets up a block cache and starts its flusher thread. The volume's file data
+ * blocks go through the cache until bcache_free() is called.
+ * @param fd: File descriptor of the volume image, from volume_open().
+ * @param block_size: The block size of the volume.
+ * @param count: The number of buffers, at least BCACHE_MIN_BLOCKS.
+ * @return: 0 on success, -1 if count is too small or too large, the buffers
+ * could not be allocated or the flusher could not be started.
+ */
+int bcache_init(int fd, size_t block_size, size_t count)
+{
+	// The dirty thresholds are percentages of count
+	if (count < BCACHE_MIN_BLOCKS || count > SIZE_MAX / block_size ||
+	    count > SIZE_MAX / 100) {
+		return -1;
+	}
+	size_t nb = 1;
+	while (nb < count)
+		nb <<= 1;
+	bufs = calloc(count, sizeof(struct bcache_buf));
+	buf_data = malloc(count * block_size);
+	buckets = calloc(nb, sizeof(struct bcache_buf *));
+	if (bufs == NULL || buf_data == NULL || buckets == NULL) {
+		free(bufs);
+		free(buf_data);
+		free(buckets);
+		bufs = NULL;
+		buf_data = NULL;
+		buckets = NULL;
+		return -1;
+	}
+	for (size_t i = 0; i < count; ++i)
+		bufs[i].data = buf_data + i * block_size;
+	nbufs = count;
+	nbuckets = nb;
+	clock_hand = 0;
+	dirty_bufs = 0;
+	dirty_background = count * BCACHE_DIRTY_BACKGROUND / 100;
+	dirty_limit = count * BCACHE_DIRTY_RATIO / 100;
+	cache_block_size = block_size;
+	cache_fd = fd;
+
+	flusher_running = 1;
+	if (pthread_create(&flusher_tid, NULL, bcache_flusher, NULL)) {
+		flusher_running = 0;
+		bcache_free();
+		return -1;
+	}
+	return 0;
+}
+
+/* Stops the flusher, writes every dirty buffer back and frees the cache. Does
+ * nothing if no cache is set up.
+ * @return: void
+ */
+void bcache_free()
+{
+	if (bufs == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	int running = flusher_running;
+	flusher_running = 0;
+	pthread_cond_signal(&flusher_cond);
+	pthread_mutex_unlock(&bcache_lock);
+	if (running)
+		pthread_join(flusher_tid, NULL);
+
+	bcache_flush();
+	free(buckets);
+	free(buf_data);
+	free(bufs);
+	buckets = NULL;
+	buf_data = NULL;
+	bufs = NULL;
+	nbufs = 0;
+	nbuckets = 0;
+	cache_fd = -1;
+}
+
+/* Returns whether file data goes through a block cache.
+ * @return: Non-zero if a cache is set up, 0 otherwise.
+ */
+int bcache_active()
+{
+	return bufs != NULL;
+}
+
+/* Writes every dirty buffer back to the image file. Returns once the writes
+ * are done, including ones other threads started.
+ * @return: 0 on success, -1 if a buffer could not be written. It stays dirty.
+ */
+int bcache_flush()
+{
+	if (bufs == NULL) {
+		return 0;
+	}
+	int res = 0;
+	pthread_mutex_lock(&bcache_lock);
+	for (size_t i = 0; i < nbufs; ++i) {
+		struct bcache_buf *buf = &bufs[i];
+		while (buf->flags & BUF_WRITING)
+			pthread_cond_wait(&bcache_cond, &bcache_lock);
+		if ((buf->flags & BUF_DIRTY) && buf_writeback(buf))
+			res = -1;
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	return res;
+}
+
+/* Drops freed blocks from the cache. Their dirty contents are thrown away
+ * rather than written over whatever the blocks are used for next. Called by
+ * the VCB whenever blocks are freed.
+ * @param start: The first freed block.
+ * @param count: The number of freed blocks.
+ * @return: void
+ */
+void bcache_discard(size_t start, size_t count)
+{
+	if (bufs == NULL || count == 0) {
+		return;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	if (count > nbufs) {
+		// Cheaper to look at every buffer than at every block
+		for (size_t i = 0; i < nbufs; ++i) {
+			struct bcache_buf *buf = &bufs[i];
+			if ((buf->flags & BUF_HASHED) && buf->block >= start &&
+			    buf->block - start < count)
+				buf_drop(buf->block);
+		}
+	} else {
+		for (size_t i = 0; i < count; ++i)
+			buf_drop(start + i);
+	}
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+/* Copies bytes out of a run of file data blocks.
+ * @param block: The first block of the run.
+ * @param offset: The offset of the bytes in the run.
+ * @param buf: The buffer to copy to.
+ * @param len: The number of bytes.
+ * @return: 0 on success, -1 if a block could not be read from the image.
+ */
+int bcache_read(size_t block, size_t offset, void *buf, size_t len)
+{
+	if (bufs == NULL) {
+		copy_bytes(buf, raw_blocks + block * vcb->block_size + offset,
+			   len);
+		return 0;
+	}
+	return bcache_access(block, offset, buf, len, BCACHE_READ);
+}
+
+/* Copies bytes into a run of file data blocks.
+ * @param block: The first block of the run.
+ * @param offset: The offset of the bytes in the run.
+ * @param buf: The bytes to copy.
+ * @param len: The number of bytes.
+ * @return: 0 on success, -1 if a partly written block could not be read from
+ * the image. The blocks before it are written.
+ */
+int bcache_write(size_t block, size_t offset, const void *buf, size_t len)
+{
+	if (bufs == NULL) {
+		copy_bytes(raw_blocks + block * vcb->block_size + offset, buf,
+			   len);
+		return 0;
+	}
+	return bcache_access(block, offset, (char *)buf, len, BCACHE_WRITE);
+}
+
+/* Zeroes bytes of a run of file data blocks.
+ * @param block: The first block of the run.
+ * @param offset: The offset of the bytes in the run.
+ * @param len: The number of bytes.
+ * @return: 0 on success, -1 if a partly zeroed block could not be read from
+ * the image. The blocks before it are zeroed.
+ */
+int bcache_zero(size_t block, size_t offset, size_t len)
+{
+	if (bufs == NULL) {
+		memset(raw_blocks + block * vcb->block_size + offset, 0, len);
+		return 0;
+	}
+	return bcache_access(block, offset, NULL, len, BCACHE_ZERO);
+}
+
+/* Copies bytes from one run of file data blocks to another. Only the
+ * destination's buffers are pinned, source blocks that are not cached are read
+ * from the image straight into them. The bytes of the runs must not overlap.
+ * @param to: The first block of the run to copy to.
+ * @param to_offset: The offset of the bytes in that run.
+ * @param from: The first block of the run to copy from.
+ * @param from_offset: The offset of the bytes in that run.
+ * @param len: The number of bytes.
+ * @return: 0 on success, -1 if a block could not be read from the image. The
+ * destination bytes from that block on are undefined.
+ */
+int bcache_copy(size_t to, size_t to_offset, size_t from, size_t from_offset,
+		size_t len)
+{
+	if (bufs == NULL) {
+		size_t block_size = vcb->block_size;
+		copy_bytes(raw_blocks + to * block_size + to_offset,
+			   raw_blocks + from * block_size + from_offset, len);
+		return 0;
+	}
+	to += to_offset / cache_block_size;
+	to_offset %= cache_block_size;
+	from += from_offset / cache_block_size;
+	from_offset %= cache_block_size;
+	while (len > 0) {
+		size_t n = cache_block_size - to_offset;
+		if (n > cache_block_size - from_offset)
+			n = cache_block_size - from_offset;
+		if (n > len)
+			n = len;
+		struct bcache_buf *dst = buf_get(to, n != cache_block_size);
+		if (dst == NULL)
+			return -1;
+		int res = buf_fetch(from, from_offset, dst->data + to_offset, n);
+		// Even a failed copy may have changed the buffer
+		buf_put(dst, 1);
+		if (res)
+			return -1;
+		to_offset += n;
+		if (to_offset == cache_block_size) {
+			to_offset = 0;
+			++to;
+		}
+		from_offset += n;
+		if (from_offset == cache_block_size) {
+			from_offset = 0;
+			++from;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/* Copies bytes between a buffer and a run of blocks in the cache, one block
+ * at a time. Blocks that are overwritten whole are not read first.
+ * @param block: The first block of the run.
+ * @param offset: The offset of the bytes in the run.
+ * @param buf: The buffer to copy to or from, unused for BCACHE_ZERO.
+ * @param len: The number of bytes.
+ * @param op: What to do with the bytes.
+ * @return: 0 on success, -1 if a block could not be read from the image.
+ */
+static int bcache_access(size_t block, size_t offset, char *buf, size_t len,
+			 enum bcache_op op)
+{
+	block += offset / cache_block_size;
+	offset %= cache_block_size;
+	while (len > 0) {
+		size_t n = cache_block_size - offset;
+		if (n > len)
+			n = len;
+		int whole = op != BCACHE_READ && n == cache_block_size;
+		struct bcache_buf *b = buf_get(block, !whole);
+		if (b == NULL)
+			return -1;
+		if (op == BCACHE_READ)
+			memcpy(buf, b->data + offset, n);
+		else if (op == BCACHE_WRITE)
+			memcpy(b->data + offset, buf, n);
+		else
+			memset(b->data + offset, 0, n);
+		buf_put(b, op != BCACHE_READ);
+		if (buf != NULL)
+			buf += n;
+		len -= n;
+		offset = 0;
+		++block;
+	}
+	return 0;
+}
+
+/* Copies bytes of a block out of its buffer if it is cached, otherwise
+ * straight from the image. A block that is not cached was written back before
+ * its buffer was replaced, so the image holds its latest contents. The block
+ * is pinned only if it is cached, which never waits for a buffer to free up.
+ * @param block: The block number.
+ * @param offset: The offset of the bytes in the block.
+ * @param buf: The buffer to copy to.
+ * @param len: The number of bytes.
+ * @return: 0 on success, -1 if the block could not be read from the image.
+ */
+static int buf_fetch(size_t block, size_t offset, char *buf, size_t len)
+{
+	pthread_mutex_lock(&bcache_lock);
+	struct bcache_buf *src;
+	while ((src = buf_lookup(block)) != NULL && (src->flags & BUF_LOADING))
+		pthread_cond_wait(&bcache_cond, &bcache_lock);
+	if (src != NULL)
+		++src->pins;
+	pthread_mutex_unlock(&bcache_lock);
+	if (src == NULL)
+		return volume_read(cache_fd, buf, len,
+				   block * cache_block_size + offset);
+	memcpy(buf, src->data + offset, len);
+	buf_put(src, 0);
+	return 0;
+}
+
+/* Pins the buffer holding a block, replacing another buffer if the block is
+ * not cached.
+ * @param block: The block number.
+ * @param load: Non-zero to read the block from the image if it is not cached,
+ * 0 if the caller overwrites the whole block.
+ * @return: The pinned buffer, or NULL if the block could not be read or every
+ * buffer that could be replaced is dirty and could not be written back.
+ */
+static struct bcache_buf *buf_get(size_t block, int load)
+{
+	size_t failed = 0;
+	pthread_mutex_lock(&bcache_lock);
+	for (;;) {
+		struct bcache_buf *buf = buf_lookup(block);
+		if (buf != NULL) {
+			if (buf->flags & BUF_LOADING) {
+				pthread_cond_wait(&bcache_cond, &bcache_lock);
+				continue;
+			}
+			++buf->pins;
+			buf->referenced = 1;
+			pthread_mutex_unlock(&bcache_lock);
+			return buf;
+		}
+		int res = buf_victim(&buf);
+		if (res < 0) {
+			// Every buffer is pinned
+			pthread_cond_wait(&bcache_cond, &bcache_lock);
+			continue;
+		} else if (res > 1 && ++failed >= nbufs) {
+			pthread_mutex_unlock(&bcache_lock);
+			return NULL;
+		} else if (res > 0) {
+			// The lock was dropped, the block may be cached now
+			continue;
+		}
+
+		if (buf->flags & BUF_HASHED)
+			buf_unhash(buf);
+		size_t bucket = block & (nbuckets - 1);
+		buf->block = block;
+		buf->pins = 1;
+		buf->referenced = 1;
+		buf->flags = BUF_HASHED | (load ? BUF_LOADING : 0);
+		buf->next = buckets[bucket];
+		buckets[bucket] = buf;
+		if (!load) {
+			pthread_mutex_unlock(&bcache_lock);
+			return buf;
+		}
+		pthread_mutex_unlock(&bcache_lock);
+
+		int err = volume_read(cache_fd, buf->data, cache_block_size,
+				      block * cache_block_size);
+
+		pthread_mutex_lock(&bcache_lock);
+		buf->flags &= ~BUF_LOADING;
+		if (err) {
+			// Threads waiting for the block try to read it
+			// themselves
+			if (buf->flags & BUF_HASHED)
+				buf_unhash(buf);
+			--buf->pins;
+			buf->referenced = 0;
+			buf = NULL;
+		}
+		pthread_cond_broadcast(&bcache_cond);
+		pthread_mutex_unlock(&bcache_lock);
+		return buf;
+	}
+}
+
+/* Unpins a buffer. A writer that finds more than dirty_limit buffers dirty
+ * writes its buffer back itself, otherwise the flusher is woken once
+ * dirty_background buffers are dirty.
+ * @param buf: The buffer.
+ * @param dirty: Non-zero if the buffer was written.
+ * @return: void
+ */
+static void buf_put(struct bcache_buf *buf, int dirty)
+{
+	pthread_mutex_lock(&bcache_lock);
+	// Buffers of discarded blocks are not written back
+	if (dirty && (buf->flags & (BUF_HASHED | BUF_DIRTY)) == BUF_HASHED) {
+		buf->flags |= BUF_DIRTY;
+		++dirty_bufs;
+	}
+	if (dirty && dirty_bufs > dirty_limit &&
+	    (buf->flags & (BUF_DIRTY | BUF_WRITING)) == BUF_DIRTY)
+		buf_writeback(buf);
+	else if (dirty && dirty_bufs >= dirty_background)
+		pthread_cond_signal(&flusher_cond);
+	if (--buf->pins == 0)
+		pthread_cond_broadcast(&bcache_cond);
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+/* Finds a buffer to replace with the clock hand. A dirty buffer the hand
+ * stops at is written back first. Caller must hold the cache lock.
+ * @param victim: Set to the buffer to replace.
+ * @return: 0 if a buffer was found, 1 if a buffer was written back and the
+ * lock dropped meanwhile, 2 if the write back failed, which leaves the buffer
+ * dirty and the hand past it, -1 if every buffer is pinned.
+ */
+static int buf_victim(struct bcache_buf **victim)
+{
+	// Two turns clear every referenced bit
+	for (size_t i = 0; i < 2 * nbufs; ++i) {
+		struct bcache_buf *buf = &bufs[clock_hand];
+		clock_hand = (clock_hand + 1) % nbufs;
+		if (buf->pins)
+			continue;
+		if (buf->referenced) {
+			buf->referenced = 0;
+			continue;
+		}
+		if (buf->flags & BUF_DIRTY)
+			return buf_writeback(buf) ? 2 : 1;
+		*victim = buf;
+		return 0;
+	}
+	return -1;
+}
+
+/* Writes a dirty buffer back to the image. The buffer is clean while the
+ * write is in flight, so a write to it meanwhile dirties it again. Caller
+ * must hold the cache lock, it is dropped during the write.
+ * @param buf: The buffer, dirty and not being written back already.
+ * @return: 0 on success, -1 if the write failed. The buffer stays dirty.
+ */
+static int buf_writeback(struct bcache_buf *buf)
+{
+	buf->flags = (buf->flags & ~BUF_DIRTY) | BUF_WRITING;
+	--dirty_bufs;
+	++buf->pins;
+	size_t block = buf->block;
+	pthread_mutex_unlock(&bcache_lock);
+
+	int res = volume_write(cache_fd, buf->data, cache_block_size,
+			       block * cache_block_size);
+
+	pthread_mutex_lock(&bcache_lock);
+	buf->flags &= ~BUF_WRITING;
+	if (res && !(buf->flags & BUF_DIRTY)) {
+		buf->flags |= BUF_DIRTY;
+		++dirty_bufs;
+	}
+	--buf->pins;
+	pthread_cond_broadcast(&bcache_cond);
+	return res;
+}
+
+/* Removes a block from the cache, waiting for a write back of it to finish.
+ * Caller must hold the cache lock.
+ * @param block: The block number.
+ * @return: void
+ */
+static void buf_drop(size_t block)
+{
+	struct bcache_buf *buf;
+	while ((buf = buf_lookup(block)) != NULL &&
+	       (buf->flags & BUF_WRITING))
+		pthread_cond_wait(&bcache_cond, &bcache_lock);
+	if (buf == NULL)
+		return;
+	if (buf->flags & BUF_DIRTY)
+		--dirty_bufs;
+	buf_unhash(buf);
+	buf->flags &= ~BUF_DIRTY;
+	buf->referenced = 0;
+}
+
+/* Looks up the buffer holding a block. Caller must hold the cache lock.
+ * @param block: The block number.
+ * @return: The buffer, or NULL if the block is not cached.
+ */
+static struct bcache_buf *buf_lookup(size_t block)
+{
+	struct bcache_buf *buf = buckets[block & (nbuckets - 1)];
+	while (buf != NULL && buf->block != block)
+		buf = buf->next;
+	return buf;
+}
+
+/* Takes a buffer out of the hash table. Caller must hold the cache lock.
+ * @param buf: The buffer.
+ * @return: void
+ */
+static void buf_unhash(struct bcache_buf *buf)
+{
+	struct bcache_buf **link = &buckets[buf->block & (nbuckets - 1)];
+	while (*link != buf)
+		link = &(*link)->next;
+	*link = buf->next;
+	buf->next = NULL;
+	buf->flags &= ~BUF_HASHED;
+}
+
+/* Body of the flusher thread. Writes every dirty buffer back whenever
+ * dirty_background buffers are dirty or BCACHE_WRITEBACK_MS have passed.
+ * Runs until bcache_free() is called.
+ * @param arg: Unused.
+ * @return: NULL
+ */
+static void *bcache_flusher(void *arg)
+{
+	pthread_mutex_lock(&bcache_lock);
+	while (flusher_running) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += BCACHE_WRITEBACK_MS / 1000;
+		until.tv_nsec += (BCACHE_WRITEBACK_MS % 1000) * 1000000L;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		while (flusher_running && dirty_bufs < dirty_background) {
+			if (pthread_cond_timedwait(&flusher_cond, &bcache_lock,
+						   &until) == ETIMEDOUT)
+				break;
+		}
+		for (size_t i = 0; i < nbufs && flusher_running; ++i) {
+			struct bcache_buf *buf = &bufs[i];
+			// Failed writes are retried on the next round
+			if ((buf->flags & (BUF_DIRTY | BUF_WRITING)) ==
+			    BUF_DIRTY)
+				buf_writeback(buf);
+		}
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	return NULL;
+}
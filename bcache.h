@@ -0,0 +1,35 @@
+#ifndef SIMPLE_FS_BCACHE_H
+#define SIMPLE_FS_BCACHE_H
+
+#include <stddef.h>
+
+// Smallest number of buffers a block cache can have
+#define BCACHE_MIN_BLOCKS 16
+// The flusher starts writing back once this percentage of the buffers is
+// dirty, and writes back whatever is dirty at least every BCACHE_WRITEBACK_MS
+#define BCACHE_DIRTY_BACKGROUND 10
+#define BCACHE_WRITEBACK_MS 1000
+// Past this percentage of dirty buffers, writers write their own buffers back
+// before they return
+#define BCACHE_DIRTY_RATIO 40
+
+int bcache_init(int fd, size_t block_size, size_t count);
+
+void bcache_free();
+
+int bcache_active();
+
+int bcache_flush();
+
+void bcache_discard(size_t start, size_t count);
+
+int bcache_read(size_t block, size_t offset, void *buf, size_t len);
+
+int bcache_write(size_t block, size_t offset, const void *buf, size_t len);
+
+int bcache_zero(size_t block, size_t offset, size_t len);
+
+int bcache_copy(size_t to, size_t to_offset, size_t from, size_t from_offset,
+		size_t len);
+
+#endif // SIMPLE_FS_BCACHE_H
@@ -0,0 +1,126 @@
+// For clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
+#include "simple-fs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "copy.h"
+
+/* Throughput benchmark for the copy engine. First compares memcpy() with
+ * copy_bytes() for a range of sizes, then measures pwrite() and pread() of a
+ * large file. Copies walk a region larger than the cache, so every copy
+ * starts cold like a bulk transfer does.
+ */
+
+// Bytes covered by the copies of one measurement
+#define BENCH_REGION (512UL << 20)
+// Bytes copied per measurement
+#define BENCH_BYTES (4UL << 30)
+// Volume for the file benchmark, 1MiB blocks
+#define BENCH_BLOCK_SIZE (1UL << 20)
+#define BENCH_BLOCK_COUNT 640
+
+static double now();
+static double bench_copy(void (*copy)(void *, const void *, size_t),
+			 char *dst, const char *src, size_t size);
+static void copy_libc(void *dst, const void *src, size_t n);
+
+int main()
+{
+	char *src = malloc(BENCH_REGION);
+	char *dst = malloc(BENCH_REGION);
+	if (src == NULL || dst == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(src, 1, BENCH_REGION);
+	memset(dst, 2, BENCH_REGION);
+	copy_init();
+
+	printf("Copy (GB/s), large copies use %s\n", copy_kernel());
+	printf("%10s %10s %12s %8s\n", "size", "memcpy", "copy_bytes", "gain");
+	for (size_t size = 64UL << 10; size <= 64UL << 20; size *= 4) {
+		double base = bench_copy(copy_libc, dst, src, size);
+		double engine = bench_copy(copy_bytes, dst, src, size);
+		printf("%8zuKiB %10.2f %12.2f %7.2fx\n", size >> 10, base,
+		       engine, engine / base);
+	}
+	free(src);
+	free(dst);
+
+	if (init_fs(BENCH_BLOCK_SIZE, BENCH_BLOCK_COUNT)) {
+		printf("Failed to set up the volume\n");
+		return 1;
+	}
+	size_t file_bytes = 512UL << 20;
+	create("/bench", file_bytes / BENCH_BLOCK_SIZE + 1);
+	int fd = open("/bench", 0);
+	off_t data = lseek(fd, 0, SFS_SEEK_SET);
+	size_t chunk = 16UL << 20;
+	char *buf = malloc(chunk);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(buf, 3, chunk);
+
+	printf("\nFile I/O (GB/s), %zuMiB per call\n", chunk >> 20);
+	double start = now();
+	for (size_t done = 0; done < BENCH_BYTES; done += chunk)
+		pwrite(fd, buf, chunk, data + done % file_bytes);
+	printf("%10s %10.2f\n", "pwrite", BENCH_BYTES / (now() - start) / 1e9);
+	start = now();
+	for (size_t done = 0; done < BENCH_BYTES; done += chunk)
+		pread(fd, buf, chunk, data + done % file_bytes);
+	printf("%10s %10.2f\n", "pread", BENCH_BYTES / (now() - start) / 1e9);
+
+	free(buf);
+	close(fd);
+	close_fs();
+	return 0;
+}
+
+/* Returns the time in seconds.
+ * @return: Seconds on the monotonic clock.
+ */
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Measures the throughput of a copy function.
+ * @param copy: The copy function.
+ * @param dst: Region to copy to, BENCH_REGION bytes.
+ * @param src: Region to copy from, BENCH_REGION bytes.
+ * @param size: The size of each copy.
+ * @return: Throughput in GB/s.
+ */
+static double bench_copy(void (*copy)(void *, const void *, size_t),
+			 char *dst, const char *src, size_t size)
+{
+	size_t slots = BENCH_REGION / size;
+	size_t reps = BENCH_BYTES / size;
+	double start = now();
+	for (size_t i = 0; i < reps; ++i) {
+		size_t off = (i % slots) * size;
+		copy(dst + off, src + off, size);
+	}
+	return reps * size / (now() - start) / 1e9;
+}
+
+/* memcpy() with the signature of copy_bytes().
+ * @param dst: The buffer to copy to.
+ * @param src: The buffer to copy from.
+ * @param n: The number of bytes to copy.
+ * @return: void
+ */
+static void copy_libc(void *dst, const void *src, size_t n)
+{
+	memcpy(dst, src, n);
+}
@@ -0,0 +1,143 @@
+#include "copy.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COPY_X86
+#endif
+
+/* Copy engine for file data. Callers hand it whole runs of contiguous blocks,
+ * so copies are either small or large. Copies below COPY_STREAM_MIN go to
+ * memcpy(). Larger ones go to a streaming kernel picked for the CPU by
+ * copy_init(): loads are unaligned, stores are aligned non-temporal stores
+ * followed by a store fence, so the data is visible to other threads when
+ * copy_bytes() returns. Until copy_init() runs every copy uses memcpy().
+ */
+struct copy_kernel {
+	const char *name;
+	void (*copy)(char *dst, const char *src, size_t n);
+};
+
+static void copy_memcpy(char *dst, const char *src, size_t n);
+#ifdef COPY_X86
+static void copy_stream_avx2(char *dst, const char *src, size_t n);
+static void copy_stream_avx512(char *dst, const char *src, size_t n);
+#endif
+
+static struct copy_kernel large = { "memcpy", copy_memcpy };
+
+/* Picks the kernel used for large copies from the features of the CPU.
+ * @return: void
+ */
+void copy_init()
+{
+#ifdef COPY_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		large.name = "avx512-stream";
+		large.copy = copy_stream_avx512;
+		return;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		large.name = "avx2-stream";
+		large.copy = copy_stream_avx2;
+		return;
+	}
+#endif
+	large.name = "memcpy";
+	large.copy = copy_memcpy;
+}
+
+/* Copies n bytes between buffers that do not overlap, like memcpy().
+ * @param dst: The buffer to copy to.
+ * @param src: The buffer to copy from.
+ * @param n: The number of bytes to copy.
+ * @return: void
+ */
+void copy_bytes(void *dst, const void *src, size_t n)
+{
+	if (n < COPY_STREAM_MIN)
+		memcpy(dst, src, n);
+	else
+		large.copy(dst, src, n);
+}
+
+/* Returns the name of the kernel used for large copies.
+ * @return: The name, such as "avx2-stream".
+ */
+const char *copy_kernel()
+{
+	return large.name;
+}
+
+/* Kernel for CPUs without a streaming kernel.
+ * @param dst: The buffer to copy to.
+ * @param src: The buffer to copy from.
+ * @param n: The number of bytes to copy.
+ * @return: void
+ */
+static void copy_memcpy(char *dst, const char *src, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+#ifdef COPY_X86
+/* Streams a copy with 32-byte AVX2 stores, 128 bytes per iteration.
+ * @param dst: The buffer to copy to.
+ * @param src: The buffer to copy from.
+ * @param n: The number of bytes to copy, at least 32.
+ * @return: void
+ */
+__attribute__((target("avx2"))) static void
+copy_stream_avx2(char *dst, const char *src, size_t n)
+{
+	// Non-temporal stores must be aligned, the loads need not be
+	size_t head = -(uintptr_t)dst & 31;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	n -= head;
+	for (; n >= 128; n -= 128, src += 128, dst += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)src);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(src + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(src + 96));
+		_mm256_stream_si256((__m256i *)dst, a);
+		_mm256_stream_si256((__m256i *)(dst + 32), b);
+		_mm256_stream_si256((__m256i *)(dst + 64), c);
+		_mm256_stream_si256((__m256i *)(dst + 96), d);
+	}
+	_mm_sfence();
+	memcpy(dst, src, n);
+}
+
+/* Streams a copy with 64-byte AVX-512 stores, 256 bytes per iteration.
+ * @param dst: The buffer to copy to.
+ * @param src: The buffer to copy from.
+ * @param n: The number of bytes to copy, at least 64.
+ * @return: void
+ */
+__attribute__((target("avx512f"))) static void
+copy_stream_avx512(char *dst, const char *src, size_t n)
+{
+	size_t head = -(uintptr_t)dst & 63;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	n -= head;
+	for (; n >= 256; n -= 256, src += 256, dst += 256) {
+		__m512i a = _mm512_loadu_si512(src);
+		__m512i b = _mm512_loadu_si512(src + 64);
+		__m512i c = _mm512_loadu_si512(src + 128);
+		__m512i d = _mm512_loadu_si512(src + 192);
+		_mm512_stream_si512((void *)dst, a);
+		_mm512_stream_si512((void *)(dst + 64), b);
+		_mm512_stream_si512((void *)(dst + 128), c);
+		_mm512_stream_si512((void *)(dst + 192), d);
+	}
+	_mm_sfence();
+	memcpy(dst, src, n);
+}
+#endif
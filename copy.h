@@ -0,0 +1,18 @@
+#ifndef SIMPLE_FS_COPY_H
+#define SIMPLE_FS_COPY_H
+
+#include <stddef.h>
+
+// Copies of at least this many bytes use non-temporal stores, which go around
+// the cache so a large transfer does not evict the caller's working set.
+// Smaller copies are left to memcpy(), which is faster while the data fits in
+// the cache.
+#define COPY_STREAM_MIN (2UL << 20)
+
+void copy_init();
+
+void copy_bytes(void *dst, const void *src, size_t n);
+
+const char *copy_kernel();
+
+#endif // SIMPLE_FS_COPY_H
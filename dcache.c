@@ -0,0 +1,85 @@
+#include "dcache.h"
+
+#include <string.h>
+
+/* In-memory cache of path components. Maps a (parent directory, name) pair to
+ * the name's dentry, so path lookups skip the parent's dentry table. Parents
+ * are identified by the first block of their directory. The cache is direct
+ * mapped: each pair has a single slot, and a newer pair hashing to the same
+ * slot replaces the old one.
+ * Callers must hold the dentry table lock.
+ */
+struct dcache_entry {
+	size_t parent;
+	char name[MAX_FILE_NAME_LEN];
+	// NULL when the slot is empty
+	struct dentry *dentry;
+};
+
+static struct dcache_entry dcache[DCACHE_SLOTS];
+
+static struct dcache_entry *dcache_slot(size_t parent, const char *name);
+
+/* Empties the dentry cache. Called when a volume is set up, since cached
+ * dentries point into the volume.
+ * @return: void
+ */
+void dcache_init()
+{
+	memset(dcache, 0, sizeof(dcache));
+}
+
+/* Looks up a path component in the cache.
+ * @param parent: First block of the parent directory.
+ * @param name: Name of the component.
+ * @return: The dentry, or NULL if the pair is not cached.
+ */
+struct dentry *dcache_get(size_t parent, const char *name)
+{
+	struct dcache_entry *slot = dcache_slot(parent, name);
+	if (slot->dentry == NULL || slot->parent != parent ||
+	    strncmp(slot->name, name, MAX_FILE_NAME_LEN) != 0)
+		return NULL;
+	return slot->dentry;
+}
+
+/* Caches a path component, replacing whatever was in its slot.
+ * @param parent: First block of the parent directory.
+ * @param name: Name of the component.
+ * @param dentry: The component's dentry.
+ * @return: void
+ */
+void dcache_put(size_t parent, const char *name, struct dentry *dentry)
+{
+	struct dcache_entry *slot = dcache_slot(parent, name);
+	slot->parent = parent;
+	strncpy(slot->name, name, MAX_FILE_NAME_LEN);
+	slot->dentry = dentry;
+}
+
+/* Drops a path component from the cache. Must be called before its dentry is
+ * removed or moved.
+ * @param parent: First block of the parent directory.
+ * @param name: Name of the component.
+ * @return: void
+ */
+void dcache_invalidate(size_t parent, const char *name)
+{
+	struct dcache_entry *slot = dcache_slot(parent, name);
+	if (slot->parent == parent &&
+	    strncmp(slot->name, name, MAX_FILE_NAME_LEN) == 0)
+		slot->dentry = NULL;
+}
+
+/* Returns the slot of a (parent, name) pair.
+ * @param parent: First block of the parent directory.
+ * @param name: Name of the component.
+ * @return: The slot.
+ */
+static struct dcache_entry *dcache_slot(size_t parent, const char *name)
+{
+	size_t hash = dentry_hash(name) ^ (parent * 0x9e3779b97f4a7c15UL);
+	// Fold the high bits in, the multiply pushes parent's entropy there
+	hash ^= hash >> 32;
+	return &dcache[hash & (DCACHE_SLOTS - 1)];
+}
@@ -0,0 +1,19 @@
+#ifndef SIMPLE_FS_DCACHE_H
+#define SIMPLE_FS_DCACHE_H
+
+#include <stddef.h>
+
+#include "dir.h"
+
+// Number of slots in the dentry cache, must be a power of 2
+#define DCACHE_SLOTS 4096
+
+void dcache_init();
+
+struct dentry *dcache_get(size_t parent, const char *name);
+
+void dcache_put(size_t parent, const char *name, struct dentry *dentry);
+
+void dcache_invalidate(size_t parent, const char *name);
+
+#endif // SIMPLE_FS_DCACHE_H
@@ -0,0 +1,210 @@
+// For pthread_rwlock_t
+#define _POSIX_C_SOURCE 200809L
+
+#include "defrag.h"
+
+#include "bcache.h"
+#include "copy.h"
+#include "fcb.h"
+#include "open-ft.h"
+#include "simple-fs.h"
+#include "vcb.h"
+
+// Mounted volume, owned by simple-fs.c
+extern struct vcb *vcb;
+
+/* Compaction moves files towards the start of the volume so free space
+ * coalesces at the end, and gathers files made of several extents into one.
+ * Each step moves at most one file, so callers can hold the file system
+ * locks for one step at a time and let reads and writes in between.
+ * Directories are never moved, the dentry cache identifies them by their
+ * first block.
+ */
+
+static int defrag_table(struct dentry_table *table, size_t max_blocks);
+static int defrag_file(struct dentry *dentry, size_t max_blocks);
+static int defrag_packed(struct fcb *fcb, size_t *runs);
+static inline char *block_ptr(size_t block_num);
+
+/* Moves one file of a directory tree to a better place on the volume. A file
+ * is moved when a free run that holds all of it starts below its first block,
+ * or when it is made of several extents and any free run holds it. Caller
+ * must hold every file system lock.
+ * @param table: The dentry table of the directory to start from, usually the
+ * root.
+ * @param max_blocks: Files larger than this are left alone, which bounds the
+ * time spent in one step.
+ * @return: 1 if a file was moved, 0 if no file can be moved.
+ */
+int defrag_step(struct dentry_table *table, size_t max_blocks)
+{
+	return defrag_table(table, max_blocks);
+}
+
+/* Moves the first file that can be moved in a directory or the directories
+ * under it.
+ * @param table: The dentry table of the directory.
+ * @param max_blocks: Files larger than this are left alone.
+ * @return: 1 if a file was moved, 0 otherwise.
+ */
+static int defrag_table(struct dentry_table *table, size_t max_blocks)
+{
+	for (size_t i = 0; i < table->used; ++i) {
+		struct dentry *entry = &table->entries[i];
+		// Slots freed by dentry_remove() have no name
+		if (entry->file_name[0] == '\0')
+			continue;
+		if (entry->type == DENTRY_DIR) {
+			struct dentry_table *dir = (struct dentry_table *)(
+				block_ptr(entry->start_block_num) +
+				sizeof(struct fcb));
+			if (defrag_table(dir, max_blocks))
+				return 1;
+		} else if (defrag_file(entry, max_blocks)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Moves a file to the lowest free run that holds all of its blocks, if that
+ * improves its placement. The file's data is copied, then its dentry and any
+ * open file entry are pointed at the new FCB before the old blocks are freed.
+ * Holes stay holes, the blocks between them are packed into the run.
+ * @param dentry: The dentry of the file.
+ * @param max_blocks: Files larger than this are left alone.
+ * @return: 1 if the file was moved, 0 otherwise, including when a cached
+ * volume's image could not be read.
+ */
+static int defrag_file(struct dentry *dentry, size_t max_blocks)
+{
+	struct fcb *fcb = (struct fcb *)block_ptr(dentry->start_block_num);
+	size_t blocks = fcb_blocks(fcb);
+	if (blocks > max_blocks)
+		return 0;
+	// The moved file's extents must fit in its FCB
+	size_t runs;
+	int packed = defrag_packed(fcb, &runs);
+	if (runs > FCB_INLINE_EXTENTS)
+		return 0;
+	size_t start;
+	if (vcb_find_free(vcb, blocks, &start))
+		return 0;
+	if (packed && start > dentry->start_block_num)
+		return 0;
+	// Moving a clone would give it its own copy of the blocks it shares
+	if (fcb_shared(fcb, 0, fcb->file_size))
+		return 0;
+	// Skip files being read or written rather than wait for them with
+	// every lock held. Their size only changes under the VCB lock, so the
+	// checks above still hold.
+	struct sys_oft_entry *open = oft_lookup(dentry);
+	if (open != NULL && pthread_rwlock_trywrlock(&open->lock)) {
+		oft_put(open);
+		return 0;
+	}
+	// Mapped files stay where they are until they are unmapped
+	if (open != NULL && atomic_load(&open->maps)) {
+		pthread_rwlock_unlock(&open->lock);
+		oft_put(open);
+		return 0;
+	}
+	if (open != NULL)
+		oft_write_begin(open);
+
+	vcb_set_range_free(vcb, start, blocks, 0);
+	size_t lblk = 0;
+	size_t copied = 0;
+	int err = 0;
+	while (lblk < fcb->file_size && !err) {
+		size_t pblk, count;
+		if (fcb_map(fcb, lblk, &pblk, &count)) {
+			size_t hole = fcb_hole(fcb, lblk);
+			if (hole >= fcb->file_size - lblk)
+				break;
+			lblk += hole;
+			continue;
+		}
+		// Only the first block, which holds the FCB, is used in place
+		if (lblk == 0) {
+			copy_bytes(block_ptr(start), block_ptr(pblk),
+				   vcb->block_size);
+			err = bcache_copy(start + 1, 0, pblk + 1, 0,
+					  (count - 1) * vcb->block_size);
+		} else {
+			err = bcache_copy(start + copied, 0, pblk, 0,
+					  count * vcb->block_size);
+		}
+		lblk += count;
+		copied += count;
+	}
+	if (err) {
+		// The file stays where it was, with its data intact
+		vcb_set_range_free(vcb, start, blocks, 1);
+		if (open != NULL) {
+			oft_write_end(open);
+			pthread_rwlock_unlock(&open->lock);
+			oft_put(open);
+		}
+		return 0;
+	}
+
+	// The copied FCB still holds the old extents
+	struct fcb *moved = (struct fcb *)block_ptr(start);
+	fcb_relocate(moved, start);
+	dentry->start_block_num = start;
+	// Refile the open file under its new first block before the old one
+	// can be handed to another file
+	if (open != NULL)
+		oft_relocate(open, moved);
+	fcb_free_blocks(fcb);
+	if (open != NULL) {
+		oft_write_end(open);
+		pthread_rwlock_unlock(&open->lock);
+		oft_put(open);
+	}
+	return 1;
+}
+
+/* Looks at how a file's blocks are laid out.
+ * @param fcb: The FCB of the file.
+ * @param runs: Set to the number of runs of blocks between holes.
+ * @return: Non-zero if the blocks follow each other on the volume in logical
+ * order, holes aside.
+ */
+static int defrag_packed(struct fcb *fcb, size_t *runs)
+{
+	int packed = 1;
+	int after_hole = 1;
+	size_t next = 0;
+	size_t lblk = 0;
+	*runs = 0;
+	while (lblk < fcb->file_size) {
+		size_t pblk, count;
+		if (fcb_map(fcb, lblk, &pblk, &count)) {
+			size_t hole = fcb_hole(fcb, lblk);
+			if (hole >= fcb->file_size - lblk)
+				break;
+			lblk += hole;
+			after_hole = 1;
+			continue;
+		}
+		if (after_hole)
+			++*runs;
+		if (lblk > 0 && pblk != next)
+			packed = 0;
+		after_hole = 0;
+		next = pblk + count;
+		lblk += count;
+	}
+	return packed;
+}
+
+/* Returns the address of a block on the volume.
+ * @param block_num: The block number.
+ * @return: Pointer to the first byte of the block.
+ */
+static inline char *block_ptr(size_t block_num)
+{
+	return raw_blocks + block_num * vcb->block_size;
+}
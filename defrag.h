@@ -0,0 +1,10 @@
+#ifndef SIMPLE_FS_DEFRAG_H
+#define SIMPLE_FS_DEFRAG_H
+
+#include <stddef.h>
+
+#include "dir.h"
+
+int defrag_step(struct dentry_table *table, size_t max_blocks);
+
+#endif // SIMPLE_FS_DEFRAG_H
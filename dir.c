@@ -1,46 +1,220 @@
 #include "dir.h"
 #include <string.h>
 
-/* Initialize the dentry table.
+// Hash index slot values. Other values are an entries[] index plus 1.
+#define INDEX_EMPTY 0
+
+static size_t table_cap(size_t avail, size_t nbuckets);
+static uint32_t *dentry_index(struct dentry_table *table);
+static size_t index_find(struct dentry_table *table, const char *file_name,
+			 size_t *slot);
+static void index_delete(struct dentry_table *table, size_t slot);
+
+/* Initialize the dentry table. The space is split between entries[] and the
+ * hash index, which keeps at most 3/4 of its slots in use. The index size is
+ * picked to fit the most entries.
  * @param table: Table of directory entries.
- * @param nblocks: Number of blocks.
+ * @param size: Number of bytes reserved for the table, header included.
  * @return: void
  */
-void dentry_table_init(struct dentry_table *table, size_t nblocks)
+void dentry_table_init(struct dentry_table *table, size_t size)
 {
+	size_t avail = size > sizeof(struct dentry_table) ?
+			       size - sizeof(struct dentry_table) :
+			       0;
+	size_t nbuckets = 1;
+	size_t cap = 0;
+	for (size_t n = 1; n * sizeof(uint32_t) <= avail; n *= 2) {
+		if (table_cap(avail, n) > cap) {
+			nbuckets = n;
+			cap = table_cap(avail, n);
+		}
+	}
+	size_t index_size = nbuckets * sizeof(uint32_t);
+
 	table->num_entries = 0;
 	table->curr_size = sizeof(struct dentry_table);
-	table->max_size = nblocks * BLOCK_SIZE;
+	table->max_size = size;
+	table->cap = cap;
+	table->used = 0;
+	table->free_head = 0;
+	table->nbuckets = nbuckets;
+	table->index_off = size - index_size;
+	memset(dentry_index(table), 0, index_size);
+}
+
+/* Returns the number of bytes a dentry table needs to hold nentries entries.
+ * A table initialized with this size has room for at least nentries.
+ * @param nentries: The number of entries.
+ * @return: The size to pass to dentry_table_init().
+ */
+size_t dentry_table_size(size_t nentries)
+{
+	size_t nbuckets = 1;
+	while (nbuckets / 4 * 3 < nentries)
+		nbuckets *= 2;
+	return sizeof(struct dentry_table) + nentries * sizeof(struct dentry) +
+	       nbuckets * sizeof(uint32_t);
 }
 
 /* Add a new entry to the table
  * @param table: Table of directory entries.
  * @param entry: Directory entry.
- * @return: void
+ * @return: 0 on success, -1 if the table is full or already has an entry with
+ * the same file name.
  */
 int dentry_add(struct dentry_table *table, struct dentry *entry)
 {
-	// No space for dentry
-	if (table->curr_size + sizeof(struct dentry) > table->max_size) {
+	size_t slot;
+	if (index_find(table, entry->file_name, &slot) != SIZE_MAX) {
+		// Names are unique
+		return -1;
+	}
+	size_t idx;
+	if (table->free_head) {
+		// Reuse a slot freed by dentry_remove()
+		idx = table->free_head - 1;
+		table->free_head = table->entries[idx].start_block_num;
+	} else if (table->used < table->cap) {
+		idx = table->used++;
+	} else {
+		// No space for dentry
 		return -1;
 	}
 	table->curr_size += sizeof(struct dentry);
-	table->entries[table->num_entries++] = *entry;
+	table->entries[idx] = *entry;
+	dentry_index(table)[slot] = idx + 1;
+	++table->num_entries;
 	return 0;
 }
 
 /* Get a data entry from the table
  * @param table: Table of directory entries.
  * @param file_name: Name of the file to get from the table.
- * @return: Directory entry
+ * @return: Directory entry, or NULL if there is no file with that name.
  */
 struct dentry *dentry_get(struct dentry_table *table, const char *file_name)
 {
-	for (int i = 0; i < table->num_entries; ++i) {
-		if (strncmp(table->entries[i].file_name, file_name,
-			    MAX_FILE_NAME_LEN) == 0) {
-			return &table->entries[i];
+	size_t slot;
+	size_t idx = index_find(table, file_name, &slot);
+	if (idx == SIZE_MAX) {
+		return NULL;
+	}
+	return &table->entries[idx];
+}
+
+/* Remove an entry from the table. Its slot is reused by later adds, so
+ * pointers to the entry must not be used afterwards.
+ * @param table: Table of directory entries.
+ * @param file_name: Name of the file to remove from the table.
+ * @return: 0 on success, -1 if there is no file with that name.
+ */
+int dentry_remove(struct dentry_table *table, const char *file_name)
+{
+	size_t slot;
+	size_t idx = index_find(table, file_name, &slot);
+	if (idx == SIZE_MAX) {
+		return -1;
+	}
+	index_delete(table, slot);
+	memset(&table->entries[idx], 0, sizeof(struct dentry));
+	table->entries[idx].start_block_num = table->free_head;
+	table->free_head = idx + 1;
+	table->curr_size -= sizeof(struct dentry);
+	--table->num_entries;
+	return 0;
+}
+
+/* Hashes a file name with FNV-1a. Only the part of the name that fits in a
+ * dentry is hashed.
+ * @param file_name: The file name.
+ * @return: The hash.
+ */
+size_t dentry_hash(const char *file_name)
+{
+	uint64_t hash = 0xcbf29ce484222325UL;
+	for (size_t i = 0; i < MAX_FILE_NAME_LEN && file_name[i]; ++i) {
+		hash ^= (unsigned char)file_name[i];
+		hash *= 0x100000001b3UL;
+	}
+	return hash;
+}
+
+/* Returns how many entries fit in a table with a given index size.
+ * @param avail: Bytes available for entries[] and the index.
+ * @param nbuckets: Number of index slots.
+ * @return: The number of entries.
+ */
+static size_t table_cap(size_t avail, size_t nbuckets)
+{
+	size_t index_size = nbuckets * sizeof(uint32_t);
+	if (avail < index_size)
+		return 0;
+	size_t cap = (avail - index_size) / sizeof(struct dentry);
+	// Keep the index at most 3/4 full so probes stay short
+	if (cap > nbuckets / 4 * 3)
+		cap = nbuckets / 4 * 3;
+	return cap;
+}
+
+/* Returns the hash index of a table.
+ * @param table: Table of directory entries.
+ * @return: Pointer to the first index slot.
+ */
+static uint32_t *dentry_index(struct dentry_table *table)
+{
+	return (uint32_t *)((char *)table + table->index_off);
+}
+
+/* Looks up a file name in the hash index.
+ * @param table: Table of directory entries.
+ * @param file_name: The file name.
+ * @param slot: Set to the index slot holding the name, or to the slot where
+ * it would be inserted when it is not found.
+ * @return: The entries[] index of the file, or SIZE_MAX if it is not found.
+ */
+static size_t index_find(struct dentry_table *table, const char *file_name,
+			 size_t *slot)
+{
+	uint32_t *index = dentry_index(table);
+	size_t mask = table->nbuckets - 1;
+	size_t i = dentry_hash(file_name) & mask;
+	// The index is never full, so probing ends at an empty slot
+	while (index[i] != INDEX_EMPTY) {
+		struct dentry *entry = &table->entries[index[i] - 1];
+		if (strncmp(entry->file_name, file_name, MAX_FILE_NAME_LEN) ==
+		    0) {
+			*slot = i;
+			return index[i] - 1;
+		}
+		i = (i + 1) & mask;
+	}
+	*slot = i;
+	return SIZE_MAX;
+}
+
+/* Empties a slot of the hash index. Later slots of the probe sequence are
+ * shifted back into the hole, so lookups never stop early and no tombstones
+ * are needed.
+ * @param table: Table of directory entries.
+ * @param slot: The index slot to empty.
+ * @return: void
+ */
+static void index_delete(struct dentry_table *table, size_t slot)
+{
+	uint32_t *index = dentry_index(table);
+	size_t mask = table->nbuckets - 1;
+	size_t hole = slot;
+	for (size_t i = (slot + 1) & mask; index[i] != INDEX_EMPTY;
+	     i = (i + 1) & mask) {
+		struct dentry *entry = &table->entries[index[i] - 1];
+		size_t home = dentry_hash(entry->file_name) & mask;
+		// The entry can move to the hole unless its home slot lies
+		// cyclically in (hole, i]
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			index[hole] = index[i];
+			hole = i;
 		}
 	}
-	return NULL;
+	index[hole] = INDEX_EMPTY;
 }
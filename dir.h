@@ -5,36 +5,54 @@
 #include <stddef.h>
 #include <stdint.h>
 
-// Note: I think the FCB can just be placed
-// at the start of the file's first data block.
-// It will always be the first 16 bytes of that block.
+#include "fcb.h"
 
-// File control block which details the state of the file.
-struct fcb {
-  size_t start_block_num;
-  size_t file_size;
-};
+// Types of directory entries
+#define DENTRY_FILE 0
+#define DENTRY_DIR 1
 
 // Directory entry. Details the file's name and starting block number.
+// The starting block holds the file's FCB, which has its extents.
+// A directory is a file made of one extent whose data, right after the FCB,
+// is the dentry table of the files inside it.
 struct dentry {
   size_t start_block_num;
   size_t file_size;
+  size_t type;
   char file_name[MAX_FILE_NAME_LEN];
 };
 
 // Table of directory entries. Used for looking up files in the file system.
-// The table is stored on blocks 1-2 of the file system.
+// The root directory's table is stored on the blocks after the VCB, other
+// tables inside their directory's file.
+// entries[] has cap slots. The end of the table's space holds a hash index of
+// nbuckets slots (a power of 2) at byte offset index_off, mapping file names
+// to entries with open addressing and linear probing.
 struct dentry_table {
   size_t num_entries;
   size_t curr_size;
   size_t max_size;
+  size_t cap;
+  // Slots of entries[] handed out so far
+  size_t used;
+  // First slot of entries[] freed by dentry_remove() plus 1, 0 if none. Freed
+  // slots are chained through their start_block_num
+  size_t free_head;
+  size_t nbuckets;
+  size_t index_off;
   struct dentry entries[];
 };
 
-void dentry_table_init(struct dentry_table *table, size_t nblocks);
+void dentry_table_init(struct dentry_table *table, size_t size);
+
+size_t dentry_table_size(size_t nentries);
 
 int dentry_add(struct dentry_table *table, struct dentry *entry);
 
 struct dentry *dentry_get(struct dentry_table *table, const char *file_name);
 
+int dentry_remove(struct dentry_table *table, const char *file_name);
+
+size_t dentry_hash(const char *file_name);
+
 #endif // SIMPLE_FS_DIR_H
@@ -0,0 +1,533 @@
+#include "fcb.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "simple-fs.h"
+#include "vcb.h"
+
+// Mounted volume, owned by simple-fs.c
+extern struct vcb *vcb;
+
+static struct extent *fcb_extents(struct fcb *fcb);
+static size_t fcb_search(struct fcb *fcb, size_t lblk);
+static int fcb_find(struct fcb *fcb, size_t lblk, size_t *idx);
+static int fcb_reserve(struct fcb *fcb, size_t extra);
+static int fcb_grow_extents(struct fcb *fcb);
+
+/* Initializes an FCB for a file made of a single run of blocks.
+ * @param fcb: The FCB to initialize. Should be at the start of block start.
+ * @param start: The first block of the file.
+ * @param blocks: The number of blocks in the run.
+ * @return: void
+ */
+void fcb_init(struct fcb *fcb, size_t start, size_t blocks)
+{
+	memset(fcb, 0, sizeof(struct fcb));
+	fcb->start_block_num = start;
+	fcb->file_size = blocks;
+	fcb->data_end = sizeof(struct fcb);
+	fcb->nextents = 1;
+	fcb->extents[0].lblk = 0;
+	fcb->extents[0].pblk = start;
+	fcb->extents[0].len = blocks;
+}
+
+/* Maps a logical block of a file to the block that stores it. Extents are
+ * binary searched, so this is O(log n) in the number of extents.
+ * @param fcb: The FCB of the file.
+ * @param lblk: The logical block number, 0 is the block holding the FCB.
+ * @param pblk: Set to the physical block number.
+ * @param count: Set to the number of blocks from lblk on that are contiguous
+ * on the volume, so callers can handle them with one copy.
+ * @return: 0 on success, -1 if lblk is in a hole or past the end of the file.
+ */
+int fcb_map(struct fcb *fcb, size_t lblk, size_t *pblk, size_t *count)
+{
+	size_t idx;
+	if (fcb_find(fcb, lblk, &idx))
+		return -1;
+	struct extent *e = &fcb_extents(fcb)[idx];
+	*pblk = e->pblk + (lblk - e->lblk);
+	*count = e->len - (lblk - e->lblk);
+	return 0;
+}
+
+/* Returns the length of the hole at a logical block of a file. Files are
+ * sparse: blocks that were never written or were punched out have no extent
+ * and read back as zeroes.
+ * @param fcb: The FCB of the file.
+ * @param lblk: The logical block number.
+ * @return: 0 if lblk is stored on a block, otherwise the number of blocks
+ * from lblk to the next extent, or SIZE_MAX if no extent follows.
+ */
+size_t fcb_hole(struct fcb *fcb, size_t lblk)
+{
+	struct extent *ext = fcb_extents(fcb);
+	size_t i = fcb_search(fcb, lblk);
+	if (i > 0 && lblk < ext[i - 1].lblk + ext[i - 1].len)
+		return 0;
+	return i < fcb->nextents ? ext[i].lblk - lblk : SIZE_MAX;
+}
+
+/* Returns whether a range of a file has holes.
+ * @param fcb: The FCB of the file.
+ * @param lblk: The first logical block.
+ * @param count: The number of blocks, blocks past the end of the file are
+ * ignored.
+ * @return: Non-zero if a block of the range is not stored, 0 otherwise.
+ */
+int fcb_holes(struct fcb *fcb, size_t lblk, size_t count)
+{
+	size_t end = lblk + count;
+	if (end > fcb->file_size)
+		end = fcb->file_size;
+	while (lblk < end) {
+		size_t pblk, run;
+		if (fcb_map(fcb, lblk, &pblk, &run))
+			return 1;
+		lblk += run;
+	}
+	return 0;
+}
+
+/* Returns the number of blocks a file is stored on, not counting holes or its
+ * extent array.
+ * @param fcb: The FCB of the file.
+ * @return: The number of blocks.
+ */
+size_t fcb_blocks(struct fcb *fcb)
+{
+	struct extent *ext = fcb_extents(fcb);
+	size_t blocks = 0;
+	for (size_t i = 0; i < fcb->nextents; ++i)
+		blocks += ext[i].len;
+	return blocks;
+}
+
+/* Appends a run of blocks to the end of a file. The run is merged into the
+ * last extent when it directly follows it on the volume. The blocks must
+ * already be marked used. Caller must hold the VCB lock, a new extent array
+ * may have to be allocated.
+ * @param fcb: The FCB of the file.
+ * @param pblk: The first block of the run.
+ * @param count: The number of blocks in the run.
+ * @return: 0 on success, -1 if there was no room for another extent.
+ */
+int fcb_append(struct fcb *fcb, size_t pblk, size_t count)
+{
+	return fcb_insert(fcb, fcb->file_size, pblk, count);
+}
+
+/* Stores a hole of a file, or blocks past its end, on a run of blocks. The run
+ * is merged with the extents before and after it when it continues them on
+ * the volume. The file grows to cover the run. The blocks must already be
+ * marked used. Caller must hold the VCB lock, the extent array may have to
+ * grow.
+ * @param fcb: The FCB of the file.
+ * @param lblk: The first logical block of the run, which must not be stored.
+ * @param pblk: The first block of the run.
+ * @param count: The number of blocks in the run.
+ * @return: 0 on success, -1 if there was no room for another extent.
+ */
+int fcb_insert(struct fcb *fcb, size_t lblk, size_t pblk, size_t count)
+{
+	struct extent *ext = fcb_extents(fcb);
+	size_t i = fcb_search(fcb, lblk);
+	int with_prev = i > 0 && ext[i - 1].lblk + ext[i - 1].len == lblk &&
+			ext[i - 1].pblk + ext[i - 1].len == pblk;
+	int with_next = i < fcb->nextents && lblk + count == ext[i].lblk &&
+			pblk + count == ext[i].pblk;
+
+	if (with_prev && with_next) {
+		ext[i - 1].len += count + ext[i].len;
+		memmove(&ext[i], &ext[i + 1],
+			(fcb->nextents - i - 1) * sizeof(struct extent));
+		--fcb->nextents;
+	} else if (with_prev) {
+		ext[i - 1].len += count;
+	} else if (with_next) {
+		ext[i].lblk = lblk;
+		ext[i].pblk = pblk;
+		ext[i].len += count;
+	} else {
+		if (fcb_reserve(fcb, 1))
+			return -1;
+		ext = fcb_extents(fcb);
+		memmove(&ext[i + 1], &ext[i],
+			(fcb->nextents - i) * sizeof(struct extent));
+		ext[i] = (struct extent){ lblk, pblk, count };
+		++fcb->nextents;
+	}
+	if (lblk + count > fcb->file_size)
+		fcb->file_size = lblk + count;
+	return 0;
+}
+
+/* Drops the blocks storing a range of a file, leaving a hole. Blocks shared
+ * with other files only lose this file as an owner. The file keeps its size.
+ * Caller must hold the VCB lock, splitting an extent may need a bigger extent
+ * array.
+ * @param fcb: The FCB of the file.
+ * @param lblk: The first logical block, at least 1 since block 0 holds the
+ * FCB.
+ * @param count: The number of blocks.
+ * @return: 0 on success, -1 if there was no room to split an extent. Nothing
+ * is dropped then.
+ */
+int fcb_punch(struct fcb *fcb, size_t lblk, size_t count)
+{
+	struct extent *ext = fcb_extents(fcb);
+	size_t end = lblk + count;
+	size_t i = fcb_search(fcb, lblk);
+	if (i > 0 && ext[i - 1].lblk < lblk &&
+	    ext[i - 1].lblk + ext[i - 1].len > end) {
+		// The hole splits one extent in two
+		if (fcb_reserve(fcb, 1))
+			return -1;
+		ext = fcb_extents(fcb);
+		struct extent e = ext[i - 1];
+		size_t head = lblk - e.lblk;
+		memmove(&ext[i + 1], &ext[i],
+			(fcb->nextents - i) * sizeof(struct extent));
+		ext[i - 1].len = head;
+		ext[i] = (struct extent){ end, e.pblk + head + count,
+					  e.lblk + e.len - end };
+		++fcb->nextents;
+		vcb_put_range(vcb, e.pblk + head, count);
+		return 0;
+	}
+
+	// Extents lose their tail, their head or all of their blocks
+	size_t kept = 0;
+	for (size_t j = 0; j < fcb->nextents; ++j) {
+		struct extent e = ext[j];
+		size_t from = e.lblk > lblk ? e.lblk : lblk;
+		size_t to = e.lblk + e.len < end ? e.lblk + e.len : end;
+		if (from < to) {
+			vcb_put_range(vcb, e.pblk + (from - e.lblk), to - from);
+			if (e.lblk < from) {
+				e.len = from - e.lblk;
+			} else if (to < e.lblk + e.len) {
+				e.pblk += to - e.lblk;
+				e.len -= to - e.lblk;
+				e.lblk = to;
+			} else {
+				continue;
+			}
+		}
+		ext[kept++] = e;
+	}
+	fcb->nextents = kept;
+	return 0;
+}
+
+/* Points a file at a copy of its blocks made on one run, in logical order and
+ * without its holes. The extents go back into the FCB, the other fields are
+ * kept. Used by the defragmenter after copying a file.
+ * @param fcb: The FCB of the file, at the start of block start. May still
+ * point at an extent array on the old blocks.
+ * @param start: The first block of the run.
+ * @return: 0 on success, -1 if the file has more than FCB_INLINE_EXTENTS
+ * runs between holes. The FCB is not changed then.
+ */
+int fcb_relocate(struct fcb *fcb, size_t start)
+{
+	struct extent *ext = fcb_extents(fcb);
+	size_t runs = 0;
+	for (size_t i = 0; i < fcb->nextents; ++i) {
+		if (i == 0 || ext[i - 1].lblk + ext[i - 1].len != ext[i].lblk)
+			++runs;
+	}
+	if (runs > FCB_INLINE_EXTENTS)
+		return -1;
+
+	// Runs only merge extents, so entry i is read before it is written
+	size_t pblk = start;
+	size_t n = 0;
+	for (size_t i = 0; i < fcb->nextents; ++i) {
+		struct extent e = ext[i];
+		struct extent *last = n > 0 ? &fcb->extents[n - 1] : NULL;
+		if (last != NULL && last->lblk + last->len == e.lblk)
+			last->len += e.len;
+		else
+			fcb->extents[n++] =
+				(struct extent){ e.lblk, pblk, e.len };
+		pblk += e.len;
+	}
+	fcb->start_block_num = start;
+	fcb->nextents = n;
+	fcb->ext_block = 0;
+	fcb->ext_cap = 0;
+	return 0;
+}
+
+/* Points count blocks of a file at a new run of blocks, splitting the extent
+ * that held them. Used to give a file its own copy of blocks it shares. The
+ * blocks must lie in one extent and the new run must already be marked used,
+ * the old blocks are left to the caller. Caller must hold the VCB lock, the
+ * extent array may have to grow.
+ * @param fcb: The FCB of the file.
+ * @param lblk: The first logical block to move.
+ * @param count: The number of blocks to move.
+ * @param pblk: The first block of the new run.
+ * @return: 0 on success, -1 if the blocks are not in one extent or there was
+ * no room for the extents.
+ */
+int fcb_remap(struct fcb *fcb, size_t lblk, size_t count, size_t pblk)
+{
+	size_t i;
+	if (fcb_find(fcb, lblk, &i))
+		return -1;
+	struct extent old = fcb_extents(fcb)[i];
+	if (lblk + count > old.lblk + old.len)
+		return -1;
+	size_t before = lblk - old.lblk;
+	size_t after = old.lblk + old.len - (lblk + count);
+	size_t added = (before != 0) + (after != 0);
+
+	if (fcb_reserve(fcb, added))
+		return -1;
+
+	struct extent *ext = fcb_extents(fcb);
+	memmove(&ext[i + 1 + added], &ext[i + 1],
+		(fcb->nextents - i - 1) * sizeof(struct extent));
+	if (before != 0)
+		ext[i++] = (struct extent){ old.lblk, old.pblk, before };
+	ext[i++] = (struct extent){ lblk, pblk, count };
+	if (after != 0)
+		ext[i] = (struct extent){ lblk + count,
+					  old.pblk + before + count, after };
+	fcb->nextents += added;
+	return 0;
+}
+
+/* Gives a new file the blocks of another, sharing every block after the one
+ * holding the FCB, so the file is cloned in time linear in its extents rather
+ * than its size. Caller must hold the VCB lock.
+ * @param dst: The FCB of the new file, holding just its first block.
+ * @param src: The FCB of the file to share blocks with.
+ * @return: 0 on success, -1 if a block has too many owners or there was no
+ * room for the extents. dst is left holding just its first block on failure.
+ */
+int fcb_share(struct fcb *dst, struct fcb *src)
+{
+	struct extent *ext = fcb_extents(src);
+	size_t i;
+	for (i = 0; i < src->nextents; ++i) {
+		size_t skip = ext[i].lblk == 0;
+		if (vcb_ref_range(vcb, ext[i].pblk + skip, ext[i].len - skip))
+			break;
+	}
+	size_t refd = i;
+	if (refd == src->nextents) {
+		for (i = 0; i < src->nextents; ++i) {
+			size_t skip = ext[i].lblk == 0;
+			if (ext[i].len > skip &&
+			    fcb_insert(dst, ext[i].lblk + skip,
+				       ext[i].pblk + skip, ext[i].len - skip))
+				break;
+		}
+		if (i == src->nextents) {
+			// Keeps a hole at the end of src
+			dst->file_size = src->file_size;
+			return 0;
+		}
+	}
+
+	// Undo: the blocks still have their other owners, so only refs drop
+	for (i = 0; i < refd; ++i) {
+		size_t skip = ext[i].lblk == 0;
+		vcb_put_range(vcb, ext[i].pblk + skip, ext[i].len - skip);
+	}
+	if (dst->ext_block) {
+		size_t ext_blocks = (dst->ext_cap * sizeof(struct extent) +
+				     vcb->block_size - 1) /
+				    vcb->block_size;
+		vcb_set_range_free(vcb, dst->ext_block, ext_blocks, 1);
+	}
+	fcb_init(dst, dst->start_block_num, 1);
+	return -1;
+}
+
+/* Returns whether any of count blocks of a file starting at lblk is shared
+ * with another file.
+ * @param fcb: The FCB of the file.
+ * @param lblk: The first logical block.
+ * @param count: The number of blocks, blocks past the end of the file are
+ * ignored.
+ * @return: Non-zero if a block is shared, 0 otherwise.
+ */
+int fcb_shared(struct fcb *fcb, size_t lblk, size_t count)
+{
+	size_t end = lblk + count;
+	if (end > fcb->file_size)
+		end = fcb->file_size;
+	while (lblk < end) {
+		size_t pblk, run;
+		if (fcb_map(fcb, lblk, &pblk, &run)) {
+			// Skip the hole
+			run = fcb_hole(fcb, lblk);
+			lblk += run < end - lblk ? run : end - lblk;
+			continue;
+		}
+		if (run > end - lblk)
+			run = end - lblk;
+		if (vcb_range_shared(vcb, pblk, run))
+			return 1;
+		lblk += run;
+	}
+	return 0;
+}
+
+/* Returns the extent holding the end of the file.
+ * @param fcb: The FCB of the file.
+ * @return: The last extent, or NULL if the file has none.
+ */
+struct extent *fcb_last_extent(struct fcb *fcb)
+{
+	if (fcb->nextents == 0)
+		return NULL;
+	return &fcb_extents(fcb)[fcb->nextents - 1];
+}
+
+/* Marks every block of a file free, including its extent array. Blocks shared
+ * with other files only lose this file as an owner. The FCB lives on the first
+ * block, so it must not be used afterwards. Caller must hold the VCB lock.
+ * @param fcb: The FCB of the file.
+ * @return: void
+ */
+void fcb_free_blocks(struct fcb *fcb)
+{
+	struct extent *ext = fcb_extents(fcb);
+	size_t ext_block = fcb->ext_block;
+	size_t ext_cap = fcb->ext_cap;
+	size_t ext_blocks =
+		(ext_cap * sizeof(struct extent) + vcb->block_size - 1) /
+		vcb->block_size;
+
+	// Free the first extent last, it holds the FCB
+	for (size_t i = fcb->nextents; i-- > 0;)
+		vcb_put_range(vcb, ext[i].pblk, ext[i].len);
+	if (ext_block)
+		vcb_set_range_free(vcb, ext_block, ext_blocks, 1);
+}
+
+/* Copies an FCB that may be changing under the caller, for readers that do
+ * not lock the file. Only FCBs with inline extents are copied. The copy is
+ * checked so that fcb_map() on it only returns blocks on the volume, even if
+ * it was torn by a concurrent writer, but it may still be stale: callers must
+ * check that the file was not written while they used it.
+ * @param dst: Set to the copy.
+ * @param src: The FCB of the file.
+ * @return: 0 if dst can be used, -1 if the file has an extent array on its
+ * own blocks or the copy is not a valid FCB.
+ */
+int fcb_snapshot(struct fcb *dst, const struct fcb *src)
+{
+	memcpy(dst, src, sizeof(struct fcb));
+	if (dst->ext_block != 0 || dst->nextents == 0 ||
+	    dst->nextents > FCB_INLINE_EXTENTS)
+		return -1;
+	size_t block_count = vcb->block_count;
+	for (size_t i = 0; i < dst->nextents; ++i) {
+		struct extent *e = &dst->extents[i];
+		if (e->len > block_count || e->pblk > block_count - e->len)
+			return -1;
+	}
+	return 0;
+}
+
+/* Returns the extent array of a file, inline or on its own blocks.
+ * @param fcb: The FCB of the file.
+ * @return: Pointer to the first extent.
+ */
+static struct extent *fcb_extents(struct fcb *fcb)
+{
+	if (fcb->ext_block == 0)
+		return fcb->extents;
+	return (struct extent *)(raw_blocks + fcb->ext_block * vcb->block_size);
+}
+
+/* Counts the extents of a file that start at or before a logical block.
+ * Extents are binary searched.
+ * @param fcb: The FCB of the file.
+ * @param lblk: The logical block number.
+ * @return: The index of the first extent starting after lblk.
+ */
+static size_t fcb_search(struct fcb *fcb, size_t lblk)
+{
+	struct extent *ext = fcb_extents(fcb);
+	size_t lo = 0;
+	size_t hi = fcb->nextents;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (ext[mid].lblk <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Finds the extent holding a logical block of a file.
+ * @param fcb: The FCB of the file.
+ * @param lblk: The logical block number.
+ * @param idx: Set to the index of the extent.
+ * @return: 0 on success, -1 if lblk is not stored.
+ */
+static int fcb_find(struct fcb *fcb, size_t lblk, size_t *idx)
+{
+	struct extent *ext = fcb_extents(fcb);
+	size_t i = fcb_search(fcb, lblk);
+	if (i == 0 || lblk >= ext[i - 1].lblk + ext[i - 1].len)
+		return -1;
+	*idx = i - 1;
+	return 0;
+}
+
+/* Makes room for more extents, moving them to a bigger array if needed.
+ * Caller must hold the VCB lock.
+ * @param fcb: The FCB of the file.
+ * @param extra: The number of extents about to be added.
+ * @return: 0 on success, -1 if no blocks were free for the array.
+ */
+static int fcb_reserve(struct fcb *fcb, size_t extra)
+{
+	size_t cap = fcb->ext_block ? fcb->ext_cap : FCB_INLINE_EXTENTS;
+	while (fcb->nextents + extra > cap) {
+		if (fcb_grow_extents(fcb))
+			return -1;
+		cap = fcb->ext_cap;
+	}
+	return 0;
+}
+
+/* Moves the extents of a file to an array twice as large. The first array
+ * outside the FCB takes one block. Caller must hold the VCB lock.
+ * @param fcb: The FCB of the file.
+ * @return: 0 on success, -1 if no blocks were free for the array.
+ */
+static int fcb_grow_extents(struct fcb *fcb)
+{
+	size_t block_size = vcb->block_size;
+	size_t old_blocks = 0;
+	size_t new_blocks = 1;
+	if (fcb->ext_block) {
+		old_blocks = (fcb->ext_cap * sizeof(struct extent) + block_size -
+			      1) / block_size;
+		new_blocks = 2 * old_blocks;
+	}
+
+	size_t start;
+	if (vcb_alloc(vcb, new_blocks, &start))
+		return -1;
+
+	char *array = raw_blocks + start * block_size;
+	memcpy(array, fcb_extents(fcb), fcb->nextents * sizeof(struct extent));
+	if (fcb->ext_block)
+		vcb_set_range_free(vcb, fcb->ext_block, old_blocks, 1);
+	fcb->ext_block = start;
+	fcb->ext_cap = new_blocks * block_size / sizeof(struct extent);
+	return 0;
+}
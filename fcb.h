@@ -0,0 +1,72 @@
+#ifndef SIMPLE_FS_FCB_H
+#define SIMPLE_FS_FCB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of extents stored in the FCB itself. Files with more extents move
+// them to an extent array on their own blocks.
+#define FCB_INLINE_EXTENTS 8
+
+// A run of contiguous blocks holding part of a file. Logical block lblk of
+// the file is stored on physical block pblk, lblk + 1 on pblk + 1, and so on.
+struct extent {
+  size_t lblk;
+  size_t pblk;
+  size_t len;
+};
+
+// File control block which details the state of the file.
+// Placed at the start of the file's first data block, so file offsets start
+// after it.
+// Extents are sorted by lblk. While nextents <= FCB_INLINE_EXTENTS they are
+// stored in extents[], afterwards in an array of ext_cap extents starting at
+// block ext_block. Files are sparse: logical blocks below file_size that no
+// extent covers are holes, which take no blocks and read as zeroes. Block 0
+// is always stored, it holds the FCB. The FCB is stored on the volume, so any
+// change to it needs a new VCB_MAGIC.
+struct fcb {
+  size_t start_block_num;
+  // Size of the file in blocks, holes included
+  size_t file_size;
+  // End of the file as a file offset, one past its last byte. Reads stop and
+  // appends start here. Never past the last block, and the bytes between it
+  // and the end of the last block are zero.
+  size_t data_end;
+  size_t nextents;
+  size_t ext_block;
+  size_t ext_cap;
+  struct extent extents[FCB_INLINE_EXTENTS];
+};
+
+void fcb_init(struct fcb *fcb, size_t start, size_t blocks);
+
+int fcb_map(struct fcb *fcb, size_t lblk, size_t *pblk, size_t *count);
+
+size_t fcb_hole(struct fcb *fcb, size_t lblk);
+
+int fcb_holes(struct fcb *fcb, size_t lblk, size_t count);
+
+size_t fcb_blocks(struct fcb *fcb);
+
+int fcb_append(struct fcb *fcb, size_t pblk, size_t count);
+
+int fcb_insert(struct fcb *fcb, size_t lblk, size_t pblk, size_t count);
+
+int fcb_punch(struct fcb *fcb, size_t lblk, size_t count);
+
+int fcb_relocate(struct fcb *fcb, size_t start);
+
+int fcb_remap(struct fcb *fcb, size_t lblk, size_t count, size_t pblk);
+
+int fcb_share(struct fcb *dst, struct fcb *src);
+
+int fcb_shared(struct fcb *fcb, size_t lblk, size_t count);
+
+struct extent *fcb_last_extent(struct fcb *fcb);
+
+void fcb_free_blocks(struct fcb *fcb);
+
+int fcb_snapshot(struct fcb *dst, const struct fcb *src);
+
+#endif // SIMPLE_FS_FCB_H
@@ -44,7 +44,7 @@ void *p2_and_p3_thread(void *arg)
 		printf("Failed to open %s\n", file_name);
 		return NULL;
 	}
-	char buf[BLOCK_SIZE];
+	char buf[DEFAULT_BLOCK_SIZE];
 	read(fd, buf, sizeof(buf));
 	printf("%s: %s\n", file_name, buf);
 	close(fd);
@@ -54,11 +54,21 @@ void *p2_and_p3_thread(void *arg)
 /* Example usage of the simple-fs implementation.
  * This example is based on the description of the
  * simulation as described in Part 2 of the rubric.
+ * Pass a path to run on a volume image instead of an in-memory volume.
  */
-int main(void)
+int main(int argc, char *argv[])
 {
 	// Initialize the file system
-	init_fs();
+	if (argc > 1) {
+		if (mount_fs(argv[1], DEFAULT_BLOCK_SIZE,
+			     DEFAULT_BLOCK_COUNT)) {
+			printf("Failed to mount %s\n", argv[1]);
+			return 1;
+		}
+	} else if (init_fs(DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT)) {
+		printf("Failed to initialize the file system\n");
+		return 1;
+	}
 	pthread_t p1, p2, p3;
 	pthread_create(&p1, NULL, p1_thread, NULL);
 	pthread_join(p1, NULL);
@@ -68,4 +78,5 @@ int main(void)
 	pthread_create(&p3, NULL, p2_and_p3_thread, p3_file);
 	pthread_join(p2, NULL);
 	pthread_join(p3, NULL);
+	close_fs();
 }
@@ -3,6 +3,7 @@
 
 #include "open-ft.h"
 
+#include <limits.h>
 #include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,94 +15,135 @@
 static struct sys_oft sys_oft;
 // Process Open File Tables
 static struct proc_oft_list proc_oft_list;
+// Bumped by oft_init(), so tables cached by threads before the file system
+// was last set up are not used
+static unsigned long oft_generation = 0;
+// The calling thread's process open file table, valid while its generation
+// matches oft_generation
+static _Thread_local struct proc_oft *thread_oft = NULL;
+static _Thread_local unsigned long thread_oft_generation = 0;
+// Unlinked files whose last open file entry was closed, waiting for their
+// blocks to be freed. A lock-free stack, so files can be pushed without the
+// VCB lock that guards taking them off.
+static _Atomic(struct oft_unlinked *) reclaim_list = NULL;
 
-// TODO: These data structures should be more dynamic and robust.
-// Eventually create a dynamic array scheme for these tables.
-
-static struct sys_oft_entry *sys_oft_find(struct dentry *dentry);
+static struct sys_oft_entry *sys_oft_find(size_t key);
+static struct sys_oft_entry *sys_oft_find_locked(size_t key);
+static void reclaim_push(struct oft_unlinked *unlinked);
 static struct sys_oft_entry *sys_oft_add(struct dentry *dentry, struct fcb *fcb,
 					 int oflag);
+static void sys_oft_put(struct sys_oft_entry *entry);
+static void sys_oft_link(struct sys_oft_entry *entry);
+static void sys_oft_unlink(struct sys_oft_entry *entry);
+static void sys_oft_grow();
+static struct oft_buckets *buckets_new(size_t n, struct oft_buckets *old);
+static inline size_t key_hash(size_t key);
 
-static struct proc_oft *proc_oft_find(pid_t pid);
+static struct proc_oft *proc_oft_self();
 static struct proc_oft *proc_oft_add(pid_t pid);
+static void proc_oft_del(struct proc_oft *oft);
 static struct proc_oft_entry *
 proc_oft_entry_add(struct proc_oft *oft, struct sys_oft_entry *sys_entry);
 static struct proc_oft_entry *proc_oft_entry_get(struct proc_oft *oft, int fd);
 
-/* Initializes the system open file table by alocating space for SYS_OFT_LEN
- * entries. Also initializes the process open file tables by allocating space
- * for PROC_OFT_LIST_LEN tables.
+/* Initializes the system open file table and the list of process open file
+ * tables. Both start empty and grow as files are opened.
  * @return: void
  */
 void oft_init()
 {
-	// Make the space static for now,
-	// we can change this to a dynamic array scheme later
-	sys_oft.entries = malloc(sizeof(struct sys_oft_entry) * SYS_OFT_LEN);
-	if (sys_oft.entries == NULL) {
-		perror("malloc");
-		exit(1);
-	}
-	memset(sys_oft.entries, 0, sizeof(struct sys_oft_entry) * SYS_OFT_LEN);
-	sys_oft.cap = SYS_OFT_LEN;
+	slab_init(&sys_oft.slab, sizeof(struct sys_oft_entry), SYS_OFT_LEN);
+	atomic_init(&sys_oft.buckets, buckets_new(SYS_OFT_LEN, NULL));
 	sys_oft.len = 0;
+	pthread_mutex_init(&sys_oft.lock, NULL);
+	slab_init(&sys_oft.map_slab, sizeof(struct oft_map), OFT_MAP_LEN);
+	sys_oft.maps = NULL;
 
-	proc_oft_list.ofts = malloc(sizeof(struct proc_oft) * PROC_OFT_LIST_LEN);
-	if (proc_oft_list.ofts == NULL) {
-		perror("malloc");
-		exit(1);
-	}
-	memset(proc_oft_list.ofts, 0, sizeof(struct proc_oft) * PROC_OFT_LIST_LEN);
-	proc_oft_list.cap = PROC_OFT_LEN;
+	slab_init(&proc_oft_list.slab, sizeof(struct proc_oft),
+		  PROC_OFT_LIST_LEN);
+	proc_oft_list.head = NULL;
 	proc_oft_list.len = 0;
+	pthread_mutex_init(&proc_oft_list.lock, NULL);
+	++oft_generation;
 }
 
 /* Opens a file for a process. Reuses or adds an entry into the system open file
  * table. If the calling process does not have a process open file table, it is
- * created. The file is then added to the process open file table. If any tables
- * are full, -1 is returned.
+ * created. The file is then added to the process open file table. Takes no
+ * lock when the file is already open.
  * @param dentry: The dentry of the file to open.
  * @param fcb: The file control block of the file to open.
- * @param oflag: The open flags for the file. (Unused for now)
+ * @param oflag: The open flags for the file descriptor.
  * @return: The index of the file in the process open file table, or -1 if the
  * file could not be opened.
  */
 int oft_open(struct dentry *dentry, struct fcb *fcb, int oflag)
 {
-	struct sys_oft_entry *entry = sys_oft_find(dentry);
+	return oft_install(oft_acquire(dentry, fcb, oflag), oflag);
+}
+
+/* Takes a reference to a file's system open file table entry, adding the
+ * entry if the file is not open yet. The first half of oft_open(), for
+ * threads that open files on behalf of a process.
+ * @param dentry: The dentry of the file to open.
+ * @param fcb: The file control block of the file to open.
+ * @param oflag: The open flags for the file. (Unused for now)
+ * @return: The entry.
+ */
+struct sys_oft_entry *oft_acquire(struct dentry *dentry, struct fcb *fcb,
+				  int oflag)
+{
+	size_t key = fcb->start_block_num;
+	struct sys_oft_entry *entry = sys_oft_find(key);
 	if (entry == NULL) {
-		entry = sys_oft_add(dentry, fcb, oflag);
-		// Out of space
-		if (entry == NULL) {
-			return -1;
-		}
+		// Check again under the lock, the lock-free lookup can miss
+		// an entry while another thread changes its bucket
+		pthread_mutex_lock(&sys_oft.lock);
+		entry = sys_oft_find_locked(key);
+		if (entry != NULL)
+			atomic_fetch_add(&entry->ref_count, 1);
+		else
+			entry = sys_oft_add(dentry, fcb, oflag);
+		pthread_mutex_unlock(&sys_oft.lock);
 	}
-	atomic_fetch_add(&entry->ref_count, 1);
+	return entry;
+}
 
-	// Add to the process OFT
-	pid_t caller = syscall(SYS_gettid);
-	// Debug message. This may be incorrect so want to check when in testable state
-	struct proc_oft *oft = proc_oft_find(caller);
+/* Gives the calling process a file descriptor for an entry taken with
+ * oft_acquire(). The reference moves to the file descriptor. The second half
+ * of oft_open().
+ * @param entry: The entry.
+ * @param oflag: The open flags for the file descriptor.
+ * @return: The file descriptor, or -1 if the process is out of them, the
+ * reference is then dropped.
+ */
+int oft_install(struct sys_oft_entry *entry, int oflag)
+{
+	// Add to the process OFT. Registering the process is the only place
+	// its id is needed, afterwards its table is found through TLS.
+	struct proc_oft *oft = proc_oft_self();
 	if (oft == NULL) {
-		oft = proc_oft_add(caller);
-		if (oft == NULL) {
-			// Out of space
-			return -1;
-		}
+		oft = proc_oft_add(syscall(SYS_gettid));
 	}
 	struct proc_oft_entry *proc_entry = proc_oft_entry_add(oft, entry);
 	if (proc_entry == NULL) {
-		// Out of space
+		// Out of fds
+		sys_oft_put(entry);
 		return -1;
 	}
+	proc_entry->oflag = oflag;
 
 	return (proc_entry - oft->entries);
 }
 
+/* Gets an open file of the calling process. Only the calling process changes
+ * its table, so no lock is needed.
+ * @param fd: The index of the file in the process open file table.
+ * @return: The entry, or NULL if fd is not an open file.
+ */
 struct proc_oft_entry *oft_get(int fd)
 {
-	pid_t caller = syscall(SYS_gettid);
-	struct proc_oft *oft = proc_oft_find(caller);
+	struct proc_oft *oft = proc_oft_self();
 	if (oft == NULL) {
 		return NULL;
 	}
@@ -118,180 +160,588 @@ struct proc_oft_entry *oft_get(int fd)
  */
 int oft_close(int fd)
 {
-	pid_t caller = syscall(SYS_gettid);
-	struct proc_oft *oft = proc_oft_find(caller);
-	if (oft == NULL) {
+	struct sys_oft_entry *entry = oft_detach(fd);
+	if (entry == NULL) {
 		return -1;
 	}
+	sys_oft_put(entry);
+	return 0;
+}
 
-	struct proc_oft_entry *entry = &oft->entries[fd];
-	if (entry->sys_entry == NULL) {
-		return -1;
+/* Removes a file descriptor from the calling process's table without
+ * dropping its reference, which moves to the caller. The fd can be reused
+ * right away.
+ * @param fd: The index of the file in the process open file table.
+ * @return: The system open file table entry of the file, or NULL if fd is not
+ * an open file.
+ */
+struct sys_oft_entry *oft_detach(int fd)
+{
+	struct proc_oft *oft = proc_oft_self();
+	if (oft == NULL) {
+		return NULL;
 	}
 
-	struct sys_oft_entry *sys_entry = entry->sys_entry;
-	atomic_fetch_sub(&sys_entry->ref_count, 1);
-	if (atomic_load(&sys_entry->ref_count) == 0) {
-		// Remove from system OFT
-		sys_entry->dentry = NULL;
-		sys_entry->fcb = NULL;
-		--sys_oft.len;
+	struct proc_oft_entry *entry = proc_oft_entry_get(oft, fd);
+	if (entry == NULL) {
+		return NULL;
 	}
+	struct sys_oft_entry *sys_entry = entry->sys_entry;
 
-	// Remove from process OFT
+	// Remove from process OFT, the fd is reused by the next open
 	entry->sys_entry = NULL;
-	entry->file_pos = 0;
+	entry->file_pos = oft->free_head;
+	oft->free_head = fd + 1;
 	--oft->len;
 
 	// If process's OFT is empty, remove it
-	// This is inefficient and a better approach could be
-	// taken
 	if (oft->len == 0) {
-		free(oft->entries);
-		oft->cap = 0;
-		oft->pid = 0;
+		proc_oft_del(oft);
+	}
+
+	return sys_entry;
+}
+
+/* Detaches an open file from its dentry before the dentry is removed. The
+ * open file keeps working on a copy of the dentry, and its blocks stay in use
+ * until it is last closed.
+ * @param dentry: The dentry of the file being unlinked.
+ * @return: 1 if the file is open and its blocks will show up on the reclaim
+ * list, 0 if it is not open and its blocks can be freed right away.
+ */
+int oft_unlink(struct dentry *dentry)
+{
+	struct sys_oft_entry *entry = oft_lookup(dentry);
+	if (entry == NULL) {
+		return 0;
+	}
+	struct oft_unlinked *unlinked = malloc(sizeof(struct oft_unlinked));
+	if (unlinked == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	unlinked->dentry = *dentry;
+	unlinked->fcb = entry->fcb;
+	unlinked->next = NULL;
+	entry->dentry = &unlinked->dentry;
+	entry->unlinked = unlinked;
+	// May be the last reference by now, then the file is reclaimed here
+	sys_oft_put(entry);
+	return 1;
+}
+
+/* Finds the system open file table entry of a file, so callers can take its
+ * lock before changing the file behind the entry's back. The entry is
+ * returned with a reference, drop it with oft_put().
+ * @param dentry: The dentry of the file.
+ * @return: The entry, or NULL if the file is not open.
+ */
+struct sys_oft_entry *oft_lookup(struct dentry *dentry)
+{
+	struct sys_oft_entry *entry = sys_oft_find(dentry->start_block_num);
+	if (entry != NULL) {
+		return entry;
 	}
+	pthread_mutex_lock(&sys_oft.lock);
+	entry = sys_oft_find_locked(dentry->start_block_num);
+	if (entry != NULL)
+		atomic_fetch_add(&entry->ref_count, 1);
+	pthread_mutex_unlock(&sys_oft.lock);
+	return entry;
+}
 
+/* Takes another reference to an entry the caller already holds one to, so
+ * the file stays open after its fd is closed.
+ * @param entry: The entry.
+ * @return: void
+ */
+void oft_hold(struct sys_oft_entry *entry)
+{
+	atomic_fetch_add(&entry->ref_count, 1);
+}
+
+/* Drops a reference taken by oft_lookup(), oft_acquire() or oft_hold().
+ * @param entry: The entry.
+ * @return: void
+ */
+void oft_put(struct sys_oft_entry *entry)
+{
+	sys_oft_put(entry);
+}
+
+/* Points an open file's entry at its FCB after the file was moved on the
+ * volume, and files it under its new first block. Caller must hold the
+ * file's lock exclusively.
+ * @param entry: The file's system open file table entry.
+ * @param fcb: The file's FCB at its new place.
+ * @return: void
+ */
+void oft_relocate(struct sys_oft_entry *entry, struct fcb *fcb)
+{
+	pthread_mutex_lock(&sys_oft.lock);
+	sys_oft_unlink(entry);
+	entry->fcb = fcb;
+	atomic_store(&entry->key, fcb->start_block_num);
+	sys_oft_link(entry);
+	pthread_mutex_unlock(&sys_oft.lock);
+}
+
+/* Marks the start of a change to an open file's data or FCB. Readers that
+ * started before oft_write_end() retry. Caller must hold the file's lock
+ * exclusively, so writers never race on seq and no read-modify-write is
+ * needed.
+ * @param entry: The file's system open file table entry.
+ * @return: void
+ */
+void oft_write_begin(struct sys_oft_entry *entry)
+{
+	unsigned int seq = atomic_load_explicit(&entry->seq,
+						memory_order_relaxed);
+	atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+	// Readers must see seq odd before any of the changes
+	atomic_thread_fence(memory_order_release);
+}
+
+/* Marks the end of a change started with oft_write_begin().
+ * @param entry: The file's system open file table entry.
+ * @return: void
+ */
+void oft_write_end(struct sys_oft_entry *entry)
+{
+	unsigned int seq = atomic_load_explicit(&entry->seq,
+						memory_order_relaxed);
+	atomic_store_explicit(&entry->seq, seq + 1, memory_order_release);
+}
+
+/* Records a mapping of an open file's blocks. The file is pinned until the
+ * mapping is removed: it keeps a reference, so its blocks are not freed when
+ * it is closed or unlinked, and it is not moved. Caller must hold the file's
+ * lock, at least shared.
+ * @param entry: The file's system open file table entry.
+ * @param addr: The address handed out.
+ * @param len: The number of bytes mapped.
+ * @return: void
+ */
+void oft_map(struct sys_oft_entry *entry, void *addr, size_t len)
+{
+	pthread_mutex_lock(&sys_oft.lock);
+	struct oft_map *map = slab_alloc(&sys_oft.map_slab);
+	map->addr = addr;
+	map->len = len;
+	map->entry = entry;
+	map->next = sys_oft.maps;
+	sys_oft.maps = map;
+	atomic_fetch_add(&entry->ref_count, 1);
+	atomic_fetch_add(&entry->maps, 1);
+	pthread_mutex_unlock(&sys_oft.lock);
+}
+
+/* Removes a mapping recorded by oft_map() and unpins its file.
+ * @param addr: The address handed out.
+ * @param len: The number of bytes mapped.
+ * @return: 0 on success, -1 if there is no such mapping.
+ */
+int oft_unmap(void *addr, size_t len)
+{
+	pthread_mutex_lock(&sys_oft.lock);
+	struct oft_map **link = &sys_oft.maps;
+	while (*link != NULL &&
+	       ((*link)->addr != addr || (*link)->len != len))
+		link = &(*link)->next;
+	struct oft_map *map = *link;
+	if (map == NULL) {
+		pthread_mutex_unlock(&sys_oft.lock);
+		return -1;
+	}
+	*link = map->next;
+	struct sys_oft_entry *entry = map->entry;
+	atomic_fetch_sub(&entry->maps, 1);
+	slab_free(&sys_oft.map_slab, map);
+	pthread_mutex_unlock(&sys_oft.lock);
+
+	sys_oft_put(entry);
 	return 0;
 }
 
-/* Free the system and process open file tables.
+/* Takes a file off the reclaim list. Files land there when they were
+ * unlinked while open and their last open file entry was closed. The caller
+ * frees the file's blocks. Only one thread may take files off the list at a
+ * time, callers hold the VCB lock. Pushes need no lock.
+ * @return: The FCB of the file, or NULL if the list is empty.
+ */
+struct fcb *oft_reclaim()
+{
+	struct oft_unlinked *unlinked = atomic_load(&reclaim_list);
+	// Pushes only add in front of unlinked, and no one else pops, so the
+	// head seen here cannot come back with a different next
+	while (unlinked != NULL &&
+	       !atomic_compare_exchange_weak(&reclaim_list, &unlinked,
+					     unlinked->next))
+		;
+	if (unlinked == NULL) {
+		return NULL;
+	}
+	struct fcb *fcb = unlinked->fcb;
+	free(unlinked);
+	return fcb;
+}
+
+/* Free the system and process open file tables. Unlinked files that are still
+ * open are moved to the reclaim list, so the caller can free their blocks.
  * @return: void
  */
 void oft_free()
 {
 	// Sys OFT
-	free(sys_oft.entries);
+	struct oft_buckets *buckets = atomic_load(&sys_oft.buckets);
+	for (size_t i = 0; i < buckets->n; ++i) {
+		struct sys_oft_entry *e = atomic_load(&buckets->heads[i]);
+		for (; e != NULL; e = atomic_load(&e->hnext)) {
+			if (e->unlinked != NULL)
+				reclaim_push(e->unlinked);
+			pthread_rwlock_destroy(&e->lock);
+		}
+	}
+	while (buckets != NULL) {
+		struct oft_buckets *old = buckets->old;
+		free(buckets);
+		buckets = old;
+	}
+	slab_destroy(&sys_oft.slab);
+	sys_oft.len = 0;
+	slab_destroy(&sys_oft.map_slab);
+	sys_oft.maps = NULL;
+	pthread_mutex_destroy(&sys_oft.lock);
 
 	// Proc OFTs
-	for (size_t i = 0; i < proc_oft_list.cap; ++i) {
-		if (proc_oft_list.ofts[i].pid != 0)
-			free(proc_oft_list.ofts[i].entries);
+	for (struct proc_oft *oft = proc_oft_list.head; oft != NULL;
+	     oft = oft->next)
+		free(oft->entries);
+	slab_destroy(&proc_oft_list.slab);
+	proc_oft_list.head = NULL;
+	proc_oft_list.len = 0;
+	pthread_mutex_destroy(&proc_oft_list.lock);
+}
+
+/* Find an entry in the system open file table and take a reference to it,
+ * without taking the table's lock. Entries are matched by first block, names
+ * are only unique within a directory. May miss an entry that is being added,
+ * removed or moved, callers fall back to sys_oft_find_locked().
+ * @param key: The first block of the file.
+ * @return: The entry, or NULL if it was not found.
+ */
+static struct sys_oft_entry *sys_oft_find(size_t key)
+{
+	struct oft_buckets *buckets = atomic_load(&sys_oft.buckets);
+	struct sys_oft_entry *e =
+		atomic_load(&buckets->heads[key_hash(key) & (buckets->n - 1)]);
+	for (; e != NULL; e = atomic_load(&e->hnext)) {
+		if (atomic_load(&e->key) != key)
+			continue;
+		// An entry going from 1 to 0 references is being removed, it
+		// must not be brought back
+		unsigned long refs = atomic_load(&e->ref_count);
+		do {
+			if (refs == 0)
+				return NULL;
+		} while (!atomic_compare_exchange_weak(&e->ref_count, &refs,
+						       refs + 1));
+		// The entry may have been freed and reused after its key
+		// was read
+		if (atomic_load(&e->key) == key)
+			return e;
+		sys_oft_put(e);
+		return NULL;
 	}
-	free(proc_oft_list.ofts);
+	return NULL;
 }
 
-/* Find an entry in the system open file table. Uses the file name to find the
- * entry.
- * @param dentry: The dentry of the file to find.
- * @return: The entry in the system open file table, or NULL if the file is not
- * found.
+/* Find an entry in the system open file table. Caller must hold the table's
+ * lock. Every entry in the table then has at least one reference.
+ * @param key: The first block of the file.
+ * @return: The entry, or NULL if the file is not open.
  */
-static struct sys_oft_entry *sys_oft_find(struct dentry *dentry)
+static struct sys_oft_entry *sys_oft_find_locked(size_t key)
 {
-	for (size_t i = 0; i < sys_oft.len; i++) {
-		if (strcmp(sys_oft.entries[i].dentry->file_name,
-			   dentry->file_name) == 0) {
-			return &sys_oft.entries[i];
-		}
+	struct oft_buckets *buckets = atomic_load(&sys_oft.buckets);
+	struct sys_oft_entry *e =
+		atomic_load(&buckets->heads[key_hash(key) & (buckets->n - 1)]);
+	for (; e != NULL; e = atomic_load(&e->hnext)) {
+		if (atomic_load(&e->key) == key)
+			return e;
 	}
 	return NULL;
 }
 
-/* Add an entry to the system open file table.
+/* Add an entry to the system open file table, with one reference. Caller
+ * must hold the table's lock.
  * @param dentry: The dentry of the file to add.
  * @param fcb: The file control block of the file to add.
  * @param oflag: The open flags for the file. (Unused for now)
- * @return: The entry in the system open file table, or NULL if the table is
- * full.
+ * @return: The entry in the system open file table.
  */
 static struct sys_oft_entry *sys_oft_add(struct dentry *dentry, struct fcb *fcb,
 					 int oflag)
 {
-	if (sys_oft.len == sys_oft.cap) {
-		return NULL;
+	struct sys_oft_entry *entry = slab_alloc(&sys_oft.slab);
+	entry->dentry = dentry;
+	entry->fcb = fcb;
+	entry->unlinked = NULL;
+	pthread_rwlock_init(&entry->lock, NULL);
+	atomic_init(&entry->seq, 0);
+	atomic_init(&entry->maps, 0);
+	atomic_init(&entry->ref_count, 1);
+	atomic_store(&entry->key, fcb->start_block_num);
+	if (sys_oft.len >= atomic_load(&sys_oft.buckets)->n)
+		sys_oft_grow();
+	sys_oft_link(entry);
+	++sys_oft.len;
+	return entry;
+}
+
+/* Drops a reference to an entry in the system open file table. The entry is
+ * removed when the last reference is dropped, the only step that takes the
+ * table's lock.
+ * @param entry: The entry.
+ * @return: void
+ */
+static void sys_oft_put(struct sys_oft_entry *entry)
+{
+	unsigned long refs = atomic_load(&entry->ref_count);
+	while (refs > 1) {
+		if (atomic_compare_exchange_weak(&entry->ref_count, &refs,
+						 refs - 1))
+			return;
 	}
 
-	// Find first empty slot
-	for (size_t i = 0; i < sys_oft.cap; ++i) {
-		if (sys_oft.entries[i].dentry == NULL) {
-			struct sys_oft_entry *entry = &sys_oft.entries[i];
-			entry->dentry = dentry;
-			entry->fcb = fcb;
-			atomic_init(&entry->ref_count, 0);
-			++sys_oft.len;
-			return entry;
-		}
+	pthread_mutex_lock(&sys_oft.lock);
+	if (atomic_fetch_sub(&entry->ref_count, 1) != 1) {
+		// Someone took a reference meanwhile
+		pthread_mutex_unlock(&sys_oft.lock);
+		return;
 	}
-	// Out of space. This should not happen if the system is working correctly.
-	return NULL;
+	// The file's blocks are freed by whoever drains the reclaim list, not
+	// here
+	if (entry->unlinked != NULL) {
+		reclaim_push(entry->unlinked);
+		entry->unlinked = NULL;
+	}
+	// Remove from system OFT
+	sys_oft_unlink(entry);
+	pthread_rwlock_destroy(&entry->lock);
+	--sys_oft.len;
+	slab_free(&sys_oft.slab, entry);
+	pthread_mutex_unlock(&sys_oft.lock);
 }
 
-/* Find a process open file table. A process's open file table
- * is identified by its process id.
- * @param pid: The process id of the calling process.
- * @return: The process open file table, or NULL if the table is not found.
+/* Puts an entry at the head of its bucket. Caller must hold the table's lock.
+ * @param entry: The entry.
+ * @return: void
+ */
+static void sys_oft_link(struct sys_oft_entry *entry)
+{
+	struct oft_buckets *buckets = atomic_load(&sys_oft.buckets);
+	size_t key = atomic_load(&entry->key);
+	_Atomic(struct sys_oft_entry *) *head =
+		&buckets->heads[key_hash(key) & (buckets->n - 1)];
+	atomic_store(&entry->hnext, atomic_load(head));
+	// Readers must see hnext before the entry
+	atomic_store(head, entry);
+}
+
+/* Removes an entry from its bucket. Its hnext is left alone, so lookups
+ * standing on it can move on. Caller must hold the table's lock.
+ * @param entry: The entry.
+ * @return: void
  */
-static struct proc_oft *proc_oft_find(pid_t pid)
+static void sys_oft_unlink(struct sys_oft_entry *entry)
 {
-	for (size_t i = 0; i < proc_oft_list.len; ++i) {
-		if (proc_oft_list.ofts[i].pid == pid) {
-			return &proc_oft_list.ofts[i];
+	struct oft_buckets *buckets = atomic_load(&sys_oft.buckets);
+	size_t key = atomic_load(&entry->key);
+	_Atomic(struct sys_oft_entry *) *link =
+		&buckets->heads[key_hash(key) & (buckets->n - 1)];
+	struct sys_oft_entry *e;
+	while ((e = atomic_load(link)) != entry)
+		link = &e->hnext;
+	atomic_store(link, atomic_load(&entry->hnext));
+}
+
+/* Doubles the number of buckets of the system open file table. Entries are
+ * linked into a new bucket array, which replaces the old one once it is
+ * complete. Caller must hold the table's lock.
+ * @return: void
+ */
+static void sys_oft_grow()
+{
+	struct oft_buckets *old = atomic_load(&sys_oft.buckets);
+	struct oft_buckets *buckets = buckets_new(old->n * 2, old);
+	for (size_t i = 0; i < old->n; ++i) {
+		struct sys_oft_entry *e = atomic_load(&old->heads[i]);
+		while (e != NULL) {
+			struct sys_oft_entry *next = atomic_load(&e->hnext);
+			size_t key = atomic_load(&e->key);
+			_Atomic(struct sys_oft_entry *) *head =
+				&buckets->heads[key_hash(key) &
+						(buckets->n - 1)];
+			atomic_store(&e->hnext, atomic_load(head));
+			atomic_store(head, e);
+			e = next;
 		}
 	}
-	return NULL;
+	atomic_store(&sys_oft.buckets, buckets);
 }
 
-/* Add a process open file table to the list of process tables.
+/* Allocates an empty bucket array.
+ * @param n: The number of buckets, a power of 2.
+ * @param old: The bucket array it replaces, freed along with it.
+ * @return: The bucket array.
+ */
+static struct oft_buckets *buckets_new(size_t n, struct oft_buckets *old)
+{
+	struct oft_buckets *buckets =
+		malloc(sizeof(struct oft_buckets) +
+		       n * sizeof(_Atomic(struct sys_oft_entry *)));
+	if (buckets == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	buckets->n = n;
+	buckets->old = old;
+	for (size_t i = 0; i < n; ++i)
+		atomic_init(&buckets->heads[i], NULL);
+	return buckets;
+}
+
+/* Hashes the first block of a file. Files are often on consecutive blocks,
+ * so the bits are mixed before they are masked.
+ * @param key: The first block of the file.
+ * @return: The hash.
+ */
+static inline size_t key_hash(size_t key)
+{
+	key *= 0x9e3779b97f4a7c15UL;
+	return key ^ (key >> 32);
+}
+
+/* Returns the calling process's open file table, cached in TLS when the
+ * table was added.
+ * @return: The process open file table, or NULL if the process has none.
+ */
+static struct proc_oft *proc_oft_self()
+{
+	if (thread_oft_generation != oft_generation)
+		return NULL;
+	return thread_oft;
+}
+
+/* Add a process open file table to the list of process tables, and cache it
+ * as the calling thread's table.
  * @param pid: The process id of the calling process.
- * @return: The process open file table, or NULL if the list of tables is full.
+ * @return: The process open file table.
  */
 static struct proc_oft *proc_oft_add(pid_t pid)
 {
-	if (proc_oft_list.len == proc_oft_list.cap) {
-		return NULL;
-	}
-	// Find first empty slot
-	for (size_t i = 0; i < proc_oft_list.cap; ++i) {
-		if (proc_oft_list.ofts[i].pid == 0) {
-			struct proc_oft *oft = &proc_oft_list.ofts[i];
-			struct proc_oft_entry *entries = malloc(
-				sizeof(struct proc_oft_entry) * PROC_OFT_LEN);
-			if (entries == NULL) {
-				perror("malloc");
-				exit(1);
-			}
-			memset(entries, 0,
-			       sizeof(struct proc_oft_entry) * PROC_OFT_LEN);
-			oft->entries = entries;
-			oft->len = 0;
-			oft->cap = PROC_OFT_LEN;
-			oft->pid = pid;
-			++proc_oft_list.len;
-			return oft;
-		}
+	struct proc_oft_entry *entries =
+		malloc(sizeof(struct proc_oft_entry) * PROC_OFT_LEN);
+	if (entries == NULL) {
+		perror("malloc");
+		exit(1);
 	}
-	return NULL;
+	pthread_mutex_lock(&proc_oft_list.lock);
+	struct proc_oft *oft = slab_alloc(&proc_oft_list.slab);
+	oft->entries = entries;
+	oft->cap = PROC_OFT_LEN;
+	oft->pid = pid;
+	oft->next = proc_oft_list.head;
+	if (proc_oft_list.head != NULL)
+		proc_oft_list.head->prev = oft;
+	proc_oft_list.head = oft;
+	++proc_oft_list.len;
+	pthread_mutex_unlock(&proc_oft_list.lock);
+	thread_oft = oft;
+	thread_oft_generation = oft_generation;
+	return oft;
 }
 
-/* Add an entry to a processes's open file table.
+/* Removes the calling process's open file table. It must be empty.
+ * @param oft: The process open file table.
+ * @return: void
+ */
+static void proc_oft_del(struct proc_oft *oft)
+{
+	free(oft->entries);
+	pthread_mutex_lock(&proc_oft_list.lock);
+	if (oft->prev != NULL)
+		oft->prev->next = oft->next;
+	else
+		proc_oft_list.head = oft->next;
+	if (oft->next != NULL)
+		oft->next->prev = oft->prev;
+	--proc_oft_list.len;
+	slab_free(&proc_oft_list.slab, oft);
+	pthread_mutex_unlock(&proc_oft_list.lock);
+	thread_oft = NULL;
+}
+
+/* Add an entry to a processes's open file table. Reuses the most recently
+ * closed fd, or takes a new one and doubles the table when it is full.
  * @param oft: The process's open file table.
  * @param sys_entry: The entry in the system open file table.
- * @return: The entry in the process open file table, or NULL if the table is
- * full.
+ * @return: The entry in the process open file table, or NULL if every int
+ * is in use as an fd.
  */
 static struct proc_oft_entry *
 proc_oft_entry_add(struct proc_oft *oft, struct sys_oft_entry *sys_entry)
 {
-	if (oft->len == oft->cap) {
-		return NULL;
-	}
-	// Find first empty slot
-	for (size_t i = 0; i < oft->cap; ++i) {
-		if (oft->entries[i].sys_entry == NULL) {
-			struct proc_oft_entry *entry = &oft->entries[i];
-			entry->sys_entry = sys_entry;
-			entry->file_pos = sizeof(struct fcb);
-			++oft->len;
-			return entry;
+	size_t fd;
+	if (oft->free_head) {
+		fd = oft->free_head - 1;
+		oft->free_head = oft->entries[fd].file_pos;
+	} else {
+		if (oft->used == oft->cap) {
+			// fds are ints
+			size_t cap = oft->cap * 2;
+			if (cap > (size_t)INT_MAX + 1)
+				return NULL;
+			struct proc_oft_entry *entries = realloc(
+				oft->entries, sizeof(struct proc_oft_entry) * cap);
+			if (entries == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+			oft->entries = entries;
+			oft->cap = cap;
 		}
+		fd = oft->used++;
 	}
-	return NULL;
+	struct proc_oft_entry *entry = &oft->entries[fd];
+	entry->sys_entry = sys_entry;
+	entry->file_pos = sizeof(struct fcb);
+	++oft->len;
+	return entry;
 }
 
+/* Get an entry from a process's open file table.
+ * @param oft: The process's open file table.
+ * @param fd: The index of the file in the table.
+ * @return: The entry, or NULL if fd is not an open file.
+ */
 static struct proc_oft_entry *proc_oft_entry_get(struct proc_oft *oft, int fd)
 {
-	if (fd >= oft->len)
+	// Closed files leave holes, so fd can be past len
+	if (fd < 0 || fd >= oft->used || oft->entries[fd].sys_entry == NULL)
 		return NULL;
 	return &oft->entries[fd];
 }
+
+/* Pushes a closed unlinked file on the reclaim list.
+ * @param unlinked: The file.
+ * @return: void
+ */
+static void reclaim_push(struct oft_unlinked *unlinked)
+{
+	unlinked->next = atomic_load(&reclaim_list);
+	while (!atomic_compare_exchange_weak(&reclaim_list, &unlinked->next,
+					     unlinked))
+		;
+}
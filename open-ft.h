@@ -1,67 +1,161 @@
 #ifndef SIMPLE_FS_OPEN_FT_H
 #define SIMPLE_FS_OPEN_FT_H
 
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdatomic.h>
 #include <unistd.h>
 
 #include "dir.h"
+#include "slab.h"
 
-// Max 32 files open system-wide
+// The tables grow as needed. System open file table entries are allocated
+// SYS_OFT_LEN at a time, process tables PROC_OFT_LIST_LEN at a time, and a
+// process's fd array starts with PROC_OFT_LEN slots and doubles when full.
 #define SYS_OFT_LEN 32
-// Max 8 processes
 #define PROC_OFT_LIST_LEN 8
-// Max 32 files open per process
 #define PROC_OFT_LEN 32
+// Mappings made by sfs_map() are allocated OFT_MAP_LEN at a time
+#define OFT_MAP_LEN 16
 
 // System-wide open file table. Tracks all open files across the FS.
+// A hash map from a file's first block to its entry. Lookups take no lock,
+// lock only serializes adding, removing and moving entries. Entries come from
+// a slab, so they never move while processes point at them, and a lookup that
+// races a removal still reads an entry, just maybe not the one it wants.
+// Bucket arrays replaced by a bigger one are kept until oft_free() for the
+// same reason. The list of live mappings is kept here too, under lock.
 struct sys_oft {
-  struct sys_oft_entry *entries;
+  struct slab slab;
+  _Atomic(struct oft_buckets *) buckets;
   size_t len;
-  size_t cap;
+  pthread_mutex_t lock;
+  struct slab map_slab;
+  struct oft_map *maps;
+};
+
+// Bucket array of the system open file table. n is a power of 2.
+struct oft_buckets {
+  size_t n;
+  // The array this one replaced
+  struct oft_buckets *old;
+  _Atomic(struct sys_oft_entry *) heads[];
 };
 
 // Entry into the system-wide open file table. Tracks the file's dentry and FCB.
 // A process's open file table will have a reference to this entry.
-// The ref_count is used to track how many processes have the file open.
+// The ref_count is used to track how many processes have the file open. It
+// only drops from 1 to 0 under the table's lock, in the same step that removes
+// the entry, and lookups only take a reference while it is not 0.
+// key is the first block of the file and hnext links the entry's bucket.
+// dentry comes first, it is the field a freed entry's slab link overwrites.
+// lock is held shared while the file is read and exclusive while it is
+// written or moved. seq is odd while a writer holding lock changes the file's
+// data or FCB, so readers that skip the lock can tell they raced a writer.
+// maps counts the file's live mappings, the file is not moved while it is not
+// 0. Each mapping also holds a reference, so the file's blocks are not freed.
 struct sys_oft_entry {
   struct dentry *dentry;
   struct fcb *fcb;
   atomic_ulong ref_count;
+  pthread_rwlock_t lock;
+  atomic_uint seq;
+  atomic_uint maps;
+  // Set when the file was unlinked while open, dentry then points into it
+  struct oft_unlinked *unlinked;
+  atomic_size_t key;
+  _Atomic(struct sys_oft_entry *) hnext;
+};
+
+// A file unlinked while it was open. Keeps a copy of the file's dentry, since
+// its slot in the directory can be reused, and holds on to the file's blocks
+// until the last close puts it on the reclaim list.
+struct oft_unlinked {
+  struct dentry dentry;
+  struct fcb *fcb;
+  struct oft_unlinked *next;
+};
+
+// A pointer into a file's blocks handed out by sfs_map().
+struct oft_map {
+  void *addr;
+  size_t len;
+  struct sys_oft_entry *entry;
+  struct oft_map *next;
 };
 
 // Process open file tables. Holds all the open file talbes for all processes.
+// Tables come from a slab, so the pointers threads cache to their own table
+// stay valid, and are linked in a list. lock guards the slab and the list,
+// threads add and remove their tables at the same time.
 struct proc_oft_list {
-  struct proc_oft *ofts;
+  struct slab slab;
+  struct proc_oft *head;
   size_t len;
-  size_t cap;
+  pthread_mutex_t lock;
 };
 
 // A process's open file table. Tracks all the files a process has open.
 // Processes are identified by their PID.
+// entries[] has cap slots, the first used of them handed out so far. Closed
+// fds are chained through their file_pos from free_head, the first closed fd
+// plus 1 or 0 if none, and reused first.
 struct proc_oft {
   struct proc_oft_entry *entries;
   size_t len;
   size_t cap;
+  size_t used;
+  size_t free_head;
   pid_t pid;
+  struct proc_oft *prev;
+  struct proc_oft *next;
 };
 
 // Entry into the process's open file table.
-// Tracks the system-wide open file table entry and the file's position.
+// Tracks the system-wide open file table entry, the file's position and the
+// flags the fd was opened with.
 struct proc_oft_entry {
   struct sys_oft_entry *sys_entry;
   off_t file_pos;
+  int oflag;
 };
 
 void oft_init();
 
 int oft_open(struct dentry *dentry, struct fcb *fcb, int oflag);
 
+struct sys_oft_entry *oft_acquire(struct dentry *dentry, struct fcb *fcb,
+				  int oflag);
+
+int oft_install(struct sys_oft_entry *entry, int oflag);
+
 struct proc_oft_entry *oft_get(int fd);
 
 int oft_close(int fd);
 
+struct sys_oft_entry *oft_detach(int fd);
+
+int oft_unlink(struct dentry *dentry);
+
+struct sys_oft_entry *oft_lookup(struct dentry *dentry);
+
+void oft_hold(struct sys_oft_entry *entry);
+
+void oft_put(struct sys_oft_entry *entry);
+
+void oft_relocate(struct sys_oft_entry *entry, struct fcb *fcb);
+
+void oft_write_begin(struct sys_oft_entry *entry);
+
+void oft_write_end(struct sys_oft_entry *entry);
+
+void oft_map(struct sys_oft_entry *entry, void *addr, size_t len);
+
+int oft_unmap(void *addr, size_t len);
+
+struct fcb *oft_reclaim();
+
 void oft_free();
 
 #endif // SIMPLE_FS_OPEN_FT_H
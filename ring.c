@@ -0,0 +1,343 @@
+// For pthread_rwlock_t
+#define _POSIX_C_SOURCE 200809L
+
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Requests are submitted in batches by the thread that owns a ring, run by a
+ * pool of worker threads shared by all rings, and handed back through the
+ * ring's completion ring in the order they finish. Requests of one batch may
+ * run at the same time, callers that need one done before another wait for
+ * its completion first.
+ */
+
+// Worker pool, requests wait in a FIFO between pool_head and pool_tail
+static pthread_t *pool_threads = NULL;
+static size_t pool_len = 0;
+static struct ring_op *pool_head = NULL;
+static struct ring_op *pool_tail = NULL;
+static int pool_running = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static int ring_prepare(struct ring_op *op);
+static void ring_complete(struct ring_op *op);
+static int ring_reap(struct sfs_ring *ring, struct sfs_cqe *cqe, int wait,
+		     int install);
+static void pool_push(struct ring_op *head, struct ring_op *tail);
+static void *pool_worker(void *arg);
+
+/* Create a submission ring for the calling thread. Requests on the ring use
+ * the calling thread's file descriptors, so only it may use the ring.
+ * @param entries: The number of requests that can be queued or in flight at
+ * once, a power of 2 up to SFS_RING_MAX.
+ * @return: The ring, or NULL if entries is invalid.
+ */
+struct sfs_ring *sfs_ring_create(unsigned int entries)
+{
+	if (entries == 0 || entries > SFS_RING_MAX ||
+	    (entries & (entries - 1))) {
+		return NULL;
+	}
+	struct sfs_ring *ring = malloc(sizeof(struct sfs_ring));
+	struct sfs_sqe *sq = malloc(entries * sizeof(struct sfs_sqe));
+	struct ring_op *ops = malloc(entries * sizeof(struct ring_op));
+	struct ring_op **cq = malloc(entries * sizeof(struct ring_op *));
+	if (ring == NULL || sq == NULL || ops == NULL || cq == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	ring->entries = entries;
+	ring->sq = sq;
+	ring->sq_head = 0;
+	ring->sq_tail = 0;
+	ring->ops = ops;
+	ring->free_ops = NULL;
+	for (unsigned int i = entries; i > 0; --i) {
+		ops[i - 1].ring = ring;
+		ops[i - 1].next = ring->free_ops;
+		ring->free_ops = &ops[i - 1];
+	}
+	ring->inflight = 0;
+	ring->cq = cq;
+	ring->cq_head = 0;
+	ring->cq_tail = 0;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	return ring;
+}
+
+/* Destroy a ring. Waits for the requests in flight, files they opened are
+ * closed again. Requests that were never submitted are dropped.
+ * @param ring: The ring.
+ * @return: void
+ */
+void sfs_ring_destroy(struct sfs_ring *ring)
+{
+	struct sfs_cqe cqe;
+	while (ring_reap(ring, &cqe, 1, 0) == 0)
+		;
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring->cq);
+	free(ring->ops);
+	free(ring->sq);
+	free(ring);
+}
+
+/* Get the next free submission entry of a ring. It is zeroed and queued, fill
+ * it in before calling sfs_ring_submit().
+ * @param ring: The ring.
+ * @return: The entry, or NULL if the submission ring is full.
+ */
+struct sfs_sqe *sfs_ring_get_sqe(struct sfs_ring *ring)
+{
+	if (ring->sq_tail - ring->sq_head == ring->entries) {
+		return NULL;
+	}
+	struct sfs_sqe *sqe = &ring->sq[ring->sq_tail++ & (ring->entries - 1)];
+	memset(sqe, 0, sizeof(struct sfs_sqe));
+	return sqe;
+}
+
+/* Hand the queued submission entries to the worker pool. Entries stay queued
+ * while entries requests are in flight. File descriptors are looked up here,
+ * a close takes effect here. If no worker pool is running the requests are
+ * run before this returns.
+ * @param ring: The ring.
+ * @return: The number of requests submitted.
+ */
+int sfs_ring_submit(struct sfs_ring *ring)
+{
+	struct ring_op *head = NULL;
+	struct ring_op *tail = NULL;
+	int submitted = 0;
+	while (ring->sq_head != ring->sq_tail && ring->free_ops != NULL) {
+		struct ring_op *op = ring->free_ops;
+		ring->free_ops = op->next;
+		op->sqe = ring->sq[ring->sq_head++ & (ring->entries - 1)];
+		op->file = NULL;
+		op->res = -1;
+		op->next = NULL;
+		++ring->inflight;
+		++submitted;
+		if (ring_prepare(op)) {
+			ring_complete(op);
+			continue;
+		}
+		if (tail != NULL)
+			tail->next = op;
+		else
+			head = op;
+		tail = op;
+	}
+	if (head != NULL)
+		pool_push(head, tail);
+	return submitted;
+}
+
+/* Take a completion off a ring without waiting.
+ * @param ring: The ring.
+ * @param cqe: Set to the completion.
+ * @return: 0 if a completion was taken, -1 if none is ready.
+ */
+int sfs_ring_peek_cqe(struct sfs_ring *ring, struct sfs_cqe *cqe)
+{
+	return ring_reap(ring, cqe, 0, 1);
+}
+
+/* Take a completion off a ring, waiting for one if requests are in flight.
+ * @param ring: The ring.
+ * @param cqe: Set to the completion.
+ * @return: 0 if a completion was taken, -1 if nothing is in flight.
+ */
+int sfs_ring_wait_cqe(struct sfs_ring *ring, struct sfs_cqe *cqe)
+{
+	return ring_reap(ring, cqe, 1, 1);
+}
+
+/* Start the worker pool that runs submitted requests.
+ * @param workers: The number of worker threads.
+ * @return: 0 on success, -1 if the pool is already running, workers is 0 or
+ * the threads could not be started.
+ */
+int ring_pool_start(size_t workers)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (pool_running || workers == 0) {
+		pthread_mutex_unlock(&pool_lock);
+		return -1;
+	}
+	pool_threads = malloc(workers * sizeof(pthread_t));
+	if (pool_threads == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	pool_running = 1;
+	for (pool_len = 0; pool_len < workers; ++pool_len) {
+		if (pthread_create(&pool_threads[pool_len], NULL, pool_worker,
+				   NULL))
+			break;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	if (pool_len < workers) {
+		ring_pool_stop();
+		return -1;
+	}
+	return 0;
+}
+
+/* Stop the worker pool and wait for its threads to exit. Requests already
+ * handed to the pool are run first. Does nothing if the pool is not running.
+ * @return: void
+ */
+void ring_pool_stop()
+{
+	pthread_mutex_lock(&pool_lock);
+	if (!pool_running) {
+		pthread_mutex_unlock(&pool_lock);
+		return;
+	}
+	pool_running = 0;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+	for (size_t i = 0; i < pool_len; ++i)
+		pthread_join(pool_threads[i], NULL);
+	free(pool_threads);
+	pool_threads = NULL;
+	pool_len = 0;
+}
+
+/* Does the part of a request that needs the submitting thread: its fd is
+ * turned into a reference to the file.
+ * @param op: The request.
+ * @return: 0 if the request can go to the workers, -1 if it failed already.
+ */
+static int ring_prepare(struct ring_op *op)
+{
+	struct proc_oft_entry *entry;
+	switch (op->sqe.opcode) {
+	case SFS_OP_READ:
+	case SFS_OP_WRITE:
+		entry = oft_get(op->sqe.fd);
+		if (entry == NULL)
+			return -1;
+		op->file = entry->sys_entry;
+		oft_hold(op->file);
+		return 0;
+	case SFS_OP_OPEN:
+		return op->sqe.path != NULL ? 0 : -1;
+	case SFS_OP_CLOSE:
+		op->file = oft_detach(op->sqe.fd);
+		return op->file != NULL ? 0 : -1;
+	default:
+		return -1;
+	}
+}
+
+/* Puts a finished request on its ring's completion ring.
+ * @param op: The request.
+ * @return: void
+ */
+static void ring_complete(struct ring_op *op)
+{
+	struct sfs_ring *ring = op->ring;
+	pthread_mutex_lock(&ring->lock);
+	ring->cq[ring->cq_tail++ & (ring->entries - 1)] = op;
+	pthread_cond_signal(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/* Takes a completion off a ring and frees its request.
+ * @param ring: The ring.
+ * @param cqe: Set to the completion.
+ * @param wait: Non-zero to wait for a completion while requests are in
+ * flight.
+ * @param install: Non-zero to give files opened by the request an fd, 0 to
+ * close them.
+ * @return: 0 if a completion was taken, -1 otherwise.
+ */
+static int ring_reap(struct sfs_ring *ring, struct sfs_cqe *cqe, int wait,
+		     int install)
+{
+	pthread_mutex_lock(&ring->lock);
+	while (wait && ring->cq_head == ring->cq_tail && ring->inflight)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	if (ring->cq_head == ring->cq_tail) {
+		pthread_mutex_unlock(&ring->lock);
+		return -1;
+	}
+	struct ring_op *op = ring->cq[ring->cq_head++ & (ring->entries - 1)];
+	pthread_mutex_unlock(&ring->lock);
+
+	if (op->sqe.opcode == SFS_OP_OPEN && op->file != NULL) {
+		if (install)
+			op->res = oft_install(op->file, op->sqe.flags);
+		else
+			oft_put(op->file);
+	}
+	cqe->res = op->res;
+	cqe->user_data = op->sqe.user_data;
+	op->next = ring->free_ops;
+	ring->free_ops = op;
+	--ring->inflight;
+	return 0;
+}
+
+/* Hands a chain of requests to the worker pool, or runs them right away if
+ * it is not running.
+ * @param head: The first request.
+ * @param tail: The last request.
+ * @return: void
+ */
+static void pool_push(struct ring_op *head, struct ring_op *tail)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (!pool_running) {
+		pthread_mutex_unlock(&pool_lock);
+		while (head != NULL) {
+			struct ring_op *next = head->next;
+			ring_exec(head);
+			ring_complete(head);
+			head = next;
+		}
+		return;
+	}
+	if (pool_tail != NULL)
+		pool_tail->next = head;
+	else
+		pool_head = head;
+	pool_tail = tail;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Worker thread of the pool. Runs requests until the pool is stopped and no
+ * requests are left.
+ * @param arg: Unused.
+ * @return: NULL
+ */
+static void *pool_worker(void *arg)
+{
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (pool_head == NULL && pool_running)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		struct ring_op *op = pool_head;
+		if (op == NULL)
+			break;
+		pool_head = op->next;
+		if (pool_head == NULL)
+			pool_tail = NULL;
+		pthread_mutex_unlock(&pool_lock);
+
+		ring_exec(op);
+		ring_complete(op);
+		pthread_mutex_lock(&pool_lock);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef SIMPLE_FS_RING_H
+#define SIMPLE_FS_RING_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "open-ft.h"
+#include "simple-fs.h"
+
+// A submitted request. Requests that work on an fd hold a reference to the
+// file's system open file table entry in file, taken when they are submitted,
+// since the fd only means something to the thread that owns the ring. An open
+// leaves its reference in file for the owner to turn into an fd when it reaps
+// the completion. next links the worker queue and the ring's free list.
+struct ring_op {
+  struct sfs_sqe sqe;
+  struct sys_oft_entry *file;
+  ssize_t res;
+  struct sfs_ring *ring;
+  struct ring_op *next;
+};
+
+// Submission and completion rings of one thread. entries is a power of 2.
+// Only the owning thread touches the submission ring, the free list and
+// inflight. The completion ring is filled by the workers under lock, it
+// cannot overflow since at most entries requests are in flight.
+struct sfs_ring {
+  unsigned int entries;
+  struct sfs_sqe *sq;
+  unsigned int sq_head;
+  unsigned int sq_tail;
+  struct ring_op *ops;
+  struct ring_op *free_ops;
+  unsigned int inflight;
+  struct ring_op **cq;
+  unsigned int cq_head;
+  unsigned int cq_tail;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+void ring_exec(struct ring_op *op);
+
+#endif // SIMPLE_FS_RING_H
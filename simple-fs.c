@@ -1,29 +1,48 @@
+// For clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
 #include "simple-fs.h"
 
+#include <limits.h>
 #include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 
+#include "bcache.h"
+#include "copy.h"
+#include "dcache.h"
+#include "defrag.h"
 #include "dir.h"
 #include "open-ft.h"
+#include "ring.h"
 #include "vcb.h"
+#include "volume.h"
 
-// For finding first free blocks. Skip first 3 blocks
-// since they are reserved for VCB and dentry table
-#define FIRST_DATA_BLOCK_IDX 3
+// Attempts of a lock-free read before falling back to the file's lock
+#define READ_RETRIES 4
 
 /* Locking Scheme: CALL lock_all() and unlock_all() to make sure
  * locks are done in correct order.
  * 1. vcb_lock
  * 2. dentry_table_lock
- * 3. open_file_table_lock
+ * 3. The rwlock of an open file (sys_oft_entry.lock)
  * Unlock in reverse order
+ * Only namespace changes and allocation take every global lock. read(),
+ * write() and lseek() look up the fd in the caller's own table without a
+ * lock, then take the file's rwlock: shared to read, exclusive to write.
+ * pread() and pwrite() do the same without touching the fd's offset. A write
+ * that grows the file or writes blocks shared with a clone drops the file's
+ * rwlock and takes vcb_lock first. sfs_copy_range() locks two files, in
+ * address order. The open file table guards itself, open() only holds
+ * dentry_table_lock to resolve the path and close() takes no lock here.
  */
 static pthread_mutex_t vcb_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t dentry_table_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t open_file_table_lock = PTHREAD_MUTEX_INITIALIZER;
 
 inline void lock_all();
 
@@ -31,19 +50,56 @@ void lock_all()
 {
 	pthread_mutex_lock(&vcb_lock);
 	pthread_mutex_lock(&dentry_table_lock);
-	pthread_mutex_lock(&open_file_table_lock);
 }
 
 inline void unlock_all();
 
 void unlock_all()
 {
-	pthread_mutex_unlock(&open_file_table_lock);
 	pthread_mutex_unlock(&dentry_table_lock);
 	pthread_mutex_unlock(&vcb_lock);
 }
 
-static int find_free_blocks(size_t *start, size_t blocks);
+static int alloc_blocks(size_t goal, size_t want, size_t *start, size_t *got);
+static void reclaim_blocks();
+static void *defrag_thread(void *arg);
+static int create_file(const char *path, size_t blocks, size_t *run_start,
+		       size_t *run_len);
+static struct sys_oft_entry *open_file(const char *path, int oflag);
+static struct dentry *lookup_file(const char *path);
+static ssize_t read_file(const char *path, void *buf, size_t nbytes);
+static ssize_t read_at(struct sys_oft_entry *file, off_t pos,
+		       const struct iovec *iov, int iovcnt);
+static ssize_t write_at(struct sys_oft_entry *file, off_t *pos,
+			const struct iovec *iov, int iovcnt, int vcb_held);
+static int write_needs_vcb(struct fcb *fcb, size_t pos, size_t nbytes);
+static int make_room(struct sys_oft_entry *file, size_t pos, size_t nbytes);
+static int iov_total(const struct iovec *iov, int iovcnt, size_t *total);
+static ssize_t read_optimistic(struct sys_oft_entry *file, off_t pos,
+			       const struct iovec *iov, int iovcnt);
+static ssize_t file_read(struct fcb *fcb, off_t pos, const struct iovec *iov,
+			 int iovcnt);
+static void defrag_kick();
+static int fill_holes(struct fcb *fcb, size_t lblk, size_t count);
+static int zero_range(struct fcb *fcb, size_t pos, size_t nbytes);
+static int unshare_blocks(struct fcb *fcb, size_t lblk, size_t count);
+static size_t block_span(size_t pos, size_t nbytes);
+static size_t max_file_blocks();
+static void lock_pair(struct sys_oft_entry *src, struct sys_oft_entry *dst);
+static void unlock_pair(struct sys_oft_entry *src, struct sys_oft_entry *dst);
+static size_t file_copy(struct fcb *fcb, off_t pos, char *buf, size_t nbytes,
+			int to_file);
+static int mount_volume(const char *path, size_t block_size,
+			size_t block_count, size_t cache_blocks);
+static int format_fs(size_t block_size, size_t block_count);
+static int geometry_valid(size_t block_size, size_t block_count);
+static inline char *block_ptr(size_t block_num);
+static const char *path_next(const char *path, char *name);
+static struct dentry_table *path_parent(const char *path, char *name,
+					size_t *parent_id);
+static struct dentry *dir_lookup(struct dentry_table *table, size_t parent_id,
+				 const char *name);
+static inline struct dentry_table *dir_table(struct dentry *dir);
 
 // TODO: Maybe extern these in impl files so
 // vcb and dentry don't have to be passed around
@@ -51,70 +107,150 @@ struct vcb *vcb = NULL;
 struct dentry_table *dentry_table = NULL;
 
 /* Raw blocks for storage. These blocks mimic a disk.
- * Block 0 will always be the VCB.
- * Block 1-2 will always be the dentry table.
+ * The VCB always starts on block 0, followed by the dentry table.
+ * Allocated by init_fs(), or a mapping of the volume image when the volume
+ * was mounted with mount_fs().
  */
-char raw_blocks[BLOCK_COUNT][BLOCK_SIZE];
+char *raw_blocks = NULL;
+// Size of raw_blocks in bytes
+static size_t volume_size = 0;
+// Set when raw_blocks is a mapping of a volume image
+static int volume_mapped = 0;
+// Image file descriptor the block cache reads and writes, -1 if no cache
+static int volume_fd = -1;
 
-/* Create a file in the file system with the given name and number of blocks.
- * @param name: The name of the file to create. The name should be less than 7
- * characters.
- * @param blocks: The number of blocks to allocate for the file.
- * @return: void
+/* Defragmenter thread state. defrag_lock only guards these variables, it is
+ * never held while taking the file system locks.
+ */
+static pthread_t defrag_tid;
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_cond = PTHREAD_COND_INITIALIZER;
+static int defrag_running = 0;
+// Set when blocks were freed since the defragmenter last looked
+static int defrag_kicked = 0;
+static size_t defrag_max_blocks;
+static unsigned int defrag_pause_ms;
+
+/* Create a sparse file in the file system at the given path and with the
+ * given number of blocks. The file reads back zeroes until it is written.
+ * @param path: The path of the file to create, such as "/a/b/file". Every
+ * directory on the path must exist. Components longer than
+ * MAX_FILE_NAME_LEN - 1 characters are truncated.
+ * @param blocks: The size of the file in blocks. Only the first block, which
+ * holds the FCB, is allocated, the rest is a hole until it is written or
+ * preallocated with fallocate(). The file can grow past this when it is
+ * written.
+ * @return: 0 on success, -1 if a file with the same path exists, the parent
+ * directory does not exist, there is no space for the file or its size in
+ * bytes would not fit in an off_t.
+ */
+int create(const char *path, size_t blocks)
+{
+	lock_all();
+	int res = create_file(path, blocks, NULL, NULL);
+	unlock_all();
+	return res;
+}
+
+/* Create a directory at the given path. A directory is a file whose blocks
+ * hold a dentry table, so the number of blocks sets how many entries it can
+ * hold. Its blocks are always contiguous.
+ * @param path: The path of the directory to create, such as "/a/b". Every
+ * directory on the path must exist.
+ * @param blocks: The number of blocks to allocate for the directory.
+ * @return: 0 on success, -1 if a file with the same path exists, the parent
+ * directory does not exist or there is no space for the directory.
  */
-void create(const char *name, size_t blocks)
+int mkdir(const char *path, size_t blocks)
 {
+	char name[MAX_FILE_NAME_LEN];
+	size_t parent_id;
 	lock_all();
 
-	size_t start;
-	if (find_free_blocks(&start, blocks)) {
-		// No space for file
-		return;
+	struct dentry_table *parent = path_parent(path, name, &parent_id);
+	if (parent == NULL || dir_lookup(parent, parent_id, name) != NULL) {
+		unlock_all();
+		return -1;
 	}
 
-	// Mark blocks as used
-	for (int j = start; j < start + blocks; ++j) {
-		// This alters free block count in VCB
-		vcb_set_block_free(vcb, j, 0);
+	if (blocks == 0)
+		blocks = 1;
+	size_t start;
+	reclaim_blocks();
+	if (vcb_alloc(vcb, blocks, &start)) {
+		unlock_all();
+		return -1;
 	}
+	memset(block_ptr(start), 0, blocks * vcb->block_size);
+	struct fcb *fcb = (struct fcb *)block_ptr(start);
+	fcb_init(fcb, start, blocks);
+	dentry_table_init((struct dentry_table *)(block_ptr(start) +
+						  sizeof(struct fcb)),
+			  blocks * vcb->block_size - sizeof(struct fcb));
 
-	// Add entry in dentry table
 	struct dentry entry = {
 		.start_block_num = start,
 		.file_size = blocks,
+		.type = DENTRY_DIR,
 	};
 	strncpy(entry.file_name, name, MAX_FILE_NAME_LEN);
-	// Ensure null-terminated string
-	entry.file_name[MAX_FILE_NAME_LEN - 1] = '\0';
-	dentry_add(dentry_table, &entry);
-
-	// Initialize FCB
-	char *block = raw_blocks[start];
-	struct fcb *fcb = (struct fcb *)block;
-	fcb->file_size = blocks;
-	fcb->start_block_num = start;
+	int res = dentry_add(parent, &entry);
+	if (res) {
+		fcb_free_blocks(fcb);
+	}
 
 	unlock_all();
-
-	return;
+	return res;
 }
 
 /* Open a file for reading and/or writing.
- * @param name: The name of the file to open.
- * @param oflag: The open flags for the file. (Unused for now)
+ * @param path: The path of the file to open, such as "/a/b/file". Directories
+ * cannot be opened.
+ * @param oflag: The open flags for the file descriptor, 0 or SFS_O_APPEND.
  * @return: The file descriptor for the file, or -1 if the file could not be
  * opened.
  */
-int open(const char *name, int oflag)
+int open(const char *path, int oflag)
 {
+	struct sys_oft_entry *file = open_file(path, oflag);
+	if (file == NULL) {
+		return -1;
+	}
+	return oft_install(file, oflag);
+}
+
+/* Remove a file or an empty directory. The name can be reused right away. A
+ * file that is still open keeps its blocks until it is last closed, open file
+ * descriptors keep reading and writing it until then.
+ * @param path: The path of the file to remove.
+ * @return: 0 on success, -1 if the file does not exist or is a directory that
+ * is not empty.
+ */
+int unlink(const char *path)
+{
+	char name[MAX_FILE_NAME_LEN];
+	size_t parent_id;
 	lock_all();
-	struct dentry *entry = dentry_get(dentry_table, name);
-	unlock_all();
-	if (entry == NULL) {
+
+	struct dentry_table *parent = path_parent(path, name, &parent_id);
+	struct dentry *entry =
+		parent != NULL ? dir_lookup(parent, parent_id, name) : NULL;
+	if (entry == NULL ||
+	    (entry->type == DENTRY_DIR && dir_table(entry)->num_entries != 0)) {
+		unlock_all();
 		return -1;
 	}
-	struct fcb *file_fcb = (struct fcb *)raw_blocks[entry->start_block_num];
-	return oft_open(entry, file_fcb, 0);
+
+	struct fcb *fcb = (struct fcb *)block_ptr(entry->start_block_num);
+	dcache_invalidate(parent_id, name);
+	if (!oft_unlink(entry)) {
+		fcb_free_blocks(fcb);
+		defrag_kick();
+	}
+	dentry_remove(parent, name);
+
+	unlock_all();
+	return 0;
 }
 
 /* Closes a previously opened file.
@@ -123,10 +259,7 @@ int open(const char *name, int oflag)
  */
 int close(int fd)
 {
-	lock_all();
-	int res = oft_close(fd);
-	unlock_all();
-	return res;
+	return oft_close(fd);
 }
 
 /* Read from a file at the current file offset. If the file offset is at the end
@@ -136,112 +269,713 @@ int close(int fd)
  * @param buf: The buffer to read into.
  * @param nbytes: The number of bytes to read. The buffer should be at least
  * this size.
- * @return: The number of bytes read, -1 if the file could not be read, or EOF
- * if the file offset is at the end of the file after the read.
+ * @return: The number of bytes read, 0 if the file offset is at the end of the
+ * file, or -1 if the file could not be read.
  */
 ssize_t read(int fd, void *buf, size_t nbytes)
 {
-	lock_all();
-
 	struct proc_oft_entry *entry = oft_get(fd);
 	if (entry == NULL || buf == NULL) {
 		return -1;
 	}
-	struct fcb *fcb = entry->sys_entry->fcb;
-	// Make sure we don't read past the end of the file
-	size_t max_file_size = fcb->file_size * BLOCK_SIZE;
-	if (nbytes > max_file_size - entry->file_pos) {
-		nbytes = max_file_size - entry->file_pos;
+	struct iovec iov = { .iov_base = buf, .iov_len = nbytes };
+	ssize_t bytes_read = read_at(entry->sys_entry, entry->file_pos, &iov, 1);
+
+	// Update file position
+	if (bytes_read > 0)
+		entry->file_pos += bytes_read;
+	return bytes_read;
+}
+
+/* Write to a file at the current file offset. The file grows when the write
+ * goes past its end, new blocks are taken next to the file's last extent when
+ * they are free and from anywhere on the volume otherwise. Call lseek to set
+ * the file offset prior to writing. If fd was opened with SFS_O_APPEND the
+ * data goes to the end of the file's data instead, and the file offset is
+ * left after it.
+ * @param fd: The file descriptor of the file to write to.
+ * @param buf: The buffer to write from.
+ * @param nbytes: The number of bytes to write.
+ * @return: The number of bytes written, which is less than nbytes if the
+ * volume ran out of space, or -1 if the file could not be written to.
+ */
+ssize_t write(int fd, const void *buf, size_t nbytes)
+{
+	struct proc_oft_entry *entry = oft_get(fd);
+	if (entry == NULL || buf == NULL) {
+		return -1;
 	}
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = nbytes };
+	off_t pos = entry->oflag & SFS_O_APPEND ? -1 : entry->file_pos;
+	ssize_t bytes_written = write_at(entry->sys_entry, &pos, &iov, 1, 0);
 
-	// Get current file position
-	off_t current_pos = entry->file_pos;
-	//Calculate the starting block and offset within that block
-	size_t block_idx = fcb->start_block_num;
-	size_t offset = current_pos % BLOCK_SIZE;
-	ssize_t bytes_read = 0;
+	// Update file position
+	if (bytes_written > 0)
+		entry->file_pos = pos + bytes_written;
+	return bytes_written;
+}
 
-	while (bytes_read < nbytes) {
-		size_t current_block = block_idx;
-		size_t remaining_bytes = nbytes - bytes_read;
-		size_t read_size = remaining_bytes;
+/* Read from a file at a given offset. The file offset is neither used nor
+ * changed, so threads sharing a file descriptor can read from it at the same
+ * time.
+ * @param fd: The file descriptor of the file to read from.
+ * @param buf: The buffer to read into.
+ * @param nbytes: The number of bytes to read.
+ * @param offset: The offset to read from, counted like lseek() offsets.
+ * @return: The number of bytes read, 0 if offset is at or past the end of the
+ * file, or -1 if the file could not be read or offset is before the start of
+ * the file's data.
+ */
+ssize_t pread(int fd, void *buf, size_t nbytes, off_t offset)
+{
+	struct proc_oft_entry *entry = oft_get(fd);
+	if (entry == NULL || buf == NULL || offset < (off_t)sizeof(struct fcb)) {
+		return -1;
+	}
+	struct iovec iov = { .iov_base = buf, .iov_len = nbytes };
+	return read_at(entry->sys_entry, offset, &iov, 1);
+}
 
-		memcpy(buf + bytes_read, &raw_blocks[current_block][offset],
-		       read_size);
+/* Write to a file at a given offset. The file offset is neither used nor
+ * changed. The file grows like it does for write().
+ * @param fd: The file descriptor of the file to write to.
+ * @param buf: The buffer to write from.
+ * @param nbytes: The number of bytes to write.
+ * @param offset: The offset to write at, counted like lseek() offsets.
+ * @return: The number of bytes written, which is less than nbytes if the
+ * volume ran out of space, or -1 if the file could not be written to or
+ * offset is before the start of the file's data.
+ */
+ssize_t pwrite(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+	struct proc_oft_entry *entry = oft_get(fd);
+	if (entry == NULL || buf == NULL || offset < (off_t)sizeof(struct fcb)) {
+		return -1;
+	}
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = nbytes };
+	return write_at(entry->sys_entry, &offset, &iov, 1, 0);
+}
 
-		bytes_read += read_size;
+/* Read from a file at the current file offset into several buffers, filling
+ * each before moving on to the next. The file is looked up and locked once
+ * for all of them.
+ * @param fd: The file descriptor of the file to read from.
+ * @param iov: The buffers to read into.
+ * @param iovcnt: The number of buffers, at most SFS_IOV_MAX.
+ * @return: The number of bytes read, 0 if the file offset is at the end of the
+ * file, or -1 if the file could not be read or the buffers are invalid.
+ */
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct proc_oft_entry *entry = oft_get(fd);
+	size_t total;
+	if (entry == NULL || iov_total(iov, iovcnt, &total)) {
+		return -1;
+	}
+	ssize_t bytes_read =
+		read_at(entry->sys_entry, entry->file_pos, iov, iovcnt);
 
-		current_pos += read_size;
-		block_idx = (current_pos / BLOCK_SIZE) + fcb->start_block_num;
-		offset = current_pos % BLOCK_SIZE;
+	// Update file position
+	if (bytes_read > 0)
+		entry->file_pos += bytes_read;
+	return bytes_read;
+}
 
-		if (read_size == 0)
-			break;
+/* Write to a file at the current file offset from several buffers, in order.
+ * The file grows once for all of them. Appends like write() if fd was opened
+ * with SFS_O_APPEND.
+ * @param fd: The file descriptor of the file to write to.
+ * @param iov: The buffers to write from.
+ * @param iovcnt: The number of buffers, at most SFS_IOV_MAX.
+ * @return: The number of bytes written, which is less than the total if the
+ * volume ran out of space, or -1 if the file could not be written to or the
+ * buffers are invalid.
+ */
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct proc_oft_entry *entry = oft_get(fd);
+	size_t total;
+	if (entry == NULL || iov_total(iov, iovcnt, &total)) {
+		return -1;
 	}
+	off_t pos = entry->oflag & SFS_O_APPEND ? -1 : entry->file_pos;
+	ssize_t bytes_written =
+		write_at(entry->sys_entry, &pos, iov, iovcnt, 0);
 
 	// Update file position
-	entry->file_pos = current_pos;
+	if (bytes_written > 0)
+		entry->file_pos = pos + bytes_written;
+	return bytes_written;
+}
 
-	unlock_all();
-	return bytes_read;
+/* readv() at a given offset. The file offset is neither used nor changed.
+ * @param fd: The file descriptor of the file to read from.
+ * @param iov: The buffers to read into.
+ * @param iovcnt: The number of buffers, at most SFS_IOV_MAX.
+ * @param offset: The offset to read from, counted like lseek() offsets.
+ * @return: The number of bytes read, or -1 if the file could not be read, the
+ * buffers are invalid or offset is before the start of the file's data.
+ */
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct proc_oft_entry *entry = oft_get(fd);
+	size_t total;
+	if (entry == NULL || iov_total(iov, iovcnt, &total) ||
+	    offset < (off_t)sizeof(struct fcb)) {
+		return -1;
+	}
+	return read_at(entry->sys_entry, offset, iov, iovcnt);
 }
 
-/* Write to a file at the current file offset. If the number of bytes
- * to be written is greater than the number of bytes to the end of the file,
- * an error will occur. Call lseek to set the file offset prior to writing.
+/* writev() at a given offset. The file offset is neither used nor changed.
  * @param fd: The file descriptor of the file to write to.
- * @param buf: The buffer to write from.
- * @param nbytes: The number of bytes to write.
- * @return: The number of bytes written or -1 if the file could not be written
- * to.
+ * @param iov: The buffers to write from.
+ * @param iovcnt: The number of buffers, at most SFS_IOV_MAX.
+ * @param offset: The offset to write at, counted like lseek() offsets.
+ * @return: The number of bytes written, or -1 if the file could not be written
+ * to, the buffers are invalid or offset is before the start of the file's
+ * data.
  */
-ssize_t write(int fd, const void *buf, size_t nbytes)
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct proc_oft_entry *entry = oft_get(fd);
+	size_t total;
+	if (entry == NULL || iov_total(iov, iovcnt, &total) ||
+	    offset < (off_t)sizeof(struct fcb)) {
+		return -1;
+	}
+	return write_at(entry->sys_entry, &offset, iov, iovcnt, 0);
+}
+
+/* Map part of a file into the caller's memory. The returned pointer points
+ * straight at the file's blocks, so reading or writing through it copies
+ * nothing. Only a range stored on contiguous blocks can be mapped. The file
+ * is not moved and keeps its blocks until sfs_unmap() is called, even if it
+ * is closed or unlinked first. Writes through the pointer are not ordered
+ * with read() and write() on the file.
+ * @param fd: The file descriptor of the file to map.
+ * @param offset: The offset of the range, counted like lseek() offsets.
+ * @param len: The length of the range in bytes.
+ * @return: Pointer to the first byte of the range, or NULL if the range is
+ * empty, reaches past the end of the file, not on contiguous blocks, in a
+ * hole or shared with a clone and there is no space to copy it. On a volume
+ * mounted with mount_fs_cached() the rest of the file lives in the block
+ * cache, so NULL is also returned for ranges past the file's first block.
+ */
+void *sfs_map(int fd, off_t offset, size_t len)
+{
+	struct proc_oft_entry *entry = oft_get(fd);
+	if (entry == NULL || len == 0 || offset < (off_t)sizeof(struct fcb) ||
+	    (bcache_active() && offset + len > vcb->block_size)) {
+		return NULL;
+	}
+	struct sys_oft_entry *file = entry->sys_entry;
+	size_t block_size = vcb->block_size;
+	size_t lblk = offset / block_size;
+	pthread_rwlock_rdlock(&file->lock);
+	struct fcb *fcb = file->fcb;
+	// Stores past the end could never be read back, and growing the file
+	// must find zeroes there
+	if (offset + len > fcb->data_end) {
+		pthread_rwlock_unlock(&file->lock);
+		return NULL;
+	}
+	if (fcb_shared(fcb, lblk, block_span(offset, len))) {
+		// Stores through the pointer must not reach the clones
+		pthread_rwlock_unlock(&file->lock);
+		pthread_mutex_lock(&vcb_lock);
+		pthread_rwlock_wrlock(&file->lock);
+		fcb = file->fcb;
+		oft_write_begin(file);
+		int res = unshare_blocks(fcb, lblk, block_span(offset, len));
+		oft_write_end(file);
+		pthread_mutex_unlock(&vcb_lock);
+		if (res) {
+			pthread_rwlock_unlock(&file->lock);
+			return NULL;
+		}
+	}
+	size_t pblk, count;
+	char *addr = NULL;
+	// The file may have shrunk while it was unlocked
+	if (offset + len <= fcb->data_end &&
+	    fcb_map(fcb, lblk, &pblk, &count) == 0 &&
+	    len <= count * block_size - offset % block_size) {
+		addr = block_ptr(pblk) + offset % block_size;
+		oft_map(file, addr, len);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	return addr;
+}
+
+/* Remove a mapping made by sfs_map(). The pointer must not be used
+ * afterwards.
+ * @param addr: The pointer sfs_map() returned.
+ * @param len: The length passed to sfs_map().
+ * @return: 0 on success, -1 if addr and len do not match a mapping.
+ */
+int sfs_unmap(void *addr, size_t len)
+{
+	return oft_unmap(addr, len);
+}
+
+/* Copy bytes from one open file to another inside the volume, without a
+ * buffer in between. Both files are locked once for the whole copy, and the
+ * destination grows like it does for write().
+ * @param fd_in: The file descriptor of the file to copy from.
+ * @param off_in: The offset to copy from, counted like lseek() offsets.
+ * @param fd_out: The file descriptor of the file to copy to.
+ * @param off_out: The offset to copy to, counted like lseek() offsets.
+ * @param len: The number of bytes to copy.
+ * @return: The number of bytes copied, 0 if off_in is at or past the end of
+ * the source, or -1 if an fd is invalid, an offset points into the FCB, the
+ * ranges overlap in the same file, the destination could not grow or nothing
+ * could be read from a cached volume's image.
+ */
+ssize_t sfs_copy_range(int fd_in, off_t off_in, int fd_out, off_t off_out,
+		       size_t len)
 {
+	struct proc_oft_entry *in = oft_get(fd_in);
+	struct proc_oft_entry *out = oft_get(fd_out);
+	if (in == NULL || out == NULL || off_in < (off_t)sizeof(struct fcb) ||
+	    off_out < (off_t)sizeof(struct fcb) || len > SSIZE_MAX) {
+		return -1;
+	}
+	struct sys_oft_entry *src = in->sys_entry;
+	struct sys_oft_entry *dst = out->sys_entry;
+	if (src == dst && (size_t)off_in < off_out + len &&
+	    (size_t)off_out < off_in + len) {
+		return -1;
+	}
+
+	size_t block_size = vcb->block_size;
+	int vcb_held = 0;
+	for (;;) {
+		lock_pair(src, dst);
+		size_t in_size = src->fcb->data_end;
+		if ((size_t)off_in >= in_size)
+			len = 0;
+		else if (len > in_size - off_in)
+			len = in_size - off_in;
+		if (vcb_held || len == 0 ||
+		    !write_needs_vcb(dst->fcb, off_out, len))
+			break;
+		// Growing or copying shared blocks needs vcb_lock, which comes
+		// before the files' locks
+		unlock_pair(src, dst);
+		pthread_mutex_lock(&vcb_lock);
+		vcb_held = 1;
+	}
+
+	struct fcb *fcb = dst->fcb;
+	oft_write_begin(dst);
+	if (vcb_held) {
+		int res = make_room(dst, off_out, len);
+		pthread_mutex_unlock(&vcb_lock);
+		if (res) {
+			// No space to copy the shared blocks
+			oft_write_end(dst);
+			unlock_pair(src, dst);
+			return -1;
+		}
+	}
+	size_t max_file_size = fcb->file_size * block_size;
+	if ((size_t)off_out >= max_file_size) {
+		oft_write_end(dst);
+		unlock_pair(src, dst);
+		return len ? -1 : 0;
+	}
+	if (len > max_file_size - off_out)
+		len = max_file_size - off_out;
+
+	size_t copied = 0;
+	int failed = 0;
+	while (copied < len) {
+		size_t from, from_count, to, to_count;
+		size_t from_lblk = (off_in + copied) / block_size;
+		size_t from_off = (off_in + copied) % block_size;
+		size_t to_lblk = (off_out + copied) / block_size;
+		size_t to_off = (off_out + copied) % block_size;
+		// The destination can only have holes left if it ran out of
+		// space
+		if (fcb_map(fcb, to_lblk, &to, &to_count))
+			break;
+		int hole = fcb_map(src->fcb, from_lblk, &from, &from_count);
+		if (hole)
+			from_count = fcb_hole(src->fcb, from_lblk);
+		// Largest piece contiguous in both files
+		size_t n = len - copied;
+		if (from_count < SIZE_MAX / block_size &&
+		    n > from_count * block_size - from_off)
+			n = from_count * block_size - from_off;
+		if (n > to_count * block_size - to_off)
+			n = to_count * block_size - to_off;
+		// First blocks hold FCBs and are always used in place
+		if (from_lblk == 0 && n > block_size - from_off)
+			n = block_size - from_off;
+		if (to_lblk == 0 && n > block_size - to_off)
+			n = block_size - to_off;
+		char *from_ptr = block_ptr(from) + from_off;
+		char *to_ptr = block_ptr(to) + to_off;
+		int err = 0;
+		if (hole && to_lblk == 0)
+			memset(to_ptr, 0, n);
+		else if (hole)
+			err = bcache_zero(to, to_off, n);
+		else if (from_lblk == 0 && to_lblk == 0)
+			copy_bytes(to_ptr, from_ptr, n);
+		else if (to_lblk == 0)
+			err = bcache_read(from, from_off, to_ptr, n);
+		else if (from_lblk == 0)
+			err = bcache_write(to, to_off, from_ptr, n);
+		else
+			err = bcache_copy(to, to_off, from, from_off, n);
+		if (err) {
+			// The cached volume's image could not be read
+			failed = 1;
+			break;
+		}
+		copied += n;
+	}
+	if (copied > 0 && off_out + copied > fcb->data_end)
+		fcb->data_end = off_out + copied;
+
+	oft_write_end(dst);
+	unlock_pair(src, dst);
+	return failed && copied == 0 ? -1 : (ssize_t)copied;
+}
+
+/* Clone a file. The clone shares every block of the file except the first,
+ * which holds the FCB, so cloning takes time in the number of extents rather
+ * than the size of the file. A shared block is copied when either file
+ * writes it, so the clone and the file never see each other's writes.
+ * @param src: The path of the file to clone.
+ * @param dst: The path of the clone. Every directory on the path must exist.
+ * @return: 0 on success, -1 if src does not exist or is mapped with
+ * sfs_map(), dst exists or its parent does not, or there is no space for the
+ * clone.
+ */
+int sfs_clone(const char *src, const char *dst)
+{
+	char name[MAX_FILE_NAME_LEN];
+	size_t parent_id;
 	lock_all();
 
+	struct dentry *entry = lookup_file(src);
+	struct dentry_table *parent = path_parent(dst, name, &parent_id);
+	if (entry == NULL || parent == NULL ||
+	    dir_lookup(parent, parent_id, name) != NULL) {
+		unlock_all();
+		return -1;
+	}
+	// Keep writers out while the blocks are shared. A mapped file cannot
+	// be cloned: stores through the mapping would reach the clone.
+	struct sys_oft_entry *file = oft_lookup(entry);
+	if (file != NULL) {
+		pthread_rwlock_wrlock(&file->lock);
+		if (atomic_load(&file->maps)) {
+			pthread_rwlock_unlock(&file->lock);
+			oft_put(file);
+			unlock_all();
+			return -1;
+		}
+	}
+
+	struct fcb *fcb = (struct fcb *)block_ptr(entry->start_block_num);
+	size_t start, got;
+	int res = alloc_blocks(0, 1, &start, &got);
+	if (res == 0) {
+		struct fcb *clone = (struct fcb *)block_ptr(start);
+		memcpy(clone, fcb, vcb->block_size);
+		fcb_init(clone, start, 1);
+		clone->data_end = fcb->data_end;
+		res = fcb_share(clone, fcb);
+		if (res == 0) {
+			struct dentry clone_entry = {
+				.start_block_num = start,
+				.file_size = clone->file_size,
+				.type = DENTRY_FILE,
+			};
+			strncpy(clone_entry.file_name, name,
+				MAX_FILE_NAME_LEN);
+			res = dentry_add(parent, &clone_entry);
+		}
+		if (res)
+			fcb_free_blocks(clone);
+	}
+
+	if (file != NULL) {
+		pthread_rwlock_unlock(&file->lock);
+		oft_put(file);
+	}
+	unlock_all();
+	return res;
+}
+
+/* Allocate or deallocate space for a range of an open file. Blocks are zeroed
+ * when they are allocated, so the range reads back the same either way.
+ * @param fd: The file descriptor of the file.
+ * @param mode: 0 to allocate blocks for the holes in the range and move the
+ * end of the file past it. SFS_FALLOC_KEEP_SIZE to leave the end alone and
+ * only allocate the part of the range before the end of the file's last
+ * block. SFS_FALLOC_PUNCH_HOLE | SFS_FALLOC_KEEP_SIZE to free the blocks of
+ * the range, bytes of blocks only partly in the range are zeroed instead.
+ * @param offset: The offset of the range, counted like lseek() offsets.
+ * @param len: The length of the range in bytes.
+ * @return: 0 on success, -1 if fd is invalid, offset points into the FCB, len
+ * is not positive, mode is invalid, a hole is punched in a file mapped with
+ * sfs_map() or there is no space for the blocks. Blocks allocated before
+ * running out of space stay with the file.
+ */
+int fallocate(int fd, int mode, off_t offset, off_t len)
+{
 	struct proc_oft_entry *entry = oft_get(fd);
-	if (entry == NULL || buf == NULL) {
+	int punch = mode & SFS_FALLOC_PUNCH_HOLE;
+	if (entry == NULL || offset < (off_t)sizeof(struct fcb) || len <= 0 ||
+	    len > SSIZE_MAX - offset ||
+	    (mode & ~(SFS_FALLOC_KEEP_SIZE | SFS_FALLOC_PUNCH_HOLE)) ||
+	    (punch && !(mode & SFS_FALLOC_KEEP_SIZE))) {
 		return -1;
 	}
+	struct sys_oft_entry *file = entry->sys_entry;
+	size_t block_size = vcb->block_size;
+	pthread_mutex_lock(&vcb_lock);
+	pthread_rwlock_wrlock(&file->lock);
+	struct fcb *fcb = file->fcb;
+	size_t end = offset + len;
+	if ((mode & SFS_FALLOC_KEEP_SIZE) && end > fcb->file_size * block_size)
+		end = fcb->file_size * block_size;
+	// Stores through a mapping would land on freed blocks
+	int res = punch && atomic_load(&file->maps) ? -1 : 0;
+	if (res == 0 && (size_t)offset < end) {
+		oft_write_begin(file);
+		if (punch) {
+			// Only whole blocks are freed
+			size_t first = (offset + block_size - 1) / block_size;
+			size_t last = end / block_size;
+			if (first >= last) {
+				res = zero_range(fcb, offset, end - offset);
+			} else {
+				res = zero_range(fcb, offset,
+						 first * block_size - offset);
+				size_t tail = last * block_size;
+				if (res == 0)
+					res = zero_range(fcb, tail, end - tail);
+				if (res == 0)
+					res = fcb_punch(fcb, first,
+							last - first);
+				if (res == 0)
+					defrag_kick();
+			}
+		} else {
+			res = fill_holes(fcb, offset / block_size,
+					 block_span(offset, end - offset));
+			if (res == 0 && !(mode & SFS_FALLOC_KEEP_SIZE) &&
+			    end > fcb->data_end)
+				fcb->data_end = end;
+			file->dentry->file_size = fcb->file_size;
+		}
+		oft_write_end(file);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	pthread_mutex_unlock(&vcb_lock);
+	return res;
+}
 
-	struct fcb *fcb = entry->sys_entry->fcb;
-	size_t max_file_size = fcb->file_size * BLOCK_SIZE;
-	// Check if we have enough room to write
-	if (max_file_size - entry->file_pos < nbytes) {
+/* Set the length of an open file, in place. A file that grows reads back
+ * zeroes past its old end, and the blocks it gains are holes until they are
+ * written. A file that shrinks gives the blocks past its new end back to the
+ * volume, blocks shared with a clone only lose this file's reference.
+ * @param fd: The file descriptor of the file.
+ * @param length: The new end of the file, counted like lseek() offsets.
+ * @return: 0 on success, -1 if fd is invalid, length points into the FCB or
+ * past the last block a file can have, the file is mapped with sfs_map() and
+ * would shrink, or its last block is shared and there was no space to copy it.
+ */
+int ftruncate(int fd, off_t length)
+{
+	struct proc_oft_entry *entry = oft_get(fd);
+	if (entry == NULL || length < (off_t)sizeof(struct fcb)) {
+		return -1;
+	}
+	struct sys_oft_entry *file = entry->sys_entry;
+	size_t block_size = vcb->block_size;
+	size_t blocks = (length + block_size - 1) / block_size;
+	if (blocks > max_file_blocks()) {
+		return -1;
+	}
+	pthread_mutex_lock(&vcb_lock);
+	pthread_rwlock_wrlock(&file->lock);
+	struct fcb *fcb = file->fcb;
+	// Stores through a mapping would land on freed blocks or past the end,
+	// where the file must read back zeroes when it grows again
+	if ((size_t)length < fcb->data_end && atomic_load(&file->maps)) {
+		pthread_rwlock_unlock(&file->lock);
+		pthread_mutex_unlock(&vcb_lock);
 		return -1;
 	}
 
-	off_t current_pos = entry->file_pos;
+	oft_write_begin(file);
+	int res = 0;
+	if ((size_t)length < fcb->data_end) {
+		// Bytes past the end are zero, so growing again reads zeroes
+		size_t tail = blocks * block_size;
+		if (tail > fcb->data_end)
+			tail = fcb->data_end;
+		res = zero_range(fcb, length, tail - length);
+	}
+	if (res == 0 && blocks < fcb->file_size) {
+		res = fcb_punch(fcb, blocks, fcb->file_size - blocks);
+		if (res == 0) {
+			fcb->file_size = blocks;
+			defrag_kick();
+		}
+	}
+	if (res == 0) {
+		if (blocks > fcb->file_size)
+			fcb->file_size = blocks;
+		fcb->data_end = length;
+		file->dentry->file_size = fcb->file_size;
+	}
+	oft_write_end(file);
 
-	size_t block_idx = fcb->start_block_num;
-	size_t offset = current_pos % BLOCK_SIZE;
-	ssize_t bytes_written = 0;
+	pthread_rwlock_unlock(&file->lock);
+	pthread_mutex_unlock(&vcb_lock);
+	return res;
+}
 
-	while (bytes_written < nbytes) {
-		size_t current_block = block_idx;
-		size_t remaining_space = BLOCK_SIZE - offset;
-		size_t remaining_bytes = nbytes - bytes_written;
-		size_t write_size = remaining_space < remaining_bytes ?
-					    remaining_space :
-					    remaining_bytes;
+/* Run several requests in order under one acquisition of the file system
+ * locks. Only the locks the requests need are taken: every lock if one of
+ * them creates or writes a file, the dentry table lock if one of them looks
+ * up a path. The first blocks of files created by one batch are allocated from
+ * a single run of free blocks when the volume has one, so they end up next to
+ * each other.
+ * @param ops: The requests, as for a submission ring. fds are the caller's.
+ * @param results: Set to the result of each request, in the same order.
+ * @param n: The number of requests.
+ * @return: 0 once every request ran, -1 if ops or results is NULL.
+ */
+int sfs_batch(const struct sfs_sqe *ops, struct sfs_cqe *results, size_t n)
+{
+	if (n && (ops == NULL || results == NULL)) {
+		return -1;
+	}
+	int lock_vcb = 0;
+	int lock_dentries = 0;
+	size_t create_blocks = 0;
+	for (size_t i = 0; i < n; ++i) {
+		switch (ops[i].opcode) {
+		case SFS_OP_CREATE:
+			++create_blocks;
+			// Fall through
+		case SFS_OP_WRITE:
+			lock_vcb = 1;
+			// Fall through
+		case SFS_OP_OPEN:
+		case SFS_OP_READ_FILE:
+			lock_dentries = 1;
+			break;
+		}
+	}
+	if (lock_vcb)
+		lock_all();
+	else if (lock_dentries)
+		pthread_mutex_lock(&dentry_table_lock);
 
-		//Write data to current block
-		memcpy(&raw_blocks[current_block][offset], buf + bytes_written,
-		       write_size);
+	// One allocation for every file created, files that do not fit in
+	// what it got are allocated on their own
+	size_t run_start = 0;
+	size_t run_len = 0;
+	if (create_blocks && alloc_blocks(0, create_blocks, &run_start, &run_len))
+		run_len = 0;
 
-		bytes_written += write_size;
-		current_pos += write_size; //updating file position
-		block_idx = (current_pos / BLOCK_SIZE) +
-			    fcb->start_block_num; //updating block index
-		offset = current_pos %
-			 BLOCK_SIZE; //updating offset within the block
+	for (size_t i = 0; i < n; ++i) {
+		const struct sfs_sqe *op = &ops[i];
+		struct iovec iov = { .iov_base = op->buf, .iov_len = op->len };
+		struct proc_oft_entry *entry = NULL;
+		struct dentry *dentry;
+		off_t pos = op->offset;
+		ssize_t res = -1;
+		switch (op->opcode) {
+		case SFS_OP_READ:
+		case SFS_OP_WRITE:
+			entry = oft_get(op->fd);
+			if (entry == NULL || op->buf == NULL ||
+			    op->offset < (off_t)sizeof(struct fcb))
+				break;
+			if (op->opcode == SFS_OP_READ)
+				res = read_at(entry->sys_entry, op->offset,
+					      &iov, 1);
+			else
+				res = write_at(entry->sys_entry, &pos, &iov, 1,
+					       1);
+			break;
+		case SFS_OP_OPEN:
+			dentry = op->path != NULL ? lookup_file(op->path) : NULL;
+			if (dentry != NULL)
+				res = oft_open(dentry,
+					       (struct fcb *)block_ptr(
+						       dentry->start_block_num),
+					       op->flags);
+			break;
+		case SFS_OP_CLOSE:
+			res = oft_close(op->fd);
+			break;
+		case SFS_OP_CREATE:
+			if (op->path != NULL)
+				res = create_file(op->path, op->len, &run_start,
+						  &run_len);
+			break;
+		case SFS_OP_READ_FILE:
+			if (op->path != NULL)
+				res = read_file(op->path, op->buf, op->len);
+			break;
+		}
+		results[i].res = res;
+		results[i].user_data = op->user_data;
 	}
 
-	// Update file position
-	entry->file_pos = current_pos;
+	if (run_len)
+		vcb_set_range_free(vcb, run_start, run_len, 1);
+	if (lock_vcb)
+		unlock_all();
+	else if (lock_dentries)
+		pthread_mutex_unlock(&dentry_table_lock);
+	return 0;
+}
 
-	unlock_all();
-	return bytes_written;
+/* Runs a request from a submission ring. Called by the worker threads, the
+ * request's fd was already turned into a file reference by the submitting
+ * thread, and this drops it.
+ * @param op: The request, its res is set to the result.
+ * @return: void
+ */
+void ring_exec(struct ring_op *op)
+{
+	struct sfs_sqe *sqe = &op->sqe;
+	struct iovec iov = { .iov_base = sqe->buf, .iov_len = sqe->len };
+	switch (sqe->opcode) {
+	case SFS_OP_READ:
+	case SFS_OP_WRITE:
+		if (sqe->buf == NULL || sqe->offset < (off_t)sizeof(struct fcb))
+			op->res = -1;
+		else if (sqe->opcode == SFS_OP_READ)
+			op->res = read_at(op->file, sqe->offset, &iov, 1);
+		else
+			op->res = write_at(op->file, &sqe->offset, &iov, 1, 0);
+		oft_put(op->file);
+		op->file = NULL;
+		break;
+	case SFS_OP_OPEN:
+		op->file = open_file(sqe->path, sqe->flags);
+		op->res = op->file != NULL ? 0 : -1;
+		break;
+	case SFS_OP_CLOSE:
+		oft_put(op->file);
+		op->file = NULL;
+		op->res = 0;
+		break;
+	}
 }
 
 /* Set the file offset for a file in number of bytes from the beginning, the
@@ -250,97 +984,1108 @@ ssize_t write(int fd, const void *buf, size_t nbytes)
  * @param offset: The offset to set.
  * @param whence: The base for the offset. SFS_SEEK_SET for the beginning of the
  * file, SFS_SEEK_CUR for the current file offset, or SFS_SEEK_END for the end
- * of the file.
+ * of the file, just past its last byte. The offset may go past the end up to
+ * the end of the file's last block, a write there leaves zeroes in between.
  * @return: The new file offset from the beginning of the file, or -1 if the
  * file offset could not be set.
  */
 off_t lseek(int fd, off_t offset, int whence)
 {
-	lock_all();
-
 	struct proc_oft_entry *entry = oft_get(fd);
-	if (entry == NULL)
+	if (entry == NULL) {
 		return -1;
+	}
+	struct sys_oft_entry *file = entry->sys_entry;
+	pthread_rwlock_rdlock(&file->lock);
+	off_t file_size = file->fcb->file_size * vcb->block_size;
+	off_t pos;
 	switch (whence) {
 	case SFS_SEEK_CUR:
-		entry->file_pos += offset;
+		pos = entry->file_pos + offset;
+		break;
 	case SFS_SEEK_SET:
-		entry->file_pos = offset;
+		pos = offset;
 		break;
 	case SFS_SEEK_END:
-		size_t bytes = entry->sys_entry->fcb->file_size * BLOCK_SIZE;
-		--bytes; // offset of 0 should put at last byte
-		entry->file_pos = bytes - offset;
+		pos = file->fcb->data_end + offset;
+		break;
 	default:
+		pthread_rwlock_unlock(&file->lock);
 		return -1;
 	}
 	// Ensure file position is within bounds
-	if (entry->file_pos < sizeof(struct fcb)) {
-		entry->file_pos = sizeof(struct fcb);
-	} else if (entry->file_pos >
-		   entry->sys_entry->fcb->file_size * BLOCK_SIZE) {
-		entry->file_pos = entry->sys_entry->fcb->file_size * BLOCK_SIZE;
+	if (pos < (off_t)sizeof(struct fcb)) {
+		pos = sizeof(struct fcb);
+	} else if (pos > file_size) {
+		pos = file_size;
 	}
+	entry->file_pos = pos;
 
-	unlock_all();
-	return entry->file_pos;
+	pthread_rwlock_unlock(&file->lock);
+	return pos;
 }
 
 /* Initialize the file system. This function should be called before any other
  * file system functions are called. This is not a public function like the
  * others, so processes should NOT call this function. Only the main thread 
  * (fake kernel that mounts our fs) should call this function.
+ * The volume lives in memory and is lost when the program exits. Use
+ * mount_fs() for a volume that survives restarts.
+ * @param block_size: The size of each block in bytes. Must be a power of 2
+ * between MIN_BLOCK_SIZE and MAX_BLOCK_SIZE.
+ * @param block_count: The number of blocks on the volume.
+ * @return: 0 on success, -1 if the geometry is invalid or the volume could not
+ * be allocated.
+ */
+int init_fs(size_t block_size, size_t block_count)
+{
+	if (!geometry_valid(block_size, block_count)) {
+		return -1;
+	}
+	// calloc hands back zeroed pages, no need to memset large volumes
+	raw_blocks = calloc(block_count, block_size);
+	if (raw_blocks == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	volume_size = block_size * block_count;
+	volume_mapped = 0;
+	if (format_fs(block_size, block_count)) {
+		free(raw_blocks);
+		raw_blocks = NULL;
+		return -1;
+	}
+
+	// Open file tables are in memory (not on disk) structures so
+	// don't alloc them to raw blocks
+	oft_init();
+	dcache_init();
+	copy_init();
+	return 0;
+}
+
+/* Mount the file system from a volume image file. The image is mapped into
+ * memory, so the VCB, dentry table and file data persist across restarts.
+ * If the image does not exist or is empty, it is created and formatted with
+ * the given geometry. Otherwise the geometry is read back from its VCB and
+ * block_size and block_count are ignored. Like init_fs(), only the main thread
+ * should call this function, and it should be called instead of init_fs().
+ * @param path: Path to the volume image file.
+ * @param block_size: The block size used if the image has to be formatted.
+ * @param block_count: The block count used if the image has to be formatted.
+ * @return: 0 on success, -1 if the image could not be mounted.
+ */
+int mount_fs(const char *path, size_t block_size, size_t block_count)
+{
+	return mount_volume(path, block_size, block_count, 0);
+}
+
+/* Mount the file system from a volume image file like mount_fs(), but keep
+ * file data in a block cache read and written with pread() and pwrite()
+ * rather than in the mapping. Memory use is then bounded by the cache and the
+ * metadata, not the size of the volume. The VCB, dentry tables and the first
+ * block of every file stay mapped. Writes reach the image in the background,
+ * sync_fs() and close_fs() wait for them. Files can only be mapped with
+ * sfs_map() as far as their first block.
+ * @param path: Path to the volume image file.
+ * @param block_size: The block size used if the image has to be formatted.
+ * @param block_count: The block count used if the image has to be formatted.
+ * @param cache_blocks: The number of blocks the cache holds, at least
+ * BCACHE_MIN_BLOCKS.
+ * @return: 0 on success, -1 if cache_blocks is too small or the image could
+ * not be mounted.
+ */
+int mount_fs_cached(const char *path, size_t block_size, size_t block_count,
+		    size_t cache_blocks)
+{
+	if (cache_blocks < BCACHE_MIN_BLOCKS) {
+		return -1;
+	}
+	return mount_volume(path, block_size, block_count, cache_blocks);
+}
+
+/* Flush the mounted volume to its image file. Returns once the VCB, dentry
+ * table and all file data are written. Does nothing for in-memory volumes.
+ * @return: 0 on success, -1 if the volume could not be flushed.
+ */
+int sync_fs()
+{
+	if (!volume_mapped) {
+		return 0;
+	}
+	lock_all();
+	reclaim_blocks();
+	int res = bcache_flush();
+	if (volume_sync(raw_blocks, volume_size))
+		res = -1;
+	unlock_all();
+	return res;
+}
+
+/* Shut down the file system. Stops the defragmenter and the ring workers,
+ * then frees the open file tables and the volume. A mounted volume is flushed
+ * and unmapped. No file system functions should be
+ * called afterwards until init_fs() or mount_fs() is called again.
  * @return: void
  */
-void init_fs()
+void close_fs()
 {
-	memset(raw_blocks, 0, sizeof(raw_blocks));
+	defrag_stop();
+	ring_pool_stop();
+	lock_all();
+	oft_free();
+	reclaim_blocks();
+	vcb_unmount(vcb);
+	if (volume_mapped) {
+		bcache_free();
+		volume_sync(raw_blocks, volume_size);
+		volume_unmap(raw_blocks, volume_size);
+		if (volume_fd >= 0)
+			volume_close(volume_fd);
+		volume_fd = -1;
+	} else {
+		free(raw_blocks);
+	}
+	raw_blocks = NULL;
+	volume_size = 0;
+	volume_mapped = 0;
+	vcb = NULL;
+	dentry_table = NULL;
+	unlock_all();
+}
 
-	vcb = (struct vcb *)raw_blocks[0];
-	vcb_init(vcb, BLOCK_SIZE);
-	vcb_set_block_free(vcb, 0, 0);
+/* Start the defragmenter, a background thread that compacts the volume so
+ * large files can be created on a fragmented volume. It moves one file at a
+ * time towards the start of the volume while holding the file system locks,
+ * then lets reads and writes run for pause_ms before the next move. Once no
+ * file can be moved it sleeps until blocks are freed. Like init_fs(), only the
+ * main thread should call this function.
+ * @param max_blocks: Files larger than this are never moved, which bounds how
+ * long one move holds the locks.
+ * @param pause_ms: Milliseconds to wait between moves.
+ * @return: 0 on success, -1 if the defragmenter is already running or the
+ * thread could not be started.
+ */
+int defrag_start(size_t max_blocks, unsigned int pause_ms)
+{
+	pthread_mutex_lock(&defrag_lock);
+	if (defrag_running) {
+		pthread_mutex_unlock(&defrag_lock);
+		return -1;
+	}
+	defrag_max_blocks = max_blocks;
+	defrag_pause_ms = pause_ms;
+	defrag_running = 1;
+	defrag_kicked = 1;
+	if (pthread_create(&defrag_tid, NULL, defrag_thread, NULL)) {
+		defrag_running = 0;
+		pthread_mutex_unlock(&defrag_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&defrag_lock);
+	return 0;
+}
 
-	dentry_table = (struct dentry_table *)raw_blocks[1];
-	// Give dentry_table 2 blocks for 4KiB total
-	dentry_table_init(dentry_table, 2);
-	vcb_set_block_free(vcb, 1, 0);
-	vcb_set_block_free(vcb, 2, 0);
+/* Stop the defragmenter and wait for its thread to exit. A move in progress
+ * is finished first. Does nothing if the defragmenter is not running.
+ * @return: void
+ */
+void defrag_stop()
+{
+	pthread_mutex_lock(&defrag_lock);
+	if (!defrag_running) {
+		pthread_mutex_unlock(&defrag_lock);
+		return;
+	}
+	defrag_running = 0;
+	pthread_cond_signal(&defrag_cond);
+	pthread_mutex_unlock(&defrag_lock);
+	pthread_join(defrag_tid, NULL);
+}
+
+/* Maps a volume image file and mounts or formats it, see mount_fs().
+ * @param path: Path to the volume image file.
+ * @param block_size: The block size used if the image has to be formatted.
+ * @param block_count: The block count used if the image has to be formatted.
+ * @param cache_blocks: The size of the block cache for file data, 0 to use the
+ * mapping instead.
+ * @return: 0 on success, -1 if the image could not be mounted.
+ */
+static int mount_volume(const char *path, size_t block_size,
+			size_t block_count, size_t cache_blocks)
+{
+	if (!geometry_valid(block_size, block_count)) {
+		return -1;
+	}
+	int created;
+	size_t size = block_size * block_count;
+	void *addr = volume_map(path, &size, &created);
+	if (addr == NULL) {
+		return -1;
+	}
+	raw_blocks = addr;
+	volume_size = size;
+	volume_mapped = 1;
+
+	if (created) {
+		if (format_fs(block_size, block_count))
+			goto err_unmap;
+	} else {
+		vcb = (struct vcb *)raw_blocks;
+		// Only mount images that hold a whole simple-fs volume
+		if (size < sizeof(struct vcb) || vcb->magic != VCB_MAGIC ||
+		    !geometry_valid(vcb->block_size, vcb->block_count) ||
+		    vcb->block_size * vcb->block_count > size)
+			goto err_unmap;
+		if (vcb_mount(vcb))
+			goto err_unmap;
+		dentry_table = (struct dentry_table *)block_ptr(
+			vcb->dentry_start);
+	}
+	if (cache_blocks > 0) {
+		volume_fd = volume_open(path);
+		if (volume_fd < 0 ||
+		    bcache_init(volume_fd, vcb->block_size, cache_blocks)) {
+			vcb_unmount(vcb);
+			goto err_unmap;
+		}
+	}
 
-	// Open file tables are in memory (not on disk) structures so
-	// don't alloc them to raw blocks
 	oft_init();
+	dcache_init();
+	copy_init();
+	return 0;
+
+err_unmap:
+	if (volume_fd >= 0)
+		volume_close(volume_fd);
+	volume_fd = -1;
+	volume_unmap(addr, size);
+	raw_blocks = NULL;
+	volume_size = 0;
+	volume_mapped = 0;
+	vcb = NULL;
+	dentry_table = NULL;
+	return -1;
 }
 
-/* Finds a free set of contiguous blocks for a file.
- * @param start: The starting block number of the free blocks.
- * This value will be set by the function to the file's starting block.
- * @param blocks: The number of blocks to allocate.
- * @return: 0 if a free set of blocks was found, -1 if no free blocks were found.
- */
-static int find_free_blocks(size_t *start, size_t blocks)
-{
-	*start = FIRST_DATA_BLOCK_IDX;
-	unsigned long word;
-	// Traverse blocks to find first fit
-	size_t i = 0;
-	while (i < BLOCK_COUNT) {
-		size_t num_bytes = vcb_get_bm_word(vcb, i / 64, &word);
-		for (int j = 0; j < sizeof(unsigned long) * num_bytes;
-		     ++j, ++i) {
-			// If word is 0 at spot, then block is not free, continue
-			if (!(word & (1 << j))) {
-				*start = i + 1;
-				continue;
-			}
-			if (i - *start + 1 == blocks) {
-				goto out_while; // Found a fit
+/* Lay out an empty volume on raw_blocks: the VCB from block 0, followed by
+ * the dentry table. raw_blocks should already be zeroed.
+ * @param block_size: The size of each block in bytes.
+ * @param block_count: The number of blocks on the volume.
+ * @return: 0 on success, -1 if the volume is too small for its metadata.
+ */
+static int format_fs(size_t block_size, size_t block_count)
+{
+	vcb = (struct vcb *)raw_blocks;
+	if (vcb_init(vcb, block_size, block_count, volume_size))
+		return -1;
+	size_t dentry_blocks =
+		(dentry_table_size(block_count / BLOCKS_PER_DENTRY) +
+		 block_size - 1) /
+		block_size;
+	if (dentry_blocks < DENTRY_TABLE_BLOCKS)
+		dentry_blocks = DENTRY_TABLE_BLOCKS;
+	if (vcb->dentry_start + dentry_blocks >= block_count) {
+		vcb_unmount(vcb);
+		return -1;
+	}
+
+	vcb->dentry_blocks = dentry_blocks;
+	vcb->data_start = vcb->dentry_start + vcb->dentry_blocks;
+	// VCB, bitmap and dentry table blocks are never free
+	vcb_set_range_free(vcb, 0, vcb->data_start, 0);
+
+	dentry_table = (struct dentry_table *)block_ptr(vcb->dentry_start);
+	dentry_table_init(dentry_table, vcb->dentry_blocks * block_size);
+	return 0;
+}
+
+/* Checks that a volume geometry is usable.
+ * @param block_size: The size of each block in bytes.
+ * @param block_count: The number of blocks on the volume.
+ * @return: non-zero if the geometry is valid, 0 otherwise.
+ */
+static int geometry_valid(size_t block_size, size_t block_count)
+{
+	if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE)
+		return 0;
+	if (block_size & (block_size - 1))
+		return 0;
+	if (block_count == 0 || block_count > SIZE_MAX / block_size)
+		return 0;
+	return 1;
+}
+
+/* Returns the address of a block on the volume.
+ * @param block_num: The block number.
+ * @return: Pointer to the first byte of the block.
+ */
+static inline char *block_ptr(size_t block_num)
+{
+	return raw_blocks + block_num * vcb->block_size;
+}
+
+/* Allocates a run of up to want blocks and marks it used. Prefers the blocks
+ * starting at goal, then a run of want blocks from the VCB's free run lists,
+ * then part of the largest free run. Caller must hold the VCB lock.
+ * @param goal: Block to try first, such as the one after a file's last
+ * extent. 0 for no preference.
+ * @param want: The number of blocks wanted.
+ * @param start: Set to the first block of the run.
+ * @param got: Set to the number of blocks in the run, between 1 and want.
+ * @return: 0 on success, -1 if no blocks are free.
+ */
+static int alloc_blocks(size_t goal, size_t want, size_t *start, size_t *got)
+{
+	reclaim_blocks();
+	size_t run = goal ? vcb_free_run(vcb, goal, want) : 0;
+	if (run == 0)
+		return vcb_alloc_upto(vcb, want, start, got);
+
+	vcb_set_range_free(vcb, goal, run, 0);
+	*start = goal;
+	*got = run;
+	return 0;
+}
+
+/* Frees the blocks of unlinked files that have been closed since the last
+ * call. Closing a file only queues its blocks, they are freed here before the
+ * next allocation. Caller must hold the VCB lock.
+ * @return: void
+ */
+static void reclaim_blocks()
+{
+	struct fcb *fcb;
+	int freed = 0;
+	while ((fcb = oft_reclaim()) != NULL) {
+		fcb_free_blocks(fcb);
+		freed = 1;
+	}
+	if (freed)
+		defrag_kick();
+}
+
+/* Body of the defragmenter thread. Runs until defrag_stop() is called.
+ * @param arg: Unused.
+ * @return: NULL
+ */
+static void *defrag_thread(void *arg)
+{
+	pthread_mutex_lock(&defrag_lock);
+	while (defrag_running) {
+		defrag_kicked = 0;
+		pthread_mutex_unlock(&defrag_lock);
+
+		lock_all();
+		int moved = defrag_step(dentry_table, defrag_max_blocks);
+		unlock_all();
+
+		pthread_mutex_lock(&defrag_lock);
+		if (moved) {
+			// Throttle, so foreground I/O gets the locks
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += defrag_pause_ms / 1000;
+			until.tv_nsec += (defrag_pause_ms % 1000) * 1000000L;
+			if (until.tv_nsec >= 1000000000L) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
 			}
+			if (defrag_running)
+				pthread_cond_timedwait(&defrag_cond,
+						       &defrag_lock, &until);
+		} else {
+			// Nothing to move until more blocks are freed
+			while (defrag_running && !defrag_kicked)
+				pthread_cond_wait(&defrag_cond, &defrag_lock);
 		}
 	}
-out_while:
-	if (i >= BLOCK_COUNT) {
+	pthread_mutex_unlock(&defrag_lock);
+	return NULL;
+}
+
+/* Wakes the defragmenter up after blocks were freed.
+ * @return: void
+ */
+static void defrag_kick()
+{
+	pthread_mutex_lock(&defrag_lock);
+	defrag_kicked = 1;
+	pthread_cond_signal(&defrag_cond);
+	pthread_mutex_unlock(&defrag_lock);
+}
+
+/* Allocates blocks for the holes in a range of a file, growing the file if
+ * the range goes past its end. New blocks are zeroed and placed after the
+ * block before them when there is room. Caller must hold the VCB lock.
+ * @param fcb: The FCB of the file.
+ * @param lblk: The first logical block.
+ * @param count: The number of blocks.
+ * @return: 0 on success, -1 if the volume ran out of space, new blocks could
+ * not be zeroed or the range goes past max_file_blocks(). The file keeps the
+ * blocks it got before that.
+ */
+static int fill_holes(struct fcb *fcb, size_t lblk, size_t count)
+{
+	size_t max = max_file_blocks();
+	int res = 0;
+	if (lblk > max || count > max - lblk) {
+		// Grow as far as the file can, like when space runs out
+		count = lblk < max ? max - lblk : 0;
+		res = -1;
+	}
+	size_t end = lblk + count;
+	while (lblk < end) {
+		size_t pblk, run;
+		if (fcb_map(fcb, lblk, &pblk, &run) == 0) {
+			lblk += run;
+			continue;
+		}
+		size_t hole = fcb_hole(fcb, lblk);
+		if (hole > end - lblk)
+			hole = end - lblk;
+		size_t goal = 0;
+		if (fcb_map(fcb, lblk - 1, &pblk, &run) == 0)
+			goal = pblk + 1;
+		size_t start, got;
+		if (alloc_blocks(goal, hole, &start, &got))
+			return -1;
+		if (bcache_zero(start, 0, got * vcb->block_size) ||
+		    fcb_insert(fcb, lblk, start, got)) {
+			vcb_set_range_free(vcb, start, got, 1);
+			return -1;
+		}
+		lblk += got;
+	}
+	return res;
+}
+
+/* Zeroes a range of a file. Holes in the range are left alone, shared blocks
+ * are copied first. Caller must hold the VCB lock and the file's lock for
+ * writing.
+ * @param fcb: The FCB of the file.
+ * @param pos: The file offset of the range.
+ * @param nbytes: The length of the range.
+ * @return: 0 on success, -1 if there was no space to copy shared blocks or a
+ * cached block could not be read from the image.
+ */
+static int zero_range(struct fcb *fcb, size_t pos, size_t nbytes)
+{
+	size_t block_size = vcb->block_size;
+	if (unshare_blocks(fcb, pos / block_size, block_span(pos, nbytes)))
+		return -1;
+	while (nbytes > 0) {
+		size_t lblk = pos / block_size;
+		size_t offset = pos % block_size;
+		size_t pblk, count;
+		int hole = fcb_map(fcb, lblk, &pblk, &count);
+		if (hole)
+			count = fcb_hole(fcb, lblk);
+		size_t len = nbytes;
+		if (count < SIZE_MAX / block_size &&
+		    len > count * block_size - offset)
+			len = count * block_size - offset;
+		if (lblk == 0 && len > block_size - offset)
+			len = block_size - offset;
+		if (!hole && lblk == 0)
+			memset(block_ptr(pblk) + offset, 0, len);
+		else if (!hole && bcache_zero(pblk, offset, len))
+			return -1;
+		pos += len;
+		nbytes -= len;
+	}
+	return 0;
+}
+
+/* Gives a file its own copy of the blocks it shares in a range of logical
+ * blocks, so they can be written. Caller must hold the VCB lock and the file's
+ * lock for writing.
+ * @param fcb: The FCB of the file.
+ * @param lblk: The first logical block.
+ * @param count: The number of blocks, blocks past the end of the file are
+ * ignored.
+ * @return: 0 on success, -1 if the volume ran out of space or a block could not
+ * be read from a cached volume's image. Blocks copied before that stay with
+ * the file.
+ */
+static int unshare_blocks(struct fcb *fcb, size_t lblk, size_t count)
+{
+	size_t end = lblk + count;
+	while (lblk < end) {
+		size_t pblk, run;
+		if (fcb_map(fcb, lblk, &pblk, &run)) {
+			// Holes have nothing to copy
+			run = fcb_hole(fcb, lblk);
+			if (run > end - lblk)
+				break;
+			lblk += run;
+			continue;
+		}
+		if (run > end - lblk)
+			run = end - lblk;
+		// Find the first run of shared blocks in the extent
+		size_t skip = 0;
+		while (skip < run && !vcb_range_shared(vcb, pblk + skip, 1))
+			++skip;
+		size_t shared = 0;
+		while (skip + shared < run &&
+		       vcb_range_shared(vcb, pblk + skip + shared, 1))
+			++shared;
+		if (shared == 0) {
+			lblk += run;
+			continue;
+		}
+
+		size_t start, got;
+		if (alloc_blocks(0, shared, &start, &got))
+			return -1;
+		if (bcache_copy(start, 0, pblk + skip, 0,
+				got * vcb->block_size) ||
+		    fcb_remap(fcb, lblk + skip, got, start)) {
+			vcb_set_range_free(vcb, start, got, 1);
+			return -1;
+		}
+		vcb_put_range(vcb, pblk + skip, got);
+		lblk += skip + got;
+	}
+	return 0;
+}
+
+/* Returns the number of blocks touched by a range of a file.
+ * @param pos: The file offset of the range.
+ * @param nbytes: The length of the range.
+ * @return: The number of blocks, 0 for an empty range.
+ */
+static size_t block_span(size_t pos, size_t nbytes)
+{
+	size_t block_size = vcb->block_size;
+	if (nbytes == 0)
+		return 0;
+	return (pos + nbytes - 1) / block_size - pos / block_size + 1;
+}
+
+/* Returns the largest size a file can have, so that its size in bytes fits in
+ * an off_t. Every place that raises a file's size checks against it.
+ * @return: The number of blocks.
+ */
+static size_t max_file_blocks()
+{
+	return (size_t)SSIZE_MAX / vcb->block_size;
+}
+
+/* Locks the files of a copy, the source for reading and the destination for
+ * writing. Two files are always locked in the same order, so copies between
+ * them in both directions cannot deadlock.
+ * @param src: The file copied from.
+ * @param dst: The file copied to, may be src.
+ * @return: void
+ */
+static void lock_pair(struct sys_oft_entry *src, struct sys_oft_entry *dst)
+{
+	if (src == dst) {
+		pthread_rwlock_wrlock(&dst->lock);
+	} else if (src < dst) {
+		pthread_rwlock_rdlock(&src->lock);
+		pthread_rwlock_wrlock(&dst->lock);
+	} else {
+		pthread_rwlock_wrlock(&dst->lock);
+		pthread_rwlock_rdlock(&src->lock);
+	}
+}
+
+/* Unlocks the files locked by lock_pair().
+ * @param src: The file copied from.
+ * @param dst: The file copied to, may be src.
+ * @return: void
+ */
+static void unlock_pair(struct sys_oft_entry *src, struct sys_oft_entry *dst)
+{
+	if (src != dst)
+		pthread_rwlock_unlock(&src->lock);
+	pthread_rwlock_unlock(&dst->lock);
+}
+
+/* Looks up a file by path and takes a reference to its system open file
+ * table entry, without giving the caller a file descriptor.
+ * @param path: The path of the file to open.
+ * @param oflag: The open flags for the file. (Unused for now)
+ * @return: The entry, or NULL if there is no such file or it is a directory.
+ */
+static struct sys_oft_entry *open_file(const char *path, int oflag)
+{
+	struct sys_oft_entry *file = NULL;
+	pthread_mutex_lock(&dentry_table_lock);
+	struct dentry *entry = lookup_file(path);
+	if (entry != NULL) {
+		struct fcb *file_fcb =
+			(struct fcb *)block_ptr(entry->start_block_num);
+		file = oft_acquire(entry, file_fcb, oflag);
+	}
+	pthread_mutex_unlock(&dentry_table_lock);
+	return file;
+}
+
+/* Looks up a file by path. Caller must hold the dentry table lock.
+ * @param path: The path of the file.
+ * @return: The file's dentry, or NULL if there is no such file or it is a
+ * directory.
+ */
+static struct dentry *lookup_file(const char *path)
+{
+	char name[MAX_FILE_NAME_LEN];
+	size_t parent_id;
+	struct dentry_table *parent = path_parent(path, name, &parent_id);
+	struct dentry *entry =
+		parent != NULL ? dir_lookup(parent, parent_id, name) : NULL;
+	if (entry == NULL || entry->type != DENTRY_FILE)
+		return NULL;
+	return entry;
+}
+
+/* Reads a file by path from the start of its data, without opening it.
+ * Caller must hold the dentry table lock, which keeps files that are not open
+ * from being opened, written, moved or removed meanwhile.
+ * @param path: The path of the file.
+ * @param buf: The buffer to read into.
+ * @param nbytes: The size of the buffer.
+ * @return: The number of bytes read, or -1 if there is no such file.
+ */
+static ssize_t read_file(const char *path, void *buf, size_t nbytes)
+{
+	struct dentry *entry = lookup_file(path);
+	if (entry == NULL || buf == NULL) {
+		return -1;
+	}
+	struct iovec iov = { .iov_base = buf, .iov_len = nbytes };
+	struct sys_oft_entry *file = oft_lookup(entry);
+	if (file == NULL) {
+		struct fcb *fcb = (struct fcb *)block_ptr(entry->start_block_num);
+		return file_read(fcb, sizeof(struct fcb), &iov, 1);
+	}
+	// Open files can be written through their fds
+	ssize_t bytes_read = read_at(file, sizeof(struct fcb), &iov, 1);
+	oft_put(file);
+	return bytes_read;
+}
+
+/* Creates a file. Caller must hold every global lock.
+ * @param path: The path of the file.
+ * @param blocks: The number of blocks to allocate for the file.
+ * @param run_start: First block of a run the caller allocated for several
+ * files, or NULL. The file is carved from the start of the run if it fits,
+ * and the run shrinks.
+ * @param run_len: The number of blocks left in the run.
+ * @return: 0 on success, -1 if a file with the same path exists, the parent
+ * directory does not exist, there is no space for the file or blocks is more
+ * than max_file_blocks().
+ */
+static int create_file(const char *path, size_t blocks, size_t *run_start,
+		       size_t *run_len)
+{
+	char name[MAX_FILE_NAME_LEN];
+	size_t parent_id;
+
+	// Names are unique, check before taking any blocks
+	struct dentry_table *parent = path_parent(path, name, &parent_id);
+	if (parent == NULL || dir_lookup(parent, parent_id, name) != NULL ||
+	    blocks > max_file_blocks()) {
+		return -1;
+	}
+
+	// The first block holds the FCB, the rest of the file is a hole
+	if (blocks == 0)
+		blocks = 1;
+	size_t start, got;
+	if (run_start != NULL && *run_len > 0) {
+		start = *run_start;
+		++*run_start;
+		--*run_len;
+	} else if (alloc_blocks(0, 1, &start, &got)) {
 		// No space for file
 		return -1;
 	}
+	memset(block_ptr(start), 0, vcb->block_size);
+
+	// Initialize FCB
+	struct fcb *fcb = (struct fcb *)block_ptr(start);
+	fcb_init(fcb, start, 1);
+	fcb->file_size = blocks;
+
+	// Add entry in the parent's dentry table
+	struct dentry entry = {
+		.start_block_num = start,
+		.file_size = fcb->file_size,
+		.type = DENTRY_FILE,
+	};
+	strncpy(entry.file_name, name, MAX_FILE_NAME_LEN);
+	int res = dentry_add(parent, &entry);
+	if (res) {
+		// Dentry table is full
+		fcb_free_blocks(fcb);
+	}
+	return res;
+}
+
+/* Reads from an open file, without its lock when no writer gets in the way.
+ * @param file: The file's system open file table entry.
+ * @param pos: The file offset to read from.
+ * @param iov: The buffers to read into, filled in order.
+ * @param iovcnt: The number of buffers.
+ * @return: The number of bytes read, or -1 if nothing could be read from a
+ * cached volume's image.
+ */
+static ssize_t read_at(struct sys_oft_entry *file, off_t pos,
+		       const struct iovec *iov, int iovcnt)
+{
+	ssize_t bytes_read = read_optimistic(file, pos, iov, iovcnt);
+	if (bytes_read < 0) {
+		// Kept racing writers, or the file is too fragmented for the
+		// lock-free path
+		pthread_rwlock_rdlock(&file->lock);
+		bytes_read = file_read(file->fcb, pos, iov, iovcnt);
+		pthread_rwlock_unlock(&file->lock);
+	}
+	return bytes_read;
+}
+
+/* Writes to an open file under its lock, growing the file when the write goes
+ * past its end. Blocks the file shares with a clone are copied first.
+ * @param file: The file's system open file table entry.
+ * @param pos: The file offset to write at, or -1 to append at the end of the
+ * file's data. Appends read and advance the end under the file's lock, so
+ * each lands after the one before. Set to the offset written at.
+ * @param iov: The buffers to write from, in order.
+ * @param iovcnt: The number of buffers.
+ * @param vcb_held: Non-zero if the caller holds the VCB lock.
+ * @return: The number of bytes written, short if a cached volume's image
+ * could not be read, or -1 if pos is past the end of a file that could not
+ * grow, the written blocks are shared and could not be copied or nothing
+ * could be written.
+ */
+static ssize_t write_at(struct sys_oft_entry *file, off_t *pos,
+			const struct iovec *iov, int iovcnt, int vcb_held)
+{
+	size_t nbytes = 0;
+	for (int i = 0; i < iovcnt; ++i)
+		nbytes += iov[i].iov_len;
+
+	int append = *pos < 0;
+	pthread_rwlock_wrlock(&file->lock);
+	struct fcb *fcb = file->fcb;
+	if (append)
+		*pos = fcb->data_end;
+	if (write_needs_vcb(fcb, *pos, nbytes)) {
+		if (!vcb_held) {
+			// vcb_lock comes before the file's lock. The file may
+			// have been moved, grown or appended to while it was
+			// unlocked.
+			pthread_rwlock_unlock(&file->lock);
+			pthread_mutex_lock(&vcb_lock);
+			pthread_rwlock_wrlock(&file->lock);
+			fcb = file->fcb;
+			if (append)
+				*pos = fcb->data_end;
+		}
+		oft_write_begin(file);
+		int res = make_room(file, *pos, nbytes);
+		if (!vcb_held)
+			pthread_mutex_unlock(&vcb_lock);
+		if (res) {
+			// No space to copy the shared blocks
+			oft_write_end(file);
+			pthread_rwlock_unlock(&file->lock);
+			return -1;
+		}
+	} else {
+		oft_write_begin(file);
+	}
+	size_t max_file_size = fcb->file_size * vcb->block_size;
+	if ((size_t)*pos >= max_file_size) {
+		oft_write_end(file);
+		pthread_rwlock_unlock(&file->lock);
+		return nbytes ? -1 : 0;
+	}
+
+	size_t bytes_written = 0;
+	for (int i = 0; i < iovcnt && *pos + bytes_written < max_file_size;
+	     ++i) {
+		size_t len = iov[i].iov_len;
+		if (len > max_file_size - *pos - bytes_written)
+			len = max_file_size - *pos - bytes_written;
+		size_t n = file_copy(fcb, *pos + bytes_written,
+				     iov[i].iov_base, len, 1);
+		bytes_written += n;
+		if (n < len)
+			break;
+	}
+	if (*pos + bytes_written > fcb->data_end)
+		fcb->data_end = *pos + bytes_written;
+
+	oft_write_end(file);
+	pthread_rwlock_unlock(&file->lock);
+	// A hole at pos could not be filled
+	return nbytes && !bytes_written ? -1 : (ssize_t)bytes_written;
+}
+
+/* Returns whether a write needs the VCB lock, because it goes past the end of
+ * the file, into a hole or touches blocks shared with a clone. Blocks only
+ * become shared and holes only appear while their files are locked, so a
+ * range a writer holding the file's lock sees filled and unshared stays that
+ * way. Caller must hold the file's lock.
+ * @param fcb: The FCB of the file.
+ * @param pos: The file offset of the write.
+ * @param nbytes: The length of the write.
+ * @return: Non-zero if the VCB lock is needed, 0 otherwise.
+ */
+static int write_needs_vcb(struct fcb *fcb, size_t pos, size_t nbytes)
+{
+	size_t block_size = vcb->block_size;
+	size_t lblk = pos / block_size;
+	size_t count = block_span(pos, nbytes);
+	return pos + nbytes > fcb->file_size * block_size ||
+	       fcb_holes(fcb, lblk, count) || fcb_shared(fcb, lblk, count);
+}
+
+/* Gets a file ready for a write that write_needs_vcb() flagged: shared blocks
+ * in the range are copied, then holes are filled and the file grows as much as
+ * it can, so a short write is done if the volume is full. Caller must hold the
+ * VCB lock and the file's lock for writing.
+ * @param file: The file's system open file table entry.
+ * @param pos: The file offset of the write.
+ * @param nbytes: The length of the write.
+ * @return: 0 on success, -1 if there was no space to copy the shared blocks.
+ */
+static int make_room(struct sys_oft_entry *file, size_t pos, size_t nbytes)
+{
+	struct fcb *fcb = file->fcb;
+	size_t block_size = vcb->block_size;
+	if (unshare_blocks(fcb, pos / block_size, block_span(pos, nbytes)))
+		return -1;
+	fill_holes(fcb, pos / block_size, block_span(pos, nbytes));
+	file->dentry->file_size = fcb->file_size;
+	return 0;
+}
+
+/* Checks the buffers passed to readv() and friends.
+ * @param iov: The buffers.
+ * @param iovcnt: The number of buffers.
+ * @param total: Set to the number of bytes in all buffers.
+ * @return: 0 if the buffers are valid, -1 if there are too many, a buffer is
+ * NULL or the total does not fit in a ssize_t.
+ */
+static int iov_total(const struct iovec *iov, int iovcnt, size_t *total)
+{
+	if (iovcnt < 0 || iovcnt > SFS_IOV_MAX || (iov == NULL && iovcnt))
+		return -1;
+	*total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (iov[i].iov_base == NULL && iov[i].iov_len)
+			return -1;
+		if (iov[i].iov_len > SSIZE_MAX - *total)
+			return -1;
+		*total += iov[i].iov_len;
+	}
 	return 0;
 }
+
+/* Reads from a file without taking its lock. The FCB is copied and the data
+ * read under the file's sequence counter, and the read is retried when a
+ * writer changed the file meanwhile. Takes no locks and does no atomic
+ * read-modify-write.
+ * @param file: The file's system open file table entry.
+ * @param pos: The file offset to read from.
+ * @param iov: The buffers to read into.
+ * @param iovcnt: The number of buffers.
+ * @return: The number of bytes read, or -1 if the caller has to read under
+ * the file's lock.
+ */
+static ssize_t read_optimistic(struct sys_oft_entry *file, off_t pos,
+			       const struct iovec *iov, int iovcnt)
+{
+	for (int i = 0; i < READ_RETRIES; ++i) {
+		unsigned int seq =
+			atomic_load_explicit(&file->seq, memory_order_acquire);
+		if (seq & 1)
+			continue;
+		struct fcb fcb;
+		int valid = fcb_snapshot(&fcb, file->fcb) == 0;
+		ssize_t bytes_read = valid ? file_read(&fcb, pos, iov, iovcnt) : 0;
+		// The copies above must be done before seq is checked again
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&file->seq, memory_order_relaxed) != seq)
+			continue;
+		// A stable FCB that cannot be copied never will be, and a
+		// failed read is retried under the lock
+		return valid ? bytes_read : -1;
+	}
+	return -1;
+}
+
+/* Reads from a file into buffers in order, stopping at the end of the file.
+ * @param fcb: The FCB of the file.
+ * @param pos: The file offset to read from.
+ * @param iov: The buffers to read into.
+ * @param iovcnt: The number of buffers.
+ * @return: The number of bytes read, short if a cached volume's image could
+ * not be read, or -1 if nothing could.
+ */
+static ssize_t file_read(struct fcb *fcb, off_t pos, const struct iovec *iov,
+			 int iovcnt)
+{
+	// Make sure we don't read past the end of the file
+	size_t max_file_size = fcb->data_end;
+	size_t bytes_read = 0;
+	for (int i = 0; i < iovcnt && pos + bytes_read < max_file_size; ++i) {
+		size_t nbytes = iov[i].iov_len;
+		if (nbytes > max_file_size - pos - bytes_read)
+			nbytes = max_file_size - pos - bytes_read;
+		size_t n = file_copy(fcb, pos + bytes_read, iov[i].iov_base,
+				     nbytes, 0);
+		bytes_read += n;
+		if (n < nbytes)
+			return bytes_read ? (ssize_t)bytes_read : -1;
+	}
+	return bytes_read;
+}
+
+/* Copies bytes between a buffer and a file. Blocks that are contiguous on the
+ * volume are copied in one go, apart from the first block, which holds the FCB
+ * and is always used in place. Later blocks go through the block cache. Holes
+ * read as zeroes, a write stops at one. Bytes past the file's last block are
+ * not copied. A copy also stops at a run of blocks that could not be read
+ * from a cached volume's image.
+ * @param fcb: The FCB of the file.
+ * @param pos: The file offset to start at.
+ * @param buf: The buffer to copy to or from.
+ * @param nbytes: The number of bytes to copy.
+ * @param to_file: Non-zero to copy from buf into the file, 0 to copy from the
+ * file into buf.
+ * @return: The number of bytes copied.
+ */
+static size_t file_copy(struct fcb *fcb, off_t pos, char *buf, size_t nbytes,
+			int to_file)
+{
+	size_t block_size = vcb->block_size;
+	size_t copied = 0;
+	while (copied < nbytes) {
+		size_t lblk = (pos + copied) / block_size;
+		size_t offset = (pos + copied) % block_size;
+		size_t pblk, count;
+		if (fcb_map(fcb, lblk, &pblk, &count)) {
+			if (to_file)
+				break;
+			size_t hole = fcb_hole(fcb, lblk);
+			size_t len = nbytes - copied;
+			if (hole < SIZE_MAX / block_size &&
+			    len > hole * block_size - offset)
+				len = hole * block_size - offset;
+			memset(buf + copied, 0, len);
+			copied += len;
+			continue;
+		}
+
+		size_t len = count * block_size - offset;
+		if (lblk == 0)
+			len = block_size - offset;
+		if (len > nbytes - copied)
+			len = nbytes - copied;
+		if (lblk == 0 && to_file)
+			copy_bytes(block_ptr(pblk) + offset, buf + copied, len);
+		else if (lblk == 0)
+			copy_bytes(buf + copied, block_ptr(pblk) + offset, len);
+		else if (to_file && bcache_write(pblk, offset, buf + copied, len))
+			break;
+		else if (!to_file &&
+			 bcache_read(pblk, offset, buf + copied, len))
+			break;
+		copied += len;
+	}
+	return copied;
+}
+
+/* Reads the next component of a path. Leading and repeated '/' are skipped.
+ * @param path: The rest of the path.
+ * @param name: Set to the component, truncated to MAX_FILE_NAME_LEN - 1
+ * characters.
+ * @return: The rest of the path after the component, or NULL if there are no
+ * components left.
+ */
+static const char *path_next(const char *path, char *name)
+{
+	while (*path == '/')
+		path++;
+	if (*path == '\0')
+		return NULL;
+	size_t len = 0;
+	for (; *path != '\0' && *path != '/'; path++) {
+		if (len < MAX_FILE_NAME_LEN - 1)
+			name[len++] = *path;
+	}
+	name[len] = '\0';
+	return path;
+}
+
+/* Walks a path to the directory holding its last component. Paths are always
+ * resolved from the root directory. Caller must hold the dentry table lock.
+ * @param path: The path.
+ * @param name: Set to the last component of the path.
+ * @param parent_id: Set to the dentry cache id of the returned directory, its
+ * first block.
+ * @return: The dentry table of the directory, or NULL if the path is empty or
+ * a directory on it does not exist.
+ */
+static struct dentry_table *path_parent(const char *path, char *name,
+					size_t *parent_id)
+{
+	if (path == NULL)
+		return NULL;
+	struct dentry_table *table = dentry_table;
+	size_t id = vcb->dentry_start;
+	path = path_next(path, name);
+	if (path == NULL)
+		return NULL;
+	char next[MAX_FILE_NAME_LEN];
+	const char *rest;
+	while ((rest = path_next(path, next)) != NULL) {
+		// name is a directory on the path
+		struct dentry *dir = dir_lookup(table, id, name);
+		if (dir == NULL || dir->type != DENTRY_DIR)
+			return NULL;
+		table = dir_table(dir);
+		id = dir->start_block_num;
+		memcpy(name, next, MAX_FILE_NAME_LEN);
+		path = rest;
+	}
+	*parent_id = id;
+	return table;
+}
+
+/* Looks up a name in a directory, through the dentry cache. Caller must hold
+ * the dentry table lock.
+ * @param table: The directory's dentry table.
+ * @param parent_id: The directory's dentry cache id.
+ * @param name: The name to look up.
+ * @return: The dentry, or NULL if the directory has no such name.
+ */
+static struct dentry *dir_lookup(struct dentry_table *table, size_t parent_id,
+				 const char *name)
+{
+	struct dentry *entry = dcache_get(parent_id, name);
+	if (entry != NULL)
+		return entry;
+	entry = dentry_get(table, name);
+	if (entry != NULL)
+		dcache_put(parent_id, name, entry);
+	return entry;
+}
+
+/* Returns the dentry table of a directory, stored right after its FCB.
+ * @param dir: The directory's dentry.
+ * @return: The dentry table.
+ */
+static inline struct dentry_table *dir_table(struct dentry *dir)
+{
+	return (struct dentry_table *)(block_ptr(dir->start_block_num) +
+				       sizeof(struct fcb));
+}
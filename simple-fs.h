@@ -3,6 +3,7 @@
 
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 // Including null terminator
 #define MAX_FILE_NAME_LEN 16
@@ -15,30 +16,152 @@
 #define SFS_SEEK_CUR 1
 #define SFS_SEEK_END 2
 
-// Blocks are 2KiB in size the FS has 512 blocks
-#define BLOCK_SIZE 2048
-#define BLOCK_COUNT 512
+// Flags for open()
+// SFS_O_APPEND: write() and writev() go to the end of the file's data, which
+// they advance in the same step, so concurrent appends never overlap.
+// pwrite() and friends still write at the offset they are given.
+#define SFS_O_APPEND 02000
 
-/* Raw blocks for storage. These blocks mimic a disk.
- * Block 0 will always be the VCB.
- * Block 1-2 will always be the dentry table.
+// Modes for fallocate()
+// SFS_FALLOC_KEEP_SIZE: never grow the file, only allocate inside it.
+// SFS_FALLOC_PUNCH_HOLE: free the blocks of the range, needs KEEP_SIZE.
+#define SFS_FALLOC_KEEP_SIZE 0x01
+#define SFS_FALLOC_PUNCH_HOLE 0x02
+
+// Most buffers readv() and friends take in one call
+#define SFS_IOV_MAX 1024
+
+// Requests of a submission ring or sfs_batch(), see struct sfs_sqe. CREATE
+// and READ_FILE are only run by sfs_batch().
+#define SFS_OP_READ 0
+#define SFS_OP_WRITE 1
+#define SFS_OP_OPEN 2
+#define SFS_OP_CLOSE 3
+#define SFS_OP_CREATE 4
+#define SFS_OP_READ_FILE 5
+
+// Most entries a submission ring can have
+#define SFS_RING_MAX 4096
+
+// Default geometry: blocks are 2KiB in size and the FS has 512 blocks.
+// The real geometry is picked at init_fs()/mount_fs() time and stored in the
+// VCB, block size must be a power of 2 between MIN_BLOCK_SIZE and
+// MAX_BLOCK_SIZE.
+#define DEFAULT_BLOCK_SIZE 2048
+#define DEFAULT_BLOCK_COUNT 512
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE (1 << 20)
+
+// The dentry table gets room for one file per BLOCKS_PER_DENTRY blocks of the
+// volume, and at least DENTRY_TABLE_BLOCKS blocks
+#define DENTRY_TABLE_BLOCKS 2
+#define BLOCKS_PER_DENTRY 16
+
+/* Raw blocks for storage. These blocks mimic a disk. They are either in
+ * memory (init_fs) or mapped from a volume image file (mount_fs).
+ * The VCB always starts on block 0, followed by the dentry table. Block n
+ * starts at raw_blocks + n * block size.
  */
-extern char raw_blocks[BLOCK_COUNT][BLOCK_SIZE];
+extern char *raw_blocks;
+
+// A request for a submission ring. READ and WRITE take fd, buf, len and an
+// offset counted like lseek() offsets, as pread() and pwrite() do. OPEN takes
+// path and flags, path must stay valid until the request completes. CLOSE
+// takes fd. CREATE takes path and the number of blocks in len. READ_FILE
+// takes path, buf and len and reads the file from the start of its data
+// without opening it. user_data is handed back in the completion.
+struct sfs_sqe {
+  int opcode;
+  int fd;
+  void *buf;
+  size_t len;
+  off_t offset;
+  const char *path;
+  int flags;
+  unsigned long user_data;
+};
+
+// A completed request. res is what the matching call returns, the new fd
+// for OPEN.
+struct sfs_cqe {
+  ssize_t res;
+  unsigned long user_data;
+};
+
+struct sfs_ring;
+
+int create(const char *path, size_t blocks);
 
-void create(const char *name, size_t blocks);
+int mkdir(const char *path, size_t blocks);
 
-int open(const char *name, int oflag);
+int open(const char *path, int oflag);
 
 int close(int fd);
 
+int unlink(const char *path);
+
 ssize_t read(int fd, void *buf, size_t nbytes);
 
 ssize_t write(int fd, const void *buf, size_t nbytes);
 
 off_t lseek(int fd, off_t offset, int whence);
 
-void init_fs();
+ssize_t pread(int fd, void *buf, size_t nbytes, off_t offset);
+
+ssize_t pwrite(int fd, const void *buf, size_t nbytes, off_t offset);
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+void *sfs_map(int fd, off_t offset, size_t len);
+
+int sfs_unmap(void *addr, size_t len);
+
+ssize_t sfs_copy_range(int fd_in, off_t off_in, int fd_out, off_t off_out,
+		       size_t len);
+
+int sfs_clone(const char *src, const char *dst);
+
+int fallocate(int fd, int mode, off_t offset, off_t len);
+
+int ftruncate(int fd, off_t length);
+
+struct sfs_ring *sfs_ring_create(unsigned int entries);
+
+void sfs_ring_destroy(struct sfs_ring *ring);
+
+struct sfs_sqe *sfs_ring_get_sqe(struct sfs_ring *ring);
+
+int sfs_ring_submit(struct sfs_ring *ring);
+
+int sfs_ring_peek_cqe(struct sfs_ring *ring, struct sfs_cqe *cqe);
+
+int sfs_ring_wait_cqe(struct sfs_ring *ring, struct sfs_cqe *cqe);
+
+int sfs_batch(const struct sfs_sqe *ops, struct sfs_cqe *results, size_t n);
+
+int ring_pool_start(size_t workers);
+
+void ring_pool_stop();
+
+int init_fs(size_t block_size, size_t block_count);
+
+int mount_fs(const char *path, size_t block_size, size_t block_count);
+
+int mount_fs_cached(const char *path, size_t block_size, size_t block_count,
+		    size_t cache_blocks);
+
+int sync_fs();
 
 void close_fs();
 
+int defrag_start(size_t max_blocks, unsigned int pause_ms);
+
+void defrag_stop();
+
 #endif // SIMPLE_FS_H
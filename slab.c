@@ -0,0 +1,88 @@
+#include "slab.h"
+
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void slab_grow(struct slab *slab);
+
+/* Initializes an empty slab. No memory is allocated until the first object
+ * is.
+ * @param slab: The slab to initialize.
+ * @param obj_size: The size of each object in bytes.
+ * @param per_chunk: The number of objects allocated at once.
+ * @return: void
+ */
+void slab_init(struct slab *slab, size_t obj_size, size_t per_chunk)
+{
+	// Objects hold the free list link while free, and must stay aligned
+	// for any type inside chunks
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+	size_t align = alignof(max_align_t);
+	slab->obj_size = (obj_size + align - 1) / align * align;
+	slab->per_chunk = per_chunk ? per_chunk : 1;
+	slab->free = NULL;
+	slab->chunks = NULL;
+}
+
+/* Allocates an object from a slab. O(1) unless a new chunk is needed.
+ * @param slab: The slab.
+ * @return: The object, zeroed.
+ */
+void *slab_alloc(struct slab *slab)
+{
+	if (slab->free == NULL)
+		slab_grow(slab);
+	void *obj = slab->free;
+	slab->free = *(void **)obj;
+	memset(obj, 0, slab->obj_size);
+	return obj;
+}
+
+/* Returns an object to its slab. The object is reused by a later
+ * slab_alloc().
+ * @param slab: The slab the object was allocated from.
+ * @param obj: The object.
+ * @return: void
+ */
+void slab_free(struct slab *slab, void *obj)
+{
+	*(void **)obj = slab->free;
+	slab->free = obj;
+}
+
+/* Frees every chunk of a slab, including objects still in use.
+ * @param slab: The slab.
+ * @return: void
+ */
+void slab_destroy(struct slab *slab)
+{
+	while (slab->chunks != NULL) {
+		void *next = *(void **)slab->chunks;
+		free(slab->chunks);
+		slab->chunks = next;
+	}
+	slab->free = NULL;
+}
+
+/* Allocates a chunk and puts its objects on the free list.
+ * @param slab: The slab.
+ * @return: void
+ */
+static void slab_grow(struct slab *slab)
+{
+	// The chunk link takes the first object-sized slot
+	size_t size = slab->obj_size * (slab->per_chunk + 1);
+	char *chunk = malloc(size);
+	if (chunk == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	*(void **)chunk = slab->chunks;
+	slab->chunks = chunk;
+	// Push in reverse, so objects are handed out in address order
+	for (size_t i = slab->per_chunk; i > 0; --i)
+		slab_free(slab, chunk + i * slab->obj_size);
+}
@@ -0,0 +1,27 @@
+#ifndef SIMPLE_FS_SLAB_H
+#define SIMPLE_FS_SLAB_H
+
+#include <stddef.h>
+
+// Pool of fixed-size objects. Objects are carved out of chunks of per_chunk
+// objects and never move, freed objects go on a free list and are handed out
+// again before a new chunk is allocated. Chunks are only returned to malloc by
+// slab_destroy(), so freed objects stay readable memory of the same type.
+struct slab {
+  size_t obj_size;
+  size_t per_chunk;
+  // Free objects, chained through their first word
+  void *free;
+  // Allocated chunks, chained through their first word
+  void *chunks;
+};
+
+void slab_init(struct slab *slab, size_t obj_size, size_t per_chunk);
+
+void *slab_alloc(struct slab *slab);
+
+void slab_free(struct slab *slab, void *obj);
+
+void slab_destroy(struct slab *slab);
+
+#endif // SIMPLE_FS_SLAB_H
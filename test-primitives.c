@@ -1,18 +1,37 @@
 /* File for testing the primitive functions of the fs. 
- * These include the functions for dentry, vcb, and oft.
+ * These include the functions for dentry, vcb, fcb, and oft.
  */
 
+// For pthread_rwlock_t
+#define _POSIX_C_SOURCE 200809L
+
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "simple-fs.h"
+#include "bcache.h"
 #include "vcb.h"
 #include "open-ft.h"
 #include "dir.h"
+#include "copy.h"
+#include "dcache.h"
+#include "defrag.h"
 
-enum test_what { TEST_ALL, TEST_DENTRY, TEST_VCB, TEST_OFT };
+enum test_what {
+	TEST_ALL,
+	TEST_DENTRY,
+	TEST_VCB,
+	TEST_FCB,
+	TEST_OFT,
+	TEST_DEFRAG,
+	TEST_IO
+};
 
 static enum test_what test_what = TEST_ALL;
 
@@ -30,21 +49,58 @@ void assert(int expr, char *msg)
 	}
 }
 
+// A read or write run on its own thread, so a test can tell whether it
+// blocks on a lock the test holds. fd tables are per thread, so the thread
+// opens the file itself.
+struct io_thread {
+	pthread_t tid;
+	const char *path;
+	void *buf;
+	size_t len;
+	off_t offset;
+	int write;
+	ssize_t res;
+	atomic_int done;
+};
+
+// Writes a range of a file over and over, all 'a' then all 'b', at least once
+// and until told to stop
+struct flip_thread {
+	pthread_t tid;
+	const char *path;
+	size_t len;
+	off_t offset;
+	atomic_int stop;
+};
+
 void get_test(char *arg);
+void io_thread_start(struct io_thread *t, const char *path, void *buf,
+		     size_t len, off_t offset, int write);
+void *io_thread_run(void *arg);
+int io_thread_wait(struct io_thread *t, unsigned int ms);
+void *flip_thread_run(void *arg);
 void test_vcb();
+void test_fcb();
 void test_oft();
 void test_dentry();
+void test_defrag();
+void test_io();
+
+// Mounted volume and its root dentry table, owned by simple-fs.c
+extern struct vcb *vcb;
+extern struct dentry_table *dentry_table;
 
 void test_vcb()
 {
-	char block[BLOCK_SIZE];
+	char block[DEFAULT_BLOCK_SIZE];
 	struct vcb *vcb = (struct vcb *)block;
-	vcb_init(vcb, BLOCK_SIZE);
+	vcb_init(vcb, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT,
+		 DEFAULT_BLOCK_SIZE);
 
 	vcb_set_block_free(vcb, 0, 0);
 	assert(vcb_get_block_free(vcb, 0) == 0, "VCB -- Superblock not free");
 
-	assert(vcb_free_block_count(vcb) == BLOCK_COUNT - 1,
+	assert(vcb_free_block_count(vcb) == DEFAULT_BLOCK_COUNT - 1,
 	       "VCB -- Free block count updated");
 
 	size_t blocks_to_set_used[] = { 5, 12, 16, 7, 511 };
@@ -55,11 +111,116 @@ void test_vcb()
 			blocks_to_set_used[i]);
 		assert(vcb_get_block_free(vcb, blocks_to_set_used[i]) <= 0, s);
 	}
-	vcb_set_block_free(vcb, BLOCK_COUNT, 0);
-	int free = vcb_get_block_free(vcb, BLOCK_COUNT);
+
+	size_t start;
+	assert(vcb_find_free(vcb, 4, &start) == 0 && start == 1,
+	       "VCB -- First fit before first used block");
+	assert(vcb_find_free(vcb, 300, &start) == 0 && start == 17,
+	       "VCB -- First fit skips short runs");
+	assert(vcb_find_free(vcb, 495, &start) == -1,
+	       "VCB -- No run longer than the largest free run");
+	vcb_set_range_free(vcb, 17, 44, 0);
+	assert(vcb_find_free(vcb, 10, &start) == 0 && start == 61,
+	       "VCB -- First fit after used range");
+	assert(vcb_find_free(vcb, 100, &start) == 0 && start == 61,
+	       "VCB -- First fit run crossing bitmap words");
+	vcb_set_range_free(vcb, 17, 44, 1);
+	assert(vcb_free_block_count(vcb) == DEFAULT_BLOCK_COUNT - 6,
+	       "VCB -- Free block count after range set");
+
+	size_t free_before = vcb_free_block_count(vcb);
+	assert(vcb_alloc(vcb, 3, &start) == 0 &&
+		       vcb_get_block_free(vcb, start) == 0 &&
+		       vcb_get_block_free(vcb, start + 2) == 0 &&
+		       vcb_free_block_count(vcb) == free_before - 3,
+	       "VCB -- Allocated run marked used");
+	vcb_set_range_free(vcb, start, 3, 1);
+	assert(vcb_alloc(vcb, 495, &start) == -1,
+	       "VCB -- Allocation larger than any run fails");
+	size_t got;
+	assert(vcb_alloc_upto(vcb, 1000, &start, &got) == 0 && start == 17 &&
+		       got == 494,
+	       "VCB -- Partial allocation takes largest run");
+	vcb_set_range_free(vcb, start, got, 1);
+	vcb_set_block_free(vcb, 16, 1);
+	assert(vcb_alloc(vcb, 498, &start) == 0 && start == 13,
+	       "VCB -- Freed block coalesced with both neighbors");
+	vcb_set_range_free(vcb, 13, 498, 1);
+	vcb_set_block_free(vcb, 16, 0);
+
+	vcb_ref_range(vcb, 16, 1);
+	vcb_put_range(vcb, 16, 1);
+	assert(vcb_get_block_free(vcb, 16) == 0 &&
+		       !vcb_range_shared(vcb, 16, 1),
+	       "VCB -- Shared block kept until its last owner drops it");
+	vcb_put_range(vcb, 16, 1);
+	assert(vcb_get_block_free(vcb, 16) == 1,
+	       "VCB -- Block freed by its last owner");
+	vcb_set_block_free(vcb, 16, 0);
+
+	// 4GiB volume of 4KiB blocks, the bitmap needs 32 blocks
+	size_t big_count = 1 << 20;
+	size_t big_bytes = vcb_size(big_count);
+	struct vcb *big = malloc(big_bytes);
+	assert(vcb_init(big, 4096, big_count, 4096) == -1,
+	       "VCB -- Bitmap larger than alloc rejected");
+	assert(vcb_init(big, 4096, big_count, big_bytes) == 0,
+	       "VCB -- Bitmap spanning multiple blocks");
+	assert(big->dentry_start == (big_bytes + 4095) / 4096,
+	       "VCB -- Dentry table placed after bitmap");
+	vcb_set_block_free(big, big_count - 1, 0);
+	assert(vcb_get_block_free(big, big_count - 1) == 0 &&
+		       vcb_free_block_count(big) == big_count - 1,
+	       "VCB -- Last block of large volume set to used");
+	free(big);
+
+	vcb_set_block_free(vcb, DEFAULT_BLOCK_COUNT, 0);
+	int free = vcb_get_block_free(vcb, DEFAULT_BLOCK_COUNT);
 	assert(free == -1 || free == 0, "VCB -- Invalid block number");
 }
 
+void test_fcb()
+{
+	struct fcb fcb;
+	size_t pblk, count;
+	fcb_init(&fcb, 10, 4);
+	assert(fcb_map(&fcb, 2, &pblk, &count) == 0 && pblk == 12 &&
+		       count == 2,
+	       "FCB -- Block mapped inside first extent");
+
+	fcb_append(&fcb, 14, 2);
+	assert(fcb.nextents == 1 && fcb.file_size == 6,
+	       "FCB -- Adjacent run merged into last extent");
+
+	fcb_append(&fcb, 40, 3);
+	assert(fcb.nextents == 2 && fcb.file_size == 9,
+	       "FCB -- Distant run added as new extent");
+	assert(fcb_map(&fcb, 7, &pblk, &count) == 0 && pblk == 41 &&
+		       count == 2,
+	       "FCB -- Block mapped inside second extent");
+	assert(fcb_map(&fcb, 9, &pblk, &count) == -1,
+	       "FCB -- Block past end of file not mapped");
+	assert(fcb_last_extent(&fcb)->pblk == 40, "FCB -- Last extent found");
+
+	fcb_remap(&fcb, 2, 2, 60);
+	assert(fcb.nextents == 4 && fcb_map(&fcb, 3, &pblk, &count) == 0 &&
+		       pblk == 61 && fcb_map(&fcb, 4, &pblk, &count) == 0 &&
+		       pblk == 14 && count == 2,
+	       "FCB -- Remapped blocks split their extent");
+
+	struct fcb sparse;
+	fcb_init(&sparse, 10, 1);
+	sparse.file_size = 6;
+	fcb_insert(&sparse, 4, 20, 2);
+	assert(fcb_map(&sparse, 2, &pblk, &count) == -1 &&
+		       fcb_hole(&sparse, 1) == 3 && fcb_hole(&sparse, 4) == 0,
+	       "FCB -- Unmapped blocks form a hole");
+	fcb_insert(&sparse, 1, 11, 3);
+	assert(sparse.nextents == 2 && !fcb_holes(&sparse, 0, 6) &&
+		       fcb_blocks(&sparse) == 6,
+	       "FCB -- Hole filled by run merged with extent before it");
+}
+
 void test_oft()
 {
 	oft_init();
@@ -68,16 +229,17 @@ void test_oft()
 		.file_size = 1,
 		.start_block_num = 0,
 	};
-	struct fcb fcb = {
-		.start_block_num = 0,
-		.file_size = 1,
-	};
+	struct fcb fcb;
+	fcb_init(&fcb, 0, 1);
 	int oft_index = oft_open(&dentry, &fcb, 0);
 	char buff[128];
 	sprintf(buff, "OFT -- File opened at index %d", oft_index);
 	assert(oft_index >= 0, buff);
 	struct proc_oft_entry *entry = oft_get(oft_index);
 	assert(entry != NULL, "OFT -- File retrieved from OFT");
+	assert(oft_get(-1) == NULL && oft_get(PROC_OFT_LEN) == NULL &&
+		       oft_get(oft_index + 1) == NULL,
+	       "OFT -- Out of range and unused fds rejected");
 	assert(entry->file_pos == sizeof(struct fcb),
 	       "OFT -- File position initialized");
 	assert(entry->sys_entry->ref_count == 1,
@@ -85,13 +247,68 @@ void test_oft()
 	assert(entry->sys_entry->fcb == &fcb, "OFT -- FCB set correctly");
 	assert(entry->sys_entry->dentry == &dentry,
 	       "OFT -- Dentry set correctly");
+	unsigned int seq = atomic_load(&entry->sys_entry->seq);
+	oft_write_begin(entry->sys_entry);
+	int seq_odd = atomic_load(&entry->sys_entry->seq) == seq + 1;
+	oft_write_end(entry->sys_entry);
+	assert(!(seq & 1) && seq_odd &&
+		       atomic_load(&entry->sys_entry->seq) == seq + 2,
+	       "OFT -- Sequence counter odd only during a write");
+
+	struct dentry dentries[SYS_OFT_LEN * 2];
+	struct fcb fcbs[SYS_OFT_LEN * 2];
+	int other_fds[SYS_OFT_LEN * 2];
+	int found = 1;
+	for (int i = 0; i < SYS_OFT_LEN * 2; ++i) {
+		dentries[i] = dentry;
+		dentries[i].start_block_num = i + 1;
+		fcb_init(&fcbs[i], i + 1, 1);
+		other_fds[i] = oft_open(&dentries[i], &fcbs[i], 0);
+	}
+	for (int i = 0; i < SYS_OFT_LEN * 2; ++i) {
+		struct sys_oft_entry *e = oft_lookup(&dentries[i]);
+		found &= e != NULL && e->fcb == &fcbs[i] &&
+			 e == oft_get(other_fds[i])->sys_entry;
+		if (e != NULL)
+			oft_put(e);
+	}
+	assert(found, "OFT -- Files found by first block past SYS_OFT_LEN");
+	for (int i = 0; i < SYS_OFT_LEN * 2; ++i)
+		oft_close(other_fds[i]);
+	assert(oft_lookup(&dentries[0]) == NULL &&
+		       oft_get(oft_index)->sys_entry->ref_count == 1,
+	       "OFT -- Closed files removed from system table");
+
+	int fds[PROC_OFT_LEN * 4];
+	int grown = 1;
+	for (int i = 0; i < PROC_OFT_LEN * 4; ++i) {
+		fds[i] = oft_open(&dentry, &fcb, 0);
+		grown &= fds[i] >= 0;
+	}
+	assert(grown && oft_get(fds[PROC_OFT_LEN * 4 - 1]) != NULL,
+	       "OFT -- Process table grows past PROC_OFT_LEN");
+	oft_close(fds[5]);
+	assert(oft_open(&dentry, &fcb, 0) == fds[5],
+	       "OFT -- Closed fd reused");
+	for (int i = 0; i < PROC_OFT_LEN * 4; ++i)
+		oft_close(fds[i]);
+	// The table may have moved when it grew
+	entry = oft_get(oft_index);
+
+	assert(oft_unlink(&dentry) == 1 && entry->sys_entry->dentry != &dentry &&
+		       oft_reclaim() == NULL,
+	       "OFT -- Unlinked open file detached from dentry");
+	oft_close(oft_index);
+	assert(oft_reclaim() == &fcb && oft_reclaim() == NULL,
+	       "OFT -- Unlinked file reclaimed on last close");
+	oft_free();
 }
 
 void test_dentry()
 {
-	char blocks[2][BLOCK_SIZE];
+	char blocks[2][DEFAULT_BLOCK_SIZE];
 	struct dentry_table *table = (struct dentry_table *)blocks[0];
-	dentry_table_init(table, 2);
+	dentry_table_init(table, sizeof(blocks));
 
 	struct dentry dentry = {
 		.file_name = "test.txt",
@@ -108,6 +325,584 @@ void test_dentry()
 	assert(strcmp(dentry_fget->file_name, "test.txt") == 0,
 	       "Dentry -- File name set");
 	assert(dentry_fget != &dentry, "Dentry -- File copied to table");
+
+	assert(dentry_add(table, &dentry) == -1,
+	       "Dentry -- Duplicate name rejected");
+	assert(dentry_get(table, "missing") == NULL,
+	       "Dentry -- Missing name not found");
+
+	size_t added = 1;
+	while (added < table->cap) {
+		snprintf(dentry.file_name, MAX_FILE_NAME_LEN, "file%u",
+			 (unsigned int)added);
+		dentry.start_block_num = added;
+		if (dentry_add(table, &dentry))
+			break;
+		++added;
+	}
+	assert(added == table->cap && table->num_entries == added,
+	       "Dentry -- Table filled to capacity");
+	assert(dentry_add(table, &(struct dentry){ .file_name = "extra" }) ==
+		       -1,
+	       "Dentry -- Add to full table rejected");
+	int found = 1;
+	for (size_t i = 1; i < added; ++i) {
+		char name[MAX_FILE_NAME_LEN];
+		snprintf(name, MAX_FILE_NAME_LEN, "file%u", (unsigned int)i);
+		struct dentry *d = dentry_get(table, name);
+		found &= d != NULL && d->start_block_num == i;
+	}
+	assert(found, "Dentry -- Every entry found through hash index");
+
+	struct dentry *removed = dentry_get(table, "file3");
+	assert(dentry_remove(table, "file3") == 0 &&
+		       dentry_get(table, "file3") == NULL &&
+		       table->num_entries == added - 1,
+	       "Dentry -- Entry removed");
+	found = 1;
+	for (size_t i = 1; i < added; ++i) {
+		char name[MAX_FILE_NAME_LEN];
+		snprintf(name, MAX_FILE_NAME_LEN, "file%u", (unsigned int)i);
+		found &= i == 3 || dentry_get(table, name) != NULL;
+	}
+	assert(found, "Dentry -- Other entries found after remove");
+	assert(dentry_add(table, &(struct dentry){ .file_name = "extra" }) ==
+			       0 &&
+		       dentry_get(table, "extra") == removed,
+	       "Dentry -- Removed slot reused");
+
+	char *big = malloc(dentry_table_size(1000));
+	struct dentry_table *big_table = (struct dentry_table *)big;
+	dentry_table_init(big_table, dentry_table_size(1000));
+	assert(big_table->cap >= 1000, "Dentry -- Table sized for entries");
+	free(big);
+
+	dcache_init();
+	dcache_put(7, "file1", dentry_fget);
+	assert(dcache_get(7, "file1") == dentry_fget,
+	       "Dentry -- Cached name found");
+	assert(dcache_get(8, "file1") == NULL,
+	       "Dentry -- Cached name not found in other directory");
+	dcache_invalidate(7, "file1");
+	assert(dcache_get(7, "file1") == NULL,
+	       "Dentry -- Invalidated name not found");
+}
+
+void test_defrag()
+{
+	init_fs(DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT);
+	create("a", 4);
+	create("b", 4);
+	create("c", 4);
+	int fd = open("c", 0);
+	write(fd, "data", 5);
+	size_t a_start = dentry_get(dentry_table, "a")->start_block_num;
+	unlink("a");
+	unlink("b");
+
+	void *map = sfs_map(fd, sizeof(struct fcb), 5);
+	assert(defrag_step(dentry_table, DEFAULT_BLOCK_COUNT) == 0,
+	       "Defrag -- Mapped file not moved");
+	sfs_unmap(map, 5);
+	assert(defrag_step(dentry_table, DEFAULT_BLOCK_COUNT) == 1 &&
+		       dentry_get(dentry_table, "c")->start_block_num ==
+			       a_start,
+	       "Defrag -- File moved into lower free run");
+	assert(defrag_step(dentry_table, DEFAULT_BLOCK_COUNT) == 0,
+	       "Defrag -- Nothing left to move");
+	char buf[5];
+	lseek(fd, 0, SFS_SEEK_SET);
+	assert(read(fd, buf, 5) == 5 && strcmp(buf, "data") == 0,
+	       "Defrag -- Open file follows moved file");
+	close(fd);
+	close_fs();
+}
+
+void test_io()
+{
+	init_fs(DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT);
+	create("/f", 1);
+	int fd = open("/f", 0);
+	off_t data = lseek(fd, 0, SFS_SEEK_SET);
+	off_t far = data + DEFAULT_BLOCK_SIZE * 2;
+	char buf[6] = { 0 };
+
+	assert(pwrite(fd, "hello", 6, far) == 6 &&
+		       lseek(fd, 0, SFS_SEEK_CUR) == data,
+	       "IO -- pwrite leaves file offset alone");
+	assert(pread(fd, buf, 6, far) == 6 && strcmp(buf, "hello") == 0 &&
+		       lseek(fd, 0, SFS_SEEK_CUR) == data,
+	       "IO -- pread reads back pwrite");
+	assert(pread(fd, buf, 6, 0) == -1 && pwrite(fd, buf, 6, 0) == -1,
+	       "IO -- Offsets inside the FCB rejected");
+	off_t end = lseek(fd, 0, SFS_SEEK_END);
+	lseek(fd, data, SFS_SEEK_SET);
+	assert(pread(fd, buf, 6, end) == 0,
+	       "IO -- pread at end of file reads nothing");
+
+	struct iovec out[3] = { { "hdr", 3 }, { "payload", 7 }, { "end", 4 } };
+	char first[5], second[9];
+	struct iovec in[2] = { { first, 5 }, { second, 9 } };
+	assert(writev(fd, out, 3) == 14 &&
+		       lseek(fd, 0, SFS_SEEK_CUR) == data + 14,
+	       "IO -- writev writes every buffer");
+	assert(preadv(fd, in, 2, data) == 14 &&
+		       memcmp(first, "hdrpa", 5) == 0 &&
+		       strcmp(second, "yloadend") == 0,
+	       "IO -- preadv splits data across buffers");
+	struct iovec null_base = { NULL, 4 };
+	assert(readv(fd, &null_base, 1) == -1,
+	       "IO -- NULL buffer rejected");
+
+	// Files are locked one by one, so a writer holding one file's lock
+	// keeps no one out of another file
+	create("/locked", 1);
+	int locked = open("/locked", 0);
+	struct sys_oft_entry *locked_file = oft_get(locked)->sys_entry;
+	struct io_thread io;
+	char other[14];
+	pthread_rwlock_wrlock(&locked_file->lock);
+	io_thread_start(&io, "/f", other, 14, data, 0);
+	int io_done = io_thread_wait(&io, 5000);
+	pthread_join(io.tid, NULL);
+	assert(io_done && io.res == 14 && memcmp(other, "hdrpayloadend", 14) == 0,
+	       "IO -- Read of a file runs while another file is locked");
+	io_thread_start(&io, "/f", "grown", 6, data + DEFAULT_BLOCK_SIZE * 3,
+			1);
+	io_done = io_thread_wait(&io, 5000);
+	pthread_join(io.tid, NULL);
+	assert(io_done && io.res == 6,
+	       "IO -- Write growing a file runs while another file is locked");
+	io_thread_start(&io, "/locked", other, 6, data, 1);
+	io_done = io_thread_wait(&io, 50);
+	pthread_rwlock_unlock(&locked_file->lock);
+	pthread_join(io.tid, NULL);
+	assert(!io_done && io.res == 6,
+	       "IO -- Write to a locked file waits for its lock");
+
+	// Reads skip the file's lock unless a write is in progress
+	pthread_rwlock_wrlock(&locked_file->lock);
+	io_thread_start(&io, "/locked", other, 6, data, 0);
+	io_done = io_thread_wait(&io, 5000);
+	pthread_join(io.tid, NULL);
+	assert(io_done && io.res == 6 && memcmp(other, "hdrpay", 6) == 0,
+	       "IO -- Read skips the lock of a file with no write in progress");
+	oft_write_begin(locked_file);
+	io_thread_start(&io, "/locked", other, 6, data, 0);
+	io_done = io_thread_wait(&io, 50);
+	oft_write_end(locked_file);
+	pthread_rwlock_unlock(&locked_file->lock);
+	pthread_join(io.tid, NULL);
+	assert(!io_done && io.res == 6,
+	       "IO -- Read racing a write falls back to the file's lock");
+	close(locked);
+
+	// Extents on their own block are not read without the lock
+	create("/frag", 1);
+	int frag = open("/frag", 0);
+	struct sys_oft_entry *frag_file = oft_get(frag)->sys_entry;
+	size_t frag_blocks = 2 * FCB_INLINE_EXTENTS + 3;
+	for (size_t i = 1; i < frag_blocks; i += 2)
+		pwrite(frag, "x", 1, i * DEFAULT_BLOCK_SIZE);
+	struct fcb frag_copy;
+	char frag_got[2];
+	pthread_rwlock_wrlock(&frag_file->lock);
+	int frag_snap = fcb_snapshot(&frag_copy, frag_file->fcb);
+	io_thread_start(&io, "/frag", frag_got, 2,
+			(frag_blocks - 2) * DEFAULT_BLOCK_SIZE - 1, 0);
+	io_done = io_thread_wait(&io, 50);
+	pthread_rwlock_unlock(&frag_file->lock);
+	pthread_join(io.tid, NULL);
+	assert(frag_snap == -1 && !io_done && io.res == 2 &&
+		       memcmp(frag_got, "\0x", 2) == 0,
+	       "IO -- Read of a fragmented file takes the file's lock");
+	close(frag);
+
+	// Reads overlapping writes retry rather than return a mix of both
+	size_t flip_len = DEFAULT_BLOCK_SIZE * 32;
+	char *flip_got = malloc(flip_len);
+	create("/flip", 33);
+	int flip = open("/flip", 0);
+	struct flip_thread flipper = {
+		.path = "/flip",
+		.len = flip_len,
+		.offset = data,
+	};
+	// One pass first, so the range is allocated and fully written
+	atomic_store(&flipper.stop, 1);
+	flip_thread_run(&flipper);
+	atomic_store(&flipper.stop, 0);
+	pthread_create(&flipper.tid, NULL, flip_thread_run, &flipper);
+	int torn = 0;
+	for (int i = 0; i < 2000; ++i) {
+		if (pread(flip, flip_got, flip_len, data) != (ssize_t)flip_len)
+			torn = 1;
+		for (size_t j = 1; j < flip_len; ++j)
+			torn |= flip_got[j] != flip_got[0];
+	}
+	atomic_store(&flipper.stop, 1);
+	pthread_join(flipper.tid, NULL);
+	assert(!torn, "IO -- Reads overlapping writes are never torn");
+	close(flip);
+	free(flip_got);
+
+	char *map = sfs_map(fd, data, 14);
+	assert(map != NULL && memcmp(map, "hdrpayload", 10) == 0,
+	       "IO -- Mapped range points at file data");
+	assert(sfs_map(fd, data, DEFAULT_BLOCK_SIZE * 3) == NULL,
+	       "IO -- Range past end of file not mapped");
+	close(fd);
+	unlink("/f");
+	create("/g", 1);
+	assert(memcmp(map, "hdrpayload", 10) == 0 &&
+		       dentry_get(dentry_table, "g")->start_block_num !=
+			       (map - raw_blocks) / DEFAULT_BLOCK_SIZE,
+	       "IO -- Mapped file keeps its blocks after unlink");
+	assert(sfs_unmap(map, 14) == 0 && sfs_unmap(map, 14) == -1,
+	       "IO -- Mapping removed once");
+	fd = open("/g", 0);
+	close(fd);
+
+	struct sfs_ring *ring = sfs_ring_create(8);
+	struct sfs_sqe *sqe = sfs_ring_get_sqe(ring);
+	struct sfs_cqe cqe;
+	sqe->opcode = SFS_OP_OPEN;
+	sqe->path = "/g";
+	sqe->user_data = 7;
+	assert(sfs_ring_submit(ring) == 1 &&
+		       sfs_ring_wait_cqe(ring, &cqe) == 0 && cqe.res >= 0 &&
+		       cqe.user_data == 7,
+	       "IO -- Ring runs requests without a worker pool");
+	fd = cqe.res;
+	ring_pool_start(2);
+	for (int i = 0; i < 8; ++i) {
+		sqe = sfs_ring_get_sqe(ring);
+		sqe->opcode = SFS_OP_WRITE;
+		sqe->fd = fd;
+		sqe->buf = "ring";
+		sqe->len = 4;
+		sqe->offset = data + i * 4;
+	}
+	assert(sfs_ring_get_sqe(ring) == NULL && sfs_ring_submit(ring) == 8,
+	       "IO -- Full submission ring submitted in one batch");
+	int done = 0;
+	while (sfs_ring_wait_cqe(ring, &cqe) == 0)
+		done += cqe.res == 4;
+	char ring_buf[32];
+	assert(done == 8 && pread(fd, ring_buf, 32, data) == 32 &&
+		       memcmp(ring_buf + 28, "ring", 4) == 0,
+	       "IO -- Worker pool completes every request");
+	sqe = sfs_ring_get_sqe(ring);
+	sqe->opcode = SFS_OP_CLOSE;
+	sqe->fd = fd;
+	sfs_ring_submit(ring);
+	assert(oft_get(fd) == NULL && sfs_ring_wait_cqe(ring, &cqe) == 0 &&
+		       cqe.res == 0,
+	       "IO -- Close submitted through ring");
+	sfs_ring_destroy(ring);
+
+	struct sfs_sqe ops[4] = {
+		{ .opcode = SFS_OP_CREATE, .path = "/b1", .len = 2 },
+		{ .opcode = SFS_OP_CREATE, .path = "/b2", .len = 1 },
+		{ .opcode = SFS_OP_CREATE, .path = "/b1", .len = 1 },
+		{ .opcode = SFS_OP_OPEN, .path = "/b2", .user_data = 9 },
+	};
+	struct sfs_cqe res[4];
+	size_t b1 = 0;
+	sfs_batch(ops, res, 4);
+	if (res[0].res == 0)
+		b1 = dentry_get(dentry_table, "b1")->start_block_num;
+	assert(res[0].res == 0 && res[1].res == 0 && res[2].res == -1 &&
+		       dentry_get(dentry_table, "b2")->start_block_num ==
+			       b1 + 1,
+	       "IO -- Batch creates files from one run");
+	assert(res[3].res >= 0 && res[3].user_data == 9 &&
+		       oft_get(res[3].res) != NULL,
+	       "IO -- Batch opens file created earlier in batch");
+	fd = res[3].res;
+	pwrite(fd, "small", 6, data);
+	char small[16];
+	struct sfs_sqe get[2] = {
+		{ .opcode = SFS_OP_READ_FILE, .path = "/b2", .buf = small,
+		  .len = 6 },
+		{ .opcode = SFS_OP_CLOSE, .fd = fd },
+	};
+	sfs_batch(get, res, 2);
+	assert(res[0].res == 6 && strcmp(small, "small") == 0 &&
+		       res[1].res == 0,
+	       "IO -- Batch reads file by name");
+
+	int src = open("/b1", 0);
+	pwrite(src, "original", 9, data + DEFAULT_BLOCK_SIZE);
+	size_t free_before = vcb_free_block_count(vcb);
+	assert(sfs_clone("/b1", "/c1") == 0 &&
+		       vcb_free_block_count(vcb) == free_before - 1,
+	       "IO -- Clone shares all blocks but the FCB's");
+	int dst = open("/c1", 0);
+	pwrite(src, "modified", 9, data + DEFAULT_BLOCK_SIZE);
+	char cow[9];
+	assert(pread(dst, cow, 9, data + DEFAULT_BLOCK_SIZE) == 9 &&
+		       strcmp(cow, "original") == 0 &&
+		       vcb_free_block_count(vcb) == free_before - 2,
+	       "IO -- Write to a clone source copies the shared block");
+	assert(sfs_copy_range(src, data + DEFAULT_BLOCK_SIZE, dst,
+			      data + DEFAULT_BLOCK_SIZE * 3, 9) == 9 &&
+		       pread(dst, cow, 9, data + DEFAULT_BLOCK_SIZE * 3) == 9 &&
+		       strcmp(cow, "modified") == 0,
+	       "IO -- Range copied between files, growing the target");
+	assert(sfs_copy_range(src, data, src, data + 4, 8) == -1,
+	       "IO -- Overlapping copy within a file rejected");
+	close(dst);
+	// Copying into a shared block needs a free block to unshare it
+	sfs_clone("/b1", "/c2");
+	dst = open("/c2", 0);
+	create("/filler", 1);
+	int filler = open("/filler", 0);
+	fallocate(filler, 0, data,
+		  vcb_free_block_count(vcb) * DEFAULT_BLOCK_SIZE);
+	assert(vcb_free_block_count(vcb) == 0 &&
+		       sfs_copy_range(src, data, dst,
+				      data + DEFAULT_BLOCK_SIZE, 9) == -1,
+	       "IO -- Copy into a clone fails when the volume is full");
+	close(filler);
+	unlink("/filler");
+	close(src);
+	close(dst);
+	unlink("/c2");
+
+	create("/log", 1);
+	int log1 = open("/log", SFS_O_APPEND);
+	int log2 = open("/log", SFS_O_APPEND);
+	char log[8] = { 0 };
+	assert(write(log1, "ab", 2) == 2 && write(log2, "cd", 2) == 2 &&
+		       write(log1, "ef", 2) == 2 &&
+		       pread(log1, log, 6, data) == 6 &&
+		       strcmp(log, "abcdef") == 0,
+	       "IO -- Appends from two fds follow each other");
+	assert(lseek(log2, 0, SFS_SEEK_CUR) == data + 4 &&
+		       pwrite(log2, "X", 1, data) == 1 &&
+		       write(log2, "g", 1) == 1 &&
+		       pread(log1, log, 7, data) == 7 &&
+		       strcmp(log, "Xbcdefg") == 0,
+	       "IO -- pwrite on an append fd writes at its offset");
+	close(log1);
+	close(log2);
+
+	size_t free_sparse = vcb_free_block_count(vcb);
+	create("/sparse", 64);
+	int sp = open("/sparse", 0);
+	char zeros[16] = { 0 };
+	char got[16] = { 1 };
+	off_t mid = data + DEFAULT_BLOCK_SIZE * 10;
+	assert(pwrite(sp, "sparse", 7, mid) == 7 &&
+		       vcb_free_block_count(vcb) == free_sparse - 2,
+	       "IO -- Write into a hole allocates one block");
+	assert(pread(sp, got, 16, data + DEFAULT_BLOCK_SIZE * 5) == 16 &&
+		       memcmp(got, zeros, 16) == 0,
+	       "IO -- Sparse file reads zeroes from unallocated blocks");
+	assert(fallocate(sp, 0, data + DEFAULT_BLOCK_SIZE * 62,
+			 DEFAULT_BLOCK_SIZE * 4) == 0 &&
+		       vcb_free_block_count(vcb) == free_sparse - 7 &&
+		       lseek(sp, 0, SFS_SEEK_END) ==
+			       data + DEFAULT_BLOCK_SIZE * 66,
+	       "IO -- fallocate fills holes and grows the file");
+	assert(ftruncate(sp, mid + 3) == 0 &&
+		       vcb_free_block_count(vcb) == free_sparse - 2 &&
+		       lseek(sp, 0, SFS_SEEK_END) == mid + 3 &&
+		       pread(sp, got, 16, mid) == 3,
+	       "IO -- ftruncate frees blocks past the new end");
+	assert(ftruncate(sp, mid + 16) == 0 && pread(sp, got, 16, mid) == 16 &&
+		       memcmp(got, "spa", 3) == 0 &&
+		       memcmp(got + 3, zeros, 13) == 0,
+	       "IO -- ftruncate grows the file with zeroes");
+	assert(create("/huge", SIZE_MAX / DEFAULT_BLOCK_SIZE + 2) == -1 &&
+		       create("/huge", SSIZE_MAX / DEFAULT_BLOCK_SIZE + 1) ==
+			       -1 &&
+		       ftruncate(sp, SSIZE_MAX) == -1 &&
+		       lseek(sp, 0, SFS_SEEK_END) == mid + 16,
+	       "IO -- File size that does not fit in an off_t is refused");
+	char *sp_map = sfs_map(sp, mid, 16);
+	assert(sp_map != NULL && sfs_map(sp, mid, 17) == NULL &&
+		       ftruncate(sp, mid + 8) == -1,
+	       "IO -- Mapped range ends at the end of the file");
+	sp_map[8] = 'x';
+	sfs_unmap(sp_map, 16);
+	char grown[32];
+	assert(ftruncate(sp, mid + 32) == 0 &&
+		       pread(sp, grown, 32, mid) == 32 && grown[8] == 'x' &&
+		       memcmp(grown + 16, zeros, 16) == 0,
+	       "IO -- File grown after a mapping reads zeroes past the old end");
+	assert(fallocate(sp, SFS_FALLOC_PUNCH_HOLE, mid, 1) == -1 &&
+		       fallocate(sp,
+				 SFS_FALLOC_PUNCH_HOLE | SFS_FALLOC_KEEP_SIZE,
+				 DEFAULT_BLOCK_SIZE * 10 - 8,
+				 DEFAULT_BLOCK_SIZE + 16) == 0 &&
+		       vcb_free_block_count(vcb) == free_sparse - 1 &&
+		       pread(sp, got, 16, mid) == 16 &&
+		       memcmp(got, zeros, 16) == 0,
+	       "IO -- Punched hole frees its blocks and reads zeroes");
+	close(sp);
+
+	// Odd length and misaligned ends go through the streaming kernel's
+	// head and tail
+	size_t big = COPY_STREAM_MIN + 77;
+	char *from = malloc(big + 3);
+	char *to = calloc(big + 5, 1);
+	for (size_t i = 0; i < big + 3; ++i)
+		from[i] = i * 31;
+	copy_bytes(to + 5, from + 3, big);
+	assert(memcmp(to + 5, from + 3, big) == 0 && to[4] == 0,
+	       "IO -- Large unaligned copy streamed intact");
+	free(from);
+	free(to);
+	close_fs();
+
+	// A file larger than the block cache has to be written back and read
+	// in again, then found on the image without the cache
+	const char *image = "/tmp/simple-fs-test.img";
+	size_t cached_len = 4 * BCACHE_MIN_BLOCKS * DEFAULT_BLOCK_SIZE -
+			    sizeof(struct fcb);
+	char *cached = malloc(cached_len);
+	char *cached_got = malloc(cached_len);
+	for (size_t i = 0; i < cached_len; ++i)
+		cached[i] = i * 7 + i / DEFAULT_BLOCK_SIZE;
+	remove(image);
+	assert(mount_fs_cached(image, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT,
+			       BCACHE_MIN_BLOCKS - 1) == -1,
+	       "IO -- Block cache below the minimum size refused");
+	assert(mount_fs_cached(image, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT,
+			       SIZE_MAX / DEFAULT_BLOCK_SIZE + 1) == -1 &&
+		       mount_fs_cached(image, DEFAULT_BLOCK_SIZE,
+				       DEFAULT_BLOCK_COUNT,
+				       SIZE_MAX / DEFAULT_BLOCK_SIZE) == -1,
+	       "IO -- Block cache too large for memory refused");
+	mount_fs_cached(image, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT,
+			BCACHE_MIN_BLOCKS);
+	create("/cached", 4 * BCACHE_MIN_BLOCKS);
+	int cfd = open("/cached", 0);
+	assert(pwrite(cfd, cached, cached_len, sizeof(struct fcb)) ==
+			       (ssize_t)cached_len &&
+		       pread(cfd, cached_got, cached_len, sizeof(struct fcb)) ==
+			       (ssize_t)cached_len &&
+		       memcmp(cached, cached_got, cached_len) == 0,
+	       "IO -- File larger than the block cache reads back");
+	void *cmap = sfs_map(cfd, sizeof(struct fcb), 16);
+	assert(cmap != NULL && sfs_map(cfd, DEFAULT_BLOCK_SIZE, 16) == NULL,
+	       "IO -- Cached volume only maps first blocks");
+	sfs_unmap(cmap, 16);
+	close(cfd);
+	close_fs();
+	mount_fs(image, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT);
+	cfd = open("/cached", 0);
+	memset(cached_got, 0, cached_len);
+	assert(pread(cfd, cached_got, cached_len, sizeof(struct fcb)) ==
+			       (ssize_t)cached_len &&
+		       memcmp(cached, cached_got, cached_len) == 0,
+	       "IO -- Block cache writes reach the image");
+	close(cfd);
+	close_fs();
+
+	// Blocks cut off the end of the image cannot be read in
+	mount_fs_cached(image, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT,
+			BCACHE_MIN_BLOCKS);
+	size_t cstart = dentry_get(dentry_table, "cached")->start_block_num;
+	truncate(image, (cstart + 2) * DEFAULT_BLOCK_SIZE);
+	cfd = open("/cached", 0);
+	memset(cached_got, 0, cached_len);
+	ssize_t cgot = pread(cfd, cached_got, cached_len, sizeof(struct fcb));
+	assert(cgot > 0 && (size_t)cgot < cached_len &&
+		       memcmp(cached, cached_got, cgot) == 0,
+	       "IO -- Block cache read error gives a short read");
+	assert(pread(cfd, cached_got, 16, 3 * DEFAULT_BLOCK_SIZE) == -1 &&
+		       pwrite(cfd, cached, 16, 3 * DEFAULT_BLOCK_SIZE) == -1,
+	       "IO -- Block cache read error fails the read and write");
+	close(cfd);
+	close_fs();
+	remove(image);
+
+	// Images from before the VCB held its geometry or FCBs held extents
+	// used the same magic
+	mount_fs(image, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT);
+	close_fs();
+	FILE *old_image = fopen(image, "r+b");
+	fwrite("SFSVOL01", 1, 8, old_image);
+	fclose(old_image);
+	assert(mount_fs(image, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT) == -1,
+	       "IO -- Image of an older volume format refused");
+	remove(image);
+	free(cached);
+	free(cached_got);
+}
+
+/* Starts a pread() or pwrite() on a new thread.
+ * @param t: The thread's state, set up here.
+ * @param path: The path of the file.
+ * @param buf: The buffer to read into or write from.
+ * @param len: The number of bytes.
+ * @param offset: The file offset.
+ * @param write: Non-zero to write, 0 to read.
+ * @return: void
+ */
+void io_thread_start(struct io_thread *t, const char *path, void *buf,
+		     size_t len, off_t offset, int write)
+{
+	t->path = path;
+	t->buf = buf;
+	t->len = len;
+	t->offset = offset;
+	t->write = write;
+	t->res = -1;
+	atomic_store(&t->done, 0);
+	pthread_create(&t->tid, NULL, io_thread_run, t);
+}
+
+/* Body of an I/O thread.
+ * @param arg: The thread's state.
+ * @return: NULL
+ */
+void *io_thread_run(void *arg)
+{
+	struct io_thread *t = arg;
+	int fd = open(t->path, 0);
+	if (t->write)
+		t->res = pwrite(fd, t->buf, t->len, t->offset);
+	else
+		t->res = pread(fd, t->buf, t->len, t->offset);
+	close(fd);
+	atomic_store(&t->done, 1);
+	return NULL;
+}
+
+/* Waits a while for an I/O thread to finish, without joining it.
+ * @param t: The thread's state.
+ * @param ms: How long to wait at most.
+ * @return: Non-zero if the thread finished.
+ */
+int io_thread_wait(struct io_thread *t, unsigned int ms)
+{
+	struct timespec tick = { .tv_sec = 0, .tv_nsec = 1000000 };
+	for (unsigned int i = 0; i < ms && !atomic_load(&t->done); ++i)
+		nanosleep(&tick, NULL);
+	return atomic_load(&t->done);
+}
+
+/* Body of a thread that flips a range of a file between two patterns.
+ * @param arg: The thread's state.
+ * @return: NULL
+ */
+void *flip_thread_run(void *arg)
+{
+	struct flip_thread *t = arg;
+	char *buf = malloc(t->len);
+	int fd = open(t->path, 0);
+	int i = 0;
+	do {
+		memset(buf, 'a' + i++ % 2, t->len);
+		pwrite(fd, buf, t->len, t->offset);
+	} while (!atomic_load(&t->stop));
+	close(fd);
+	free(buf);
+	return NULL;
 }
 
 int main(int argc, char *argv[])
@@ -119,8 +914,14 @@ int main(int argc, char *argv[])
 	size_t dentry_passed = 0;
 	size_t vcb_tests = 0;
 	size_t vcb_passed = 0;
+	size_t fcb_tests = 0;
+	size_t fcb_passed = 0;
 	size_t oft_tests = 0;
 	size_t oft_passed = 0;
+	size_t defrag_tests = 0;
+	size_t defrag_passed = 0;
+	size_t io_tests = 0;
+	size_t io_passed = 0;
 
 	switch (test_what) {
 	case TEST_ALL:
@@ -133,9 +934,26 @@ int main(int argc, char *argv[])
 		vcb_tests = tests - dentry_tests;
 		vcb_passed = passed_tests - dentry_passed;
 		printf("\n");
+		test_fcb();
+		fcb_tests = tests - vcb_tests - dentry_tests;
+		fcb_passed = passed_tests - vcb_passed - dentry_passed;
+		printf("\n");
 		test_oft();
-		oft_tests = tests - vcb_tests - dentry_tests;
-		oft_passed = passed_tests - vcb_passed - dentry_passed;
+		oft_tests = tests - fcb_tests - vcb_tests - dentry_tests;
+		oft_passed =
+			passed_tests - fcb_passed - vcb_passed - dentry_passed;
+		printf("\n");
+		test_defrag();
+		defrag_tests = tests - oft_tests - fcb_tests - vcb_tests -
+			       dentry_tests;
+		defrag_passed = passed_tests - oft_passed - fcb_passed -
+				vcb_passed - dentry_passed;
+		printf("\n");
+		test_io();
+		io_tests = tests - defrag_tests - oft_tests - fcb_tests -
+			   vcb_tests - dentry_tests;
+		io_passed = passed_tests - defrag_passed - oft_passed -
+			    fcb_passed - vcb_passed - dentry_passed;
 		break;
 	case TEST_DENTRY:
 		printf("Running dentry tests...\n");
@@ -149,18 +967,39 @@ int main(int argc, char *argv[])
 		vcb_tests = tests;
 		vcb_passed = passed_tests;
 		break;
+	case TEST_FCB:
+		printf("Running fcb tests...\n");
+		test_fcb();
+		fcb_tests = tests;
+		fcb_passed = passed_tests;
+		break;
 	case TEST_OFT:
 		printf("Running oft tests...\n");
 		test_oft();
 		oft_tests = tests;
 		oft_passed = passed_tests;
 		break;
+	case TEST_DEFRAG:
+		printf("Running defrag tests...\n");
+		test_defrag();
+		defrag_tests = tests;
+		defrag_passed = passed_tests;
+		break;
+	case TEST_IO:
+		printf("Running io tests...\n");
+		test_io();
+		io_tests = tests;
+		io_passed = passed_tests;
+		break;
 	}
 
 	printf("\n=== TEST RESULTS ===\n");
 	printf("Dentry tests:    %lu/%lu\n", dentry_passed, dentry_tests);
 	printf("VCB tests:       %lu/%lu\n", vcb_passed, vcb_tests);
+	printf("FCB tests:       %lu/%lu\n", fcb_passed, fcb_tests);
 	printf("OFT tests:       %lu/%lu\n", oft_passed, oft_tests);
+	printf("Defrag tests:    %lu/%lu\n", defrag_passed, defrag_tests);
+	printf("IO tests:        %lu/%lu\n", io_passed, io_tests);
 	printf("Total tests:     %lu/%lu\n", passed_tests, tests);
 
 	return 0;
@@ -179,8 +1018,14 @@ void get_test(char *arg)
 		test_what = TEST_OFT;
 	} else if (strstr(arg, "vcb")) {
 		test_what = TEST_VCB;
+	} else if (strstr(arg, "fcb")) {
+		test_what = TEST_FCB;
+	} else if (strstr(arg, "defrag")) {
+		test_what = TEST_DEFRAG;
 	} else if (strstr(arg, "dentry")) {
 		test_what = TEST_DENTRY;
+	} else if (strstr(arg, "io")) {
+		test_what = TEST_IO;
 	} else {
 		test_what = TEST_ALL;
 	}
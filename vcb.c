@@ -1,34 +1,149 @@
 #include "vcb.h"
 
 #include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "bcache.h"
 #include "simple-fs.h"
 
-static int bm_get_idx(size_t block_num, size_t *idx);
+#define BM_WORD_BITS 64
 
-/* Initializes the VCB struct with the defined block size and block count.
+/* Free runs of the mounted volume, kept next to the bitmap so blocks can be
+ * allocated without searching for them. Every maximal run of free blocks has
+ * a node. Nodes sit in a treap ordered by start block, used to find the runs
+ * around a block and coalesce neighbors on free, and in one list per size
+ * class, where class c holds runs of 2^c to 2^(c+1) - 1 blocks. class_mask
+ * has bit c set when list c is not empty, so a class that satisfies a request
+ * is found with a single ctz. Every treap node also records the longest run
+ * below it, so the first run of a given length is found by walking down one
+ * path of the treap.
+ * Kept in sync by vcb_set_range_free(), so every bitmap change updates it.
+ * Rebuilt from the bitmap by vcb_init() and vcb_mount(), never stored on the
+ * volume.
+ */
+struct free_run {
+	size_t start;
+	size_t len;
+	// Longest run in the subtree rooted here
+	size_t best;
+	unsigned int prio;
+	struct free_run *left;
+	struct free_run *right;
+	struct free_run *prev;
+	struct free_run *next;
+};
+
+struct free_runs {
+	// The mounted VCB the runs index, NULL if none
+	struct vcb *vcb;
+	struct free_run *root;
+	struct free_run *classes[BM_WORD_BITS];
+	uint64_t class_mask;
+	// Unused nodes kept for reuse
+	struct free_run *spare;
+	unsigned int seed;
+};
+
+static struct free_runs runs;
+
+static int bm_get_idx(struct vcb *vcb, size_t block_num, size_t *idx);
+static size_t bm_words(size_t block_count);
+static uint16_t *vcb_refs(struct vcb *vcb);
+static size_t bm_next(struct vcb *vcb, size_t from, int free);
+static void runs_build(struct vcb *vcb);
+static void runs_clear();
+static void runs_mark_free(size_t start, size_t count);
+static void runs_mark_used(size_t start, size_t count);
+static struct free_run *run_new(size_t start, size_t len);
+static void run_del(struct free_run *run);
+static void run_resize(struct free_run *run, size_t start, size_t len);
+static struct free_run *run_le(size_t block);
+static struct free_run *run_gt(size_t block);
+static size_t run_best(struct free_run *run);
+static void run_pull(struct free_run *run);
+static void class_add(struct free_run *run);
+static void class_del(struct free_run *run);
+static void treap_insert(struct free_run **root, struct free_run *run);
+static void treap_erase(struct free_run **root, size_t start);
+static struct free_run *treap_merge(struct free_run *a, struct free_run *b);
+static void treap_update(struct free_run *root, size_t start);
+static void treap_free(struct free_run *root);
+
+/* Returns the number of bytes the VCB needs for a volume of block_count
+ * blocks, including the free block bitmap and the block reference counts.
+ * @param block_count: The number of blocks on the volume.
+ * @return: The size of the VCB in bytes.
+ */
+size_t vcb_size(size_t block_count)
+{
+	return sizeof(struct vcb) + bm_words(block_count) * sizeof(uint64_t) +
+	       block_count * sizeof(uint16_t);
+}
+
+/* Initializes the VCB struct with the given block size and block count.
  * Also initializes the free block bitmap to all 1s, indicating all blocks are
- * free.
+ * free, and builds the in-memory free run index. The blocks holding the VCB
+ * itself are not marked, the caller decides which blocks are reserved.
  * @param vcb: The VCB struct to initialize. Should be on the first block
  * of the "disk."
+ * @param block_size: The size of each block in bytes.
+ * @param block_count: The number of blocks on the volume.
  * @param alloc_bytes: The number of bytes allocated for the VCB. This will
  * allow the function to check if it has enough room for the bitmap.
- * @return: void
+ * @return: 0 on success, -1 if alloc_bytes is too small for the bitmap.
  */
-void vcb_init(struct vcb *vcb, size_t alloc_bytes)
+int vcb_init(struct vcb *vcb, size_t block_size, size_t block_count,
+	     size_t alloc_bytes)
 {
-	vcb->block_size = BLOCK_SIZE;
-	vcb->block_count = BLOCK_COUNT;
-	vcb->free_block_count = BLOCK_COUNT;
-
-	size_t num_bytes = BLOCK_COUNT / 8;
-	if (BLOCK_COUNT % 8 != 0)
-		++num_bytes;
 	// Prevents VCB from overflowing other buff
-	if (alloc_bytes < num_bytes + sizeof(struct vcb))
+	if (alloc_bytes < vcb_size(block_count))
+		return -1;
+
+	vcb->magic = VCB_MAGIC;
+	vcb->block_size = block_size;
+	vcb->block_count = block_count;
+	vcb->free_block_count = block_count;
+
+	// Nothing after the VCB yet
+	vcb->dentry_start = (vcb_size(block_count) + block_size - 1) / block_size;
+	vcb->dentry_blocks = 0;
+	vcb->data_start = vcb->dentry_start;
+
+	size_t full_words = block_count / BM_WORD_BITS;
+	memset(vcb->free_block_bm, 0xFF, full_words * sizeof(uint64_t));
+	// Padding past the end of the volume is never free
+	if (block_count % BM_WORD_BITS != 0)
+		vcb->free_block_bm[full_words] =
+			(1UL << (block_count % BM_WORD_BITS)) - 1;
+	memset(vcb_refs(vcb), 0, block_count * sizeof(uint16_t));
+	return vcb_mount(vcb);
+}
+
+/* Builds the in-memory state for a VCB already on the volume, such as one
+ * read back from a volume image. Must be called before blocks are allocated.
+ * @param vcb: The VCB struct of the mounted volume.
+ * @return: 0
+ */
+int vcb_mount(struct vcb *vcb)
+{
+	runs_clear();
+	runs.vcb = vcb;
+	runs_build(vcb);
+	return 0;
+}
+
+/* Frees the in-memory state built by vcb_init() or vcb_mount(). The VCB on
+ * the volume is not touched.
+ * @param vcb: The VCB struct of the mounted volume.
+ * @return: void
+ */
+void vcb_unmount(struct vcb *vcb)
+{
+	if (runs.vcb != vcb)
 		return;
-	memset(vcb->free_block_bm, 0xFFFF, num_bytes);
+	runs_clear();
 }
 
 /* Sets the block at block_num to free or not free in the VCB's free block
@@ -40,37 +155,251 @@ void vcb_init(struct vcb *vcb, size_t alloc_bytes)
  */
 void vcb_set_block_free(struct vcb *vcb, size_t block_num, int free)
 {
-	size_t idx;
-	if (bm_get_idx(block_num, &idx)) {
+	vcb_set_range_free(vcb, block_num, 1, free);
+}
+
+/* Sets count blocks starting at start to free or not free. Works a bitmap
+ * word at a time, so it is much cheaper than setting each block.
+ * Blocks past the end of the volume are ignored.
+ * @param vcb: The VCB struct to modify.
+ * @param start: The first block number to set.
+ * @param count: The number of blocks to set.
+ * @param free: 0 to set the blocks to not free, otherwise set to free.
+ * @return: void
+ */
+void vcb_set_range_free(struct vcb *vcb, size_t start, size_t count, int free)
+{
+	if (start >= vcb->block_count || count == 0)
 		return;
+	if (count > vcb->block_count - start)
+		count = vcb->block_count - start;
+	// A freed block can come back as metadata, cached copies of it must
+	// not be written over that
+	if (free)
+		bcache_discard(start, count);
+
+	if (runs.vcb == vcb) {
+		if (free)
+			runs_mark_free(start, count);
+		else
+			runs_mark_used(start, count);
 	}
 
-	int add_to_free = free ? 1 : -1;
-	vcb->free_block_count += add_to_free;
+	size_t end = start + count;
+	while (start < end) {
+		size_t idx = start / BM_WORD_BITS;
+		size_t bit = start % BM_WORD_BITS;
+		size_t n = BM_WORD_BITS - bit;
+		if (n > end - start)
+			n = end - start;
+		uint64_t mask = (n == BM_WORD_BITS) ? ~0UL :
+						      ((1UL << n) - 1) << bit;
 
-	char *byte = &vcb->free_block_bm[idx];
-	int bitnum = block_num % 8;
-	if (free)
-		*byte |= (1 << bitnum);
-	else
-		*byte &= ~(1 << bitnum);
+		uint64_t *word = &vcb->free_block_bm[idx];
+		// Only count blocks that actually change state
+		if (free) {
+			vcb->free_block_count +=
+				__builtin_popcountl(~*word & mask);
+			*word |= mask;
+		} else {
+			vcb->free_block_count -=
+				__builtin_popcountl(*word & mask);
+			*word &= ~mask;
+		}
+		start += n;
+	}
+}
+
+/* Allocates count contiguous blocks and marks them used. The run is taken
+ * from the free run lists instead of searched for: any run in a size class
+ * at or above count's class fits, so this is O(1) apart from the O(log n)
+ * bitmap and treap updates. Falls back to the runs of count's own class when
+ * no larger class has one.
+ * @param vcb: The VCB struct to allocate from. Must be the mounted VCB.
+ * @param count: The number of blocks needed.
+ * @param start: Set to the first block of the run.
+ * @return: 0 on success, -1 if there is no run of count free blocks.
+ */
+int vcb_alloc(struct vcb *vcb, size_t count, size_t *start)
+{
+	if (runs.vcb != vcb || count == 0)
+		return -1;
+
+	int cls = BM_WORD_BITS - 1 - __builtin_clzl(count);
+	// Every run in a class above count's own class is large enough
+	int fit_cls = (count & (count - 1)) ? cls + 1 : cls;
+	uint64_t mask = fit_cls < BM_WORD_BITS ? runs.class_mask >> fit_cls : 0;
+
+	struct free_run *run;
+	if (mask) {
+		run = runs.classes[fit_cls + __builtin_ctzl(mask)];
+	} else {
+		run = runs.classes[cls];
+		while (run != NULL && run->len < count)
+			run = run->next;
+		if (run == NULL)
+			return -1;
+	}
+	*start = run->start;
+	vcb_set_range_free(vcb, *start, count, 0);
+	return 0;
+}
+
+/* Allocates up to want contiguous blocks and marks them used. Takes want
+ * blocks when a run that large exists, otherwise the start of a run from the
+ * largest size class.
+ * @param vcb: The VCB struct to allocate from. Must be the mounted VCB.
+ * @param want: The number of blocks wanted.
+ * @param start: Set to the first block of the run.
+ * @param got: Set to the number of blocks allocated, between 1 and want.
+ * @return: 0 on success, -1 if no blocks are free.
+ */
+int vcb_alloc_upto(struct vcb *vcb, size_t want, size_t *start, size_t *got)
+{
+	if (vcb_alloc(vcb, want, start) == 0) {
+		*got = want;
+		return 0;
+	}
+	if (runs.vcb != vcb || want == 0 || runs.class_mask == 0)
+		return -1;
+
+	struct free_run *run =
+		runs.classes[BM_WORD_BITS - 1 - __builtin_clzl(runs.class_mask)];
+	*start = run->start;
+	*got = run->len < want ? run->len : want;
+	vcb_set_range_free(vcb, *start, *got, 0);
+	return 0;
+}
+
+/* Finds the first run of count free blocks on the volume. Walks down the free
+ * run treap, going left whenever the runs there are long enough, so it costs
+ * O(log n) in the number of free runs. The blocks are not marked used.
+ * @param vcb: The VCB struct to search. Must be the mounted VCB.
+ * @param count: The number of contiguous free blocks needed.
+ * @param start: Set to the first block of the run.
+ * @return: 0 if a run was found, -1 if there is no run of count free blocks.
+ */
+int vcb_find_free(struct vcb *vcb, size_t count, size_t *start)
+{
+	if (runs.vcb != vcb || count == 0 || run_best(runs.root) < count)
+		return -1;
+
+	struct free_run *run = runs.root;
+	for (;;) {
+		if (run_best(run->left) >= count)
+			run = run->left;
+		else if (run->len >= count)
+			break;
+		else
+			run = run->right;
+	}
+	*start = run->start;
+	return 0;
+}
+
+/* Returns the length of the run of free blocks starting at start. Used to
+ * check whether a file can grow in place.
+ * @param vcb: The VCB struct to check.
+ * @param start: The first block of the run.
+ * @param max: Stop counting after this many blocks.
+ * @return: The number of free blocks from start on, at most max.
+ */
+size_t vcb_free_run(struct vcb *vcb, size_t start, size_t max)
+{
+	size_t run = 0;
+	while (run < max && start + run < vcb->block_count) {
+		size_t pos = start + run;
+		uint64_t word = vcb->free_block_bm[pos / BM_WORD_BITS] >>
+				(pos % BM_WORD_BITS);
+		// Free blocks from pos to the end of the word
+		size_t in_word = ~word ? __builtin_ctzl(~word) :
+					 BM_WORD_BITS - pos % BM_WORD_BITS;
+		if (in_word > BM_WORD_BITS - pos % BM_WORD_BITS)
+			in_word = BM_WORD_BITS - pos % BM_WORD_BITS;
+		run += in_word;
+		if (pos % BM_WORD_BITS + in_word < BM_WORD_BITS)
+			break;
+	}
+	if (run > max)
+		run = max;
+	return run;
+}
+
+/* Adds a file to the owners of count used blocks starting at start, so they
+ * are shared with it. Nothing is changed if a block already has
+ * VCB_MAX_SHARERS owners.
+ * @param vcb: The VCB struct to modify.
+ * @param start: The first block of the run.
+ * @param count: The number of blocks.
+ * @return: 0 on success, -1 if a block cannot take another owner.
+ */
+int vcb_ref_range(struct vcb *vcb, size_t start, size_t count)
+{
+	uint16_t *refs = vcb_refs(vcb);
+	for (size_t i = start; i < start + count; ++i) {
+		if (refs[i] == VCB_MAX_SHARERS - 1)
+			return -1;
+	}
+	for (size_t i = start; i < start + count; ++i)
+		++refs[i];
+	return 0;
+}
+
+/* Drops a file from the owners of count blocks starting at start. Blocks it
+ * was the last owner of are freed.
+ * @param vcb: The VCB struct to modify.
+ * @param start: The first block of the run.
+ * @param count: The number of blocks.
+ * @return: void
+ */
+void vcb_put_range(struct vcb *vcb, size_t start, size_t count)
+{
+	uint16_t *refs = vcb_refs(vcb);
+	size_t end = start + count;
+	while (start < end) {
+		if (refs[start] != 0) {
+			--refs[start++];
+			continue;
+		}
+		// Free the whole run of unshared blocks at once
+		size_t run = 1;
+		while (start + run < end && refs[start + run] == 0)
+			++run;
+		vcb_set_range_free(vcb, start, run, 1);
+		start += run;
+	}
+}
+
+/* Returns whether any of count blocks starting at start has more than one
+ * owner.
+ * @param vcb: The VCB struct to check.
+ * @param start: The first block of the run.
+ * @param count: The number of blocks.
+ * @return: Non-zero if a block is shared, 0 otherwise.
+ */
+int vcb_range_shared(struct vcb *vcb, size_t start, size_t count)
+{
+	uint16_t *refs = vcb_refs(vcb);
+	for (size_t i = start; i < start + count; ++i) {
+		if (refs[i] != 0)
+			return 1;
+	}
+	return 0;
 }
 
 /* Returns whether the block at block_num is free or not.
  * @param vcb: The VCB struct to check.
  * @param block_num: The block number to check.
- * @return: -1 if the VCB is not initialized, 0 if the block is not free,
- * non-zero if the block is free.
+ * @return: -1 if the block number is out of range, 0 if the block is not
+ * free, non-zero if the block is free.
  */
 int vcb_get_block_free(struct vcb *vcb, size_t block_num)
 {
-	int free;
 	size_t idx;
-	if (bm_get_idx(block_num, &idx)) {
+	if (bm_get_idx(vcb, block_num, &idx)) {
 		return -1;
 	}
-	free = vcb->free_block_bm[idx] & (1 << ((block_num) % 8));
-	return free;
+	return (vcb->free_block_bm[idx] >> (block_num % BM_WORD_BITS)) & 1;
 }
 
 /* Returns the number of free blocks in the VCB.
@@ -84,42 +413,413 @@ size_t vcb_free_block_count(struct vcb *vcb)
 	return cnt;
 }
 
-/* Grabs a word (8 bytes) from the free block bitmap. This function is used
- * for efficient finding when finding a set of free blocks for allocation.
+/* Grabs a word (64 blocks) from the free block bitmap.
  * @param vcb: The VCB struct to get the word from.
- * @param idx: The byte index to start from. 0 grabs first 8 bytes, 1 grabs
- * the next 8 bytes, and so on.
+ * @param idx: The word index. 0 grabs blocks 0-63, 1 grabs blocks 64-127,
+ * and so on.
  * @param word: The word to set. The function sets this value.
- * @return: The number of bytes set in the word.
+ * @return: The number of blocks of the volume covered by the word, 0 if idx is
+ * out of range.
  */
-size_t vcb_get_bm_word(struct vcb *vcb, size_t idx, unsigned long *word)
+size_t vcb_get_bm_word(struct vcb *vcb, size_t idx, uint64_t *word)
 {
-	size_t max_idx = BLOCK_COUNT / 8;
-	if (BLOCK_COUNT % 8 != 0)
-		++max_idx;
 	*word = 0;
-	int i;
-	for (i = 0; i < 8 && i < max_idx; ++i) {
-		unsigned long byte = vcb->free_block_bm[idx + i];
-		byte &= 0xFF;
-		*word |= byte << (i * 8);
-	}
-	return i;
+	if (idx >= bm_words(vcb->block_count))
+		return 0;
+	*word = vcb->free_block_bm[idx];
+	size_t left = vcb->block_count - idx * BM_WORD_BITS;
+	return left < BM_WORD_BITS ? left : BM_WORD_BITS;
 }
 
 /* Gets the index for accessing the VCB's free block bitmap.
  * Checks if the block number is within the range of the bitmap.
+ * @param vcb: The VCB struct the bitmap belongs to.
  * @param block_num: The block number to get the index for.
- * @param idx: The index to set.
+ * @param idx: The word index to set.
  * @return: a non-zero value if the block number is out of range, 0 otherwise.
  */
-static int bm_get_idx(size_t block_num, size_t *idx)
+static int bm_get_idx(struct vcb *vcb, size_t block_num, size_t *idx)
 {
-	size_t max_idx = BLOCK_COUNT / 8;
-	if (BLOCK_COUNT % 8 != 0)
-		++max_idx;
-	*idx = block_num / 8;
-	if (*idx > max_idx)
+	if (block_num >= vcb->block_count)
 		return -1;
+	*idx = block_num / BM_WORD_BITS;
 	return 0;
 }
+
+/* Returns the number of 64 bit words in the free block bitmap.
+ * @param block_count: The number of blocks on the volume.
+ * @return: The number of words.
+ */
+static size_t bm_words(size_t block_count)
+{
+	return (block_count + BM_WORD_BITS - 1) / BM_WORD_BITS;
+}
+
+/* Returns the block reference counts, stored right after the bitmap.
+ * @param vcb: The VCB struct.
+ * @return: The reference count array, one entry per block.
+ */
+static uint16_t *vcb_refs(struct vcb *vcb)
+{
+	return (uint16_t *)(vcb->free_block_bm + bm_words(vcb->block_count));
+}
+
+/* Finds the next block whose free bit matches free. Skips whole words.
+ * @param vcb: The VCB struct to search.
+ * @param from: The block to start at.
+ * @param free: Non-zero to look for a free block, 0 for a used one.
+ * @return: The block number, or the block count if there is none.
+ */
+static size_t bm_next(struct vcb *vcb, size_t from, int free)
+{
+	while (from < vcb->block_count) {
+		uint64_t word = vcb->free_block_bm[from / BM_WORD_BITS];
+		if (!free)
+			word = ~word;
+		word >>= from % BM_WORD_BITS;
+		if (word) {
+			from += __builtin_ctzl(word);
+			break;
+		}
+		from = (from / BM_WORD_BITS + 1) * BM_WORD_BITS;
+	}
+	return from < vcb->block_count ? from : vcb->block_count;
+}
+
+/* Builds the free run index from the bitmap of a VCB.
+ * @param vcb: The VCB struct to index.
+ * @return: void
+ */
+static void runs_build(struct vcb *vcb)
+{
+	size_t block = bm_next(vcb, 0, 1);
+	while (block < vcb->block_count) {
+		size_t end = bm_next(vcb, block, 0);
+		run_new(block, end - block);
+		block = bm_next(vcb, end, 1);
+	}
+}
+
+/* Drops every run of the free run index, which then indexes no VCB. Nodes
+ * are freed, not kept.
+ * @return: void
+ */
+static void runs_clear()
+{
+	treap_free(runs.root);
+	while (runs.spare != NULL) {
+		struct free_run *next = runs.spare->next;
+		free(runs.spare);
+		runs.spare = next;
+	}
+	memset(&runs, 0, sizeof(runs));
+}
+
+/* Records that blocks became free. The blocks are merged with every run they
+ * touch or overlap, so neighboring runs coalesce into one.
+ * @param start: The first block freed.
+ * @param count: The number of blocks freed.
+ * @return: void
+ */
+static void runs_mark_free(size_t start, size_t count)
+{
+	size_t end = start + count;
+	struct free_run *run = run_le(start);
+	if (run != NULL && run->start + run->len >= start) {
+		// Touches or overlaps the run on the left
+		if (run->start + run->len > end)
+			end = run->start + run->len;
+		start = run->start;
+		run_del(run);
+	}
+	while ((run = run_gt(start)) != NULL && run->start <= end) {
+		if (run->start + run->len > end)
+			end = run->start + run->len;
+		run_del(run);
+	}
+	run_new(start, end - start);
+}
+
+/* Records that blocks became used. Runs overlapping the blocks are trimmed,
+ * split or dropped.
+ * @param start: The first block used.
+ * @param count: The number of blocks used.
+ * @return: void
+ */
+static void runs_mark_used(size_t start, size_t count)
+{
+	size_t end = start + count;
+	struct free_run *run = run_le(start);
+	if (run == NULL || run->start + run->len <= start)
+		run = run_gt(start);
+	while (run != NULL && run->start < end) {
+		struct free_run *next = run_gt(run->start);
+		size_t run_end = run->start + run->len;
+		if (run->start < start) {
+			run_resize(run, run->start, start - run->start);
+			if (run_end > end)
+				run_new(end, run_end - end);
+		} else if (run_end > end) {
+			// Still sorts between the same neighbors
+			run_resize(run, end, run_end - end);
+		} else {
+			run_del(run);
+		}
+		run = next;
+	}
+}
+
+/* Adds a free run to the treap and its size class list.
+ * @param start: The first block of the run.
+ * @param len: The number of blocks in the run.
+ * @return: The new run.
+ */
+static struct free_run *run_new(size_t start, size_t len)
+{
+	struct free_run *run = runs.spare;
+	if (run != NULL) {
+		runs.spare = run->next;
+	} else {
+		run = malloc(sizeof(struct free_run));
+		if (run == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+	// xorshift, only needs to be random enough to balance the treap
+	runs.seed ^= runs.seed << 13;
+	runs.seed ^= runs.seed >> 17;
+	runs.seed ^= runs.seed << 5;
+	if (runs.seed == 0)
+		runs.seed = 2463534242U;
+
+	run->start = start;
+	run->len = len;
+	run->prio = runs.seed;
+	run->left = run->right = NULL;
+	treap_insert(&runs.root, run);
+	class_add(run);
+	return run;
+}
+
+/* Removes a free run from the index. The node is kept for reuse.
+ * @param run: The run to remove.
+ * @return: void
+ */
+static void run_del(struct free_run *run)
+{
+	class_del(run);
+	treap_erase(&runs.root, run->start);
+	run->next = runs.spare;
+	runs.spare = run;
+}
+
+/* Changes the blocks of a run. The new start must not move the run past a
+ * neighbor, so its place in the treap stays valid.
+ * @param run: The run to change.
+ * @param start: The new first block.
+ * @param len: The new number of blocks.
+ * @return: void
+ */
+static void run_resize(struct free_run *run, size_t start, size_t len)
+{
+	class_del(run);
+	run->start = start;
+	run->len = len;
+	class_add(run);
+	treap_update(runs.root, start);
+}
+
+/* Finds the run with the largest start at or before a block.
+ * @param block: The block number.
+ * @return: The run, or NULL if every run starts after block.
+ */
+static struct free_run *run_le(size_t block)
+{
+	struct free_run *best = NULL;
+	struct free_run *node = runs.root;
+	while (node != NULL) {
+		if (node->start <= block) {
+			best = node;
+			node = node->right;
+		} else {
+			node = node->left;
+		}
+	}
+	return best;
+}
+
+/* Finds the run with the smallest start after a block.
+ * @param block: The block number.
+ * @return: The run, or NULL if no run starts after block.
+ */
+static struct free_run *run_gt(size_t block)
+{
+	struct free_run *best = NULL;
+	struct free_run *node = runs.root;
+	while (node != NULL) {
+		if (node->start > block) {
+			best = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return best;
+}
+
+/* Returns the longest run in a subtree of the treap.
+ * @param run: The root of the subtree, may be NULL.
+ * @return: The number of blocks, 0 for an empty subtree.
+ */
+static size_t run_best(struct free_run *run)
+{
+	return run != NULL ? run->best : 0;
+}
+
+/* Recomputes the longest run below a treap node from its children.
+ * @param run: The node.
+ * @return: void
+ */
+static void run_pull(struct free_run *run)
+{
+	run->best = run->len;
+	if (run_best(run->left) > run->best)
+		run->best = run->left->best;
+	if (run_best(run->right) > run->best)
+		run->best = run->right->best;
+}
+
+/* Pushes a run on the list of its size class.
+ * @param run: The run to add.
+ * @return: void
+ */
+static void class_add(struct free_run *run)
+{
+	int cls = BM_WORD_BITS - 1 - __builtin_clzl(run->len);
+	run->prev = NULL;
+	run->next = runs.classes[cls];
+	if (run->next != NULL)
+		run->next->prev = run;
+	runs.classes[cls] = run;
+	runs.class_mask |= 1UL << cls;
+}
+
+/* Unlinks a run from the list of its size class.
+ * @param run: The run to remove.
+ * @return: void
+ */
+static void class_del(struct free_run *run)
+{
+	int cls = BM_WORD_BITS - 1 - __builtin_clzl(run->len);
+	if (run->prev != NULL)
+		run->prev->next = run->next;
+	else
+		runs.classes[cls] = run->next;
+	if (run->next != NULL)
+		run->next->prev = run->prev;
+	if (runs.classes[cls] == NULL)
+		runs.class_mask &= ~(1UL << cls);
+}
+
+/* Inserts a run into a treap, rotating it up while its priority is higher
+ * than its parent's.
+ * @param root: The root of the treap.
+ * @param run: The run to insert.
+ * @return: void
+ */
+static void treap_insert(struct free_run **root, struct free_run *run)
+{
+	struct free_run *node = *root;
+	if (node == NULL) {
+		run->best = run->len;
+		*root = run;
+		return;
+	}
+	if (run->start < node->start) {
+		treap_insert(&node->left, run);
+		if (node->left->prio > node->prio) {
+			*root = node->left;
+			node->left = (*root)->right;
+			(*root)->right = node;
+		}
+	} else {
+		treap_insert(&node->right, run);
+		if (node->right->prio > node->prio) {
+			*root = node->right;
+			node->right = (*root)->left;
+			(*root)->left = node;
+		}
+	}
+	// A rotation moved node below the new root
+	run_pull(node);
+	if (*root != node)
+		run_pull(*root);
+}
+
+/* Removes the run starting at start from a treap.
+ * @param root: The root of the treap.
+ * @param start: The first block of the run. Must be in the treap.
+ * @return: void
+ */
+static void treap_erase(struct free_run **root, size_t start)
+{
+	struct free_run *node = *root;
+	if (node->start == start) {
+		*root = treap_merge(node->left, node->right);
+		return;
+	}
+	if (start < node->start)
+		treap_erase(&node->left, start);
+	else
+		treap_erase(&node->right, start);
+	run_pull(node);
+}
+
+/* Joins two treaps where every run of a starts before every run of b.
+ * @param a: The treap with the lower blocks.
+ * @param b: The treap with the higher blocks.
+ * @return: The root of the joined treap.
+ */
+static struct free_run *treap_merge(struct free_run *a, struct free_run *b)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (a->prio > b->prio) {
+		a->right = treap_merge(a->right, b);
+		run_pull(a);
+		return a;
+	}
+	b->left = treap_merge(a, b->left);
+	run_pull(b);
+	return b;
+}
+
+/* Recomputes the longest runs on the path to a run whose length changed.
+ * @param root: The root of the treap.
+ * @param start: The first block of the run. Must be in the treap.
+ * @return: void
+ */
+static void treap_update(struct free_run *root, size_t start)
+{
+	if (start < root->start)
+		treap_update(root->left, start);
+	else if (start > root->start)
+		treap_update(root->right, start);
+	run_pull(root);
+}
+
+/* Frees every node of a treap.
+ * @param root: The root of the treap.
+ * @return: void
+ */
+static void treap_free(struct free_run *root)
+{
+	if (root == NULL)
+		return;
+	treap_free(root->left);
+	treap_free(root->right);
+	free(root);
+}
@@ -4,25 +4,69 @@
 #include <stdint.h>
 #include <stddef.h>
 
+// Marks block 0 as a formatted simple-fs volume ("SFSVOL08"). The number is
+// bumped when the on-volume layout changes, so old images are not mounted.
+// The layout includes the FCB at the start of every file (fcb.h).
+// SFSVOL01 was kept when the VCB gained its geometry and layout fields and
+// when FCBs switched to extents, so that number stands for more than one
+// layout and is never reused.
+#define VCB_MAGIC 0x38304c4f56534653UL
+
+// Most files that can share a block
+#define VCB_MAX_SHARERS 0x10000UL
+
 // Volume control block. Details the state of the file system.
-// Should be on block 0 of the file system.
+// Starts on block 0 of the file system. The bitmap may run past block 0, the
+// VCB takes as many blocks as it needs (see vcb_size()). Any change to this
+// struct changes the volume format and needs a new VCB_MAGIC.
 struct vcb {
+  size_t magic;
   size_t block_size;
   size_t block_count;
   size_t free_block_count;
 
-  // Block bitmap just takes rest of the block
-  char free_block_bm[];
+  // Layout of the volume after the VCB's own blocks
+  size_t dentry_start;
+  size_t dentry_blocks;
+  size_t data_start;
+
+  // Block bitmap. 1 bit per block, block n is bit n % 64 of word n / 64.
+  // Followed by a uint16_t per block counting the files that share it beyond
+  // the first, 0 for blocks owned by one file and for free blocks.
+  uint64_t free_block_bm[];
 };
 
-void vcb_init(struct vcb *vcb, size_t alloc_bytes);
+size_t vcb_size(size_t block_count);
+
+int vcb_init(struct vcb *vcb, size_t block_size, size_t block_count,
+	     size_t alloc_bytes);
+
+int vcb_mount(struct vcb *vcb);
+
+void vcb_unmount(struct vcb *vcb);
 
 void vcb_set_block_free(struct vcb *vcb, size_t block_num, int free);
 
+void vcb_set_range_free(struct vcb *vcb, size_t start, size_t count, int free);
+
+int vcb_alloc(struct vcb *vcb, size_t count, size_t *start);
+
+int vcb_alloc_upto(struct vcb *vcb, size_t want, size_t *start, size_t *got);
+
+int vcb_find_free(struct vcb *vcb, size_t count, size_t *start);
+
+size_t vcb_free_run(struct vcb *vcb, size_t start, size_t max);
+
 int vcb_get_block_free(struct vcb *vcb, size_t block_num);
 
 size_t vcb_free_block_count(struct vcb *vcb);
 
-size_t vcb_get_bm_word(struct vcb *vcb, size_t idx, unsigned long *word);
+int vcb_ref_range(struct vcb *vcb, size_t start, size_t count);
+
+void vcb_put_range(struct vcb *vcb, size_t start, size_t count);
+
+int vcb_range_shared(struct vcb *vcb, size_t start, size_t count);
+
+size_t vcb_get_bm_word(struct vcb *vcb, size_t idx, uint64_t *word);
 
 #endif // SIMPLE_FS_VCB_H
@@ -0,0 +1,172 @@
+// For syscall, fileno and mmap
+#define _GNU_SOURCE
+
+#include "volume.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Maps a volume image file into memory. An image that does not exist or is
+ * empty is created with zeroes and *size bytes. An existing image is mapped
+ * whole and never resized. The mapping is shared so stores into it reach the
+ * file.
+ * Note: simple-fs defines its own open(), close(), ftruncate(), pread() and
+ * pwrite(), so the image is opened through stdio and sized with the raw
+ * system call instead of the POSIX calls. The functions below use raw system
+ * calls for the same reason.
+ * @param path: Path of the image file.
+ * @param size: Size in bytes of a new image. Set to the size of the mapping.
+ * @param created: Set to 1 if the image was created, meaning the volume has
+ * to be formatted. Set to 0 otherwise.
+ * @return: The address of the mapping, or NULL if the image could not be
+ * mapped.
+ */
+void *volume_map(const char *path, size_t *size, int *created)
+{
+	*created = 0;
+	FILE *image = fopen(path, "r+b");
+	if (image == NULL) {
+		image = fopen(path, "w+b");
+		if (image == NULL) {
+			perror("fopen");
+			return NULL;
+		}
+	}
+	int fd = fileno(image);
+
+	struct stat st;
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		fclose(image);
+		return NULL;
+	}
+	if (st.st_size == 0) {
+		if (syscall(SYS_ftruncate, fd, (off_t)*size)) {
+			perror("ftruncate");
+			fclose(image);
+			return NULL;
+		}
+		*created = 1;
+	} else {
+		*size = st.st_size;
+	}
+
+	void *addr =
+		mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	// The mapping keeps its own reference to the file
+	fclose(image);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	return addr;
+}
+
+/* Flushes a mapped volume back to its image file. Blocks until the data
+ * reaches the file.
+ * @param addr: Address returned by volume_map().
+ * @param size: Size of the volume in bytes.
+ * @return: 0 on success, -1 if the volume could not be flushed.
+ */
+int volume_sync(void *addr, size_t size)
+{
+	if (msync(addr, size, MS_SYNC)) {
+		perror("msync");
+		return -1;
+	}
+	return 0;
+}
+
+/* Unmaps a volume. Dirty pages are still written back by the kernel, call
+ * volume_sync() first to wait for them.
+ * @param addr: Address returned by volume_map().
+ * @param size: Size of the volume in bytes.
+ * @return: void
+ */
+void volume_unmap(void *addr, size_t size)
+{
+	munmap(addr, size);
+}
+
+/* Opens a volume image file for volume_read() and volume_write(). The image
+ * must exist already, volume_map() creates it.
+ * @param path: Path of the image file.
+ * @return: The file descriptor, or -1 if the image could not be opened.
+ */
+int volume_open(const char *path)
+{
+	int fd = syscall(SYS_openat, AT_FDCWD, path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	return fd;
+}
+
+/* Reads part of a volume image file. Short reads are retried.
+ * @param fd: File descriptor returned by volume_open().
+ * @param buf: The buffer to read into.
+ * @param len: The number of bytes to read.
+ * @param offset: The offset in the image to read from.
+ * @return: 0 on success, -1 with errno set if the bytes could not be read.
+ * Nothing is printed, callers turn this into a short read.
+ */
+int volume_read(int fd, void *buf, size_t len, size_t offset)
+{
+	while (len > 0) {
+		ssize_t n = syscall(SYS_pread64, fd, buf, len, (off_t)offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			// Past the end of the image
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/* Writes part of a volume image file. Short writes are retried.
+ * @param fd: File descriptor returned by volume_open().
+ * @param buf: The bytes to write.
+ * @param len: The number of bytes to write.
+ * @param offset: The offset in the image to write to.
+ * @return: 0 on success, -1 with errno set if the bytes could not be
+ * written. Nothing is printed, the block cache keeps the bytes dirty.
+ */
+int volume_write(int fd, const void *buf, size_t len, size_t offset)
+{
+	while (len > 0) {
+		ssize_t n = syscall(SYS_pwrite64, fd, buf, len, (off_t)offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			// Past the end of the image
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/* Closes a file descriptor returned by volume_open().
+ * @param fd: The file descriptor.
+ * @return: void
+ */
+void volume_close(int fd)
+{
+	syscall(SYS_close, fd);
+}
@@ -0,0 +1,20 @@
+#ifndef SIMPLE_FS_VOLUME_H
+#define SIMPLE_FS_VOLUME_H
+
+#include <stddef.h>
+
+void *volume_map(const char *path, size_t *size, int *created);
+
+int volume_sync(void *addr, size_t size);
+
+void volume_unmap(void *addr, size_t size);
+
+int volume_open(const char *path);
+
+int volume_read(int fd, void *buf, size_t len, size_t offset);
+
+int volume_write(int fd, const void *buf, size_t len, size_t offset);
+
+void volume_close(int fd);
+
+#endif // SIMPLE_FS_VOLUME_H